@@ -25,21 +25,326 @@
 // #include "ink_file.h"
 // #include "I_Version.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
-#include <set>
-#include <sstream>
+#include <limits>
+#include <list>
+#include <memory_resource>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sysexits.h>
-
-std::string global_usage;
-std::string parser_program_name;
-std::string default_command;
-
-// by default return EX_USAGE(64) when usage is called.
-// if -h or --help is called specifically, return 0
-int usage_return_code = EX_USAGE;
+#include <unistd.h>
 
 namespace ts
 {
+namespace
+{
+  // The schema compiled by ArgParser::compile(), owning the flat arrays and the strings they point into, but the ones of
+  // its base
+  struct OwnedSchema : Schema {
+    std::string_view
+    intern(std::string const &s)
+    {
+      if (s.empty()) {
+        return {};
+      }
+      char *p = static_cast<char *>(strings.allocate(s.size(), 1));
+      memcpy(p, s.data(), s.size());
+      return {p, s.size()};
+    }
+
+    std::pmr::monotonic_buffer_resource strings;
+    std::vector<SchemaCommand> command_list;
+    std::vector<SchemaOption> option_list;
+    std::vector<SchemaSlot> slot_list;
+    std::vector<std::string_view> key_list;
+    std::vector<SchemaSlot> key_slot_list;
+    std::vector<std::string_view> envvar_list;
+    std::vector<std::string_view> default_list;
+    std::vector<SchemaConstraint> constraint_list;
+    std::vector<uint64_t> mask_list;
+    std::vector<std::function<void()>> actions;
+    // the command each of command_list is compiled from, for ArgParser::build()
+    std::vector<ArgParser::Command const *> sources;
+    // the schema this one extends with a lazy command once built, whose strings and functions it points into
+    std::shared_ptr<const Schema> base;
+  };
+
+  // The classes of the characters of a response file, looked up to scan a plain argument a character at a time
+  enum : unsigned char { PLAIN, SPACE, QUOTING };
+  constexpr std::array<unsigned char, 256> response_classes = []() {
+    std::array<unsigned char, 256> classes{};
+    for (unsigned char c : {' ', '\t', '\n', '\r', '\f', '\v'}) {
+      classes[c] = SPACE;
+    }
+    for (unsigned char c : {'\'', '"', '\\'}) {
+      classes[c] = QUOTING;
+    }
+    return classes;
+  }();
+
+  // The end of the plain characters of a response file from text[pos], tested 8 at a time
+  size_t
+  plain_end(std::string_view text, size_t pos)
+  {
+    constexpr uint64_t ones  = 0x0101010101010101ull;
+    constexpr uint64_t highs = 0x8080808080808080ull;
+    // nonzero if a byte of x is below n
+    auto below = [](uint64_t x, uint64_t n) { return (x - ones * n) & ~x & highs; };
+    while (pos + 8 <= text.size()) {
+      uint64_t x;
+      memcpy(&x, text.data() + pos, 8);
+      // white space or another control character, a quote or a backslash
+      if (below(x, '!') || below(x ^ (ones * '"'), 1) || below(x ^ (ones * '\''), 1) || below(x ^ (ones * '\\'), 1)) {
+        break;
+      }
+      pos += 8;
+    }
+    while (pos < text.size() && response_classes[static_cast<unsigned char>(text[pos])] == PLAIN) {
+      pos++;
+    }
+    return pos;
+  }
+
+  // Scan the argument of a response file starting at text[pos] up to the white space after it, unquoted into out
+  // if not nullptr. Return the size of the argument.
+  size_t
+  scan_quoted(std::string_view text, size_t &pos, char *out)
+  {
+    size_t size = 0;
+    char quote  = 0;
+    auto put    = [&](char c) {
+      if (out) {
+        out[size] = c;
+      }
+      size++;
+    };
+    for (; pos < text.size(); pos++) {
+      char c = text[pos];
+      if (quote == '\'') {
+        // everything is literal up to the closing quote
+        if (c == '\'') {
+          quote = 0;
+        } else {
+          put(c);
+        }
+      } else if (quote == '"') {
+        if (c == '"') {
+          quote = 0;
+        } else if (c == '\\' && pos + 1 < text.size() && (text[pos + 1] == '"' || text[pos + 1] == '\\')) {
+          put(text[++pos]);
+        } else {
+          put(c);
+        }
+      } else if (response_classes[static_cast<unsigned char>(c)] == SPACE) {
+        break;
+      } else if (c == '\'' || c == '"') {
+        quote = c;
+      } else if (c == '\\' && pos + 1 < text.size()) {
+        put(text[++pos]);
+      } else {
+        put(c);
+      }
+    }
+    return size;
+  }
+
+  /** Split the contents of a response file, or a line of a batch, into arguments, into out if not nullptr, and return their number.
+      A plain argument is a view into text, one with quotes or escapes is unquoted into arena.
+  */
+  size_t
+  split_response_file(std::string_view text, std::string_view *out, std::pmr::memory_resource *arena)
+  {
+    size_t count = 0;
+    size_t pos   = 0;
+    while (true) {
+      while (pos < text.size() && response_classes[static_cast<unsigned char>(text[pos])] == SPACE) {
+        pos++;
+      }
+      if (pos == text.size()) {
+        return count;
+      }
+      size_t start = pos;
+      pos          = plain_end(text, pos);
+      if (pos < text.size() && response_classes[static_cast<unsigned char>(text[pos])] == QUOTING) {
+        // quotes or escapes, at most as long unquoted
+        pos = start;
+        if (out) {
+          size_t end = pos;
+          scan_quoted(text, end, nullptr);
+          char *arg  = static_cast<char *>(arena->allocate(end - start, 1));
+          out[count] = {arg, scan_quoted(text, pos, arg)};
+        } else {
+          scan_quoted(text, pos, nullptr);
+        }
+      } else if (out) {
+        out[count] = text.substr(start, pos - start);
+      }
+      count++;
+    }
+  }
+
+  // Map a file in memory, nullptr if it cannot be read. An empty file is an empty string.
+  std::shared_ptr<const char>
+  map_file(const char *path, size_t &size)
+  {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      return nullptr;
+    }
+    size = st.st_size;
+    if (size == 0) {
+      close(fd);
+      return std::shared_ptr<const char>(std::shared_ptr<const char>(), "");
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // all of it is read at once
+    flags |= MAP_POPULATE;
+#endif
+    void *data = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    return std::shared_ptr<const char>(static_cast<const char *>(data),
+                                       [size](const char *p) { munmap(const_cast<char *>(p), size); });
+  }
+} // namespace
+
+// argv is walked exactly once from left to right. The commands entered so far form a chain from the top
+// level command down to the current one. An option can be given anywhere after the command it belongs to,
+// and the options of outer commands take precedence, so while the arguments of an option or command are
+// taken, the options of the outer commands are still recognized in between.
+struct ArgParser::ParseState {
+  ParseState(Arguments &r, std::string_view const *v, unsigned c, bool cp)
+    : schema(*r._schema), ret(r), argv(v), argc(c), copy(cp)
+  {
+    env.resize(schema.envvar_count);
+  }
+
+  // walk argv, optionally with a default command right after the program name
+  void run(SchemaCommand const *default_cmd);
+  // checks and default values once argv is exhausted
+  void finish();
+  // check the number of arguments of the options given as --arg=value
+  void check_counts();
+  // check the constraints between the options given of the commands called
+  void check_constraints();
+  // the long options of the bitset of the options masked by a constraint, with the ones of `given` only if set
+  std::string constraint_options(SchemaConstraint const &constraint, bool given, bool set) const;
+  // walk the options of argv only, on top of the data parsed before, see ArgParser::apply()
+  void apply();
+  // keep the data of an option given to apply() the first time, then reset it
+  void touch(SchemaCommand const &owner, SchemaOption const &option);
+  // record the command as called and take its arguments
+  void enter(SchemaCommand const &cmd);
+  // handle the option at the cursor if it belongs to one of the first `limit` commands of the chain
+  bool consume_option(unsigned limit);
+  // the only option of the first `limit` commands of the chain starting with name, see allow_abbreviations()
+  SchemaOption const *abbreviated_option(std::string_view name, unsigned limit, unsigned &level);
+  // the only subcommand of the last command of the chain starting with name
+  SchemaCommand const *abbreviated_command(std::string_view name);
+  // take the arguments expected by an option or command, stored with the look-up key `id`
+  void take_args(SchemaCommand const &owner, std::string_view key, unsigned id, unsigned arg_num, unsigned limit);
+  // add argv[cursor] to the runs of the values of a variadic option
+  void add_run(ArgumentData &value, std::string_view const *arg);
+  // convert the values of a typed option of `owner`, see ArgParser::Command::add_typed_option()
+  void convert(SchemaCommand const &owner, SchemaOption const &option);
+  // the index of the argument a value is part of, argc for a default value
+  unsigned
+  token(std::string_view value) const
+  {
+    for (unsigned i = 1; i < argc; i++) {
+      if (value.data() >= argv[i].data() && value.data() < argv[i].data() + argv[i].size()) {
+        return i;
+      }
+    }
+    return argc;
+  }
+  // remember the first error, at argv[token] and reported with the help message of `cmd`
+  void fail(SchemaCommand const &cmd, ParseError::Kind kind, unsigned token, std::string const &msg);
+  // the parsed data of the look-up key, marked as called
+  ArgumentData &data(unsigned id);
+  // the name and look-up key of a command, the top level command is named after the program
+  std::string_view name(SchemaCommand const &cmd) const { return &cmd == schema.commands ? program : cmd.name; }
+  std::string_view key(SchemaCommand const &cmd) const { return &cmd == schema.commands ? program : cmd.key; }
+  // the view of a string that is neither in argv nor owned by ret
+  std::string_view keep(std::string_view s) { return copy ? ret.own(s) : s; }
+  // the value of an environment variable of the schema, looked up the first time only
+  std::string_view
+  env_value(unsigned env_id)
+  {
+    std::string_view &value = env[env_id];
+    if (!value.data()) {
+      const char *found = getenv(std::pmr::string(schema.envvars[env_id], &scratch).c_str());
+      value             = found ? keep(found) : std::string_view("", 0);
+    }
+    return value;
+  }
+  bool ok() const { return err_kind == ParseError::NONE && !unbuilt; }
+
+  // the bookkeeping of the parse is allocated on the stack, unless argv is huge
+  char scratch_buffer[2048];
+  std::pmr::monotonic_buffer_resource scratch{scratch_buffer, sizeof(scratch_buffer)};
+
+  Schema const &schema;
+  Arguments &ret;
+  std::string_view const *argv;
+  unsigned argc;
+  // whether the values have to be owned by ret, argv is then already a copy owned by ret
+  bool copy;
+  std::string_view program;
+  unsigned cursor = 1;
+  // commands entered so far, the top level command first
+  std::pmr::vector<SchemaCommand const *> chain{&scratch};
+  // the values of the environment variables by index, nullptr if not looked up yet
+  std::pmr::vector<std::string_view> env{&scratch};
+  // the options given as --arg=value
+  struct EqCount {
+    // the command the option belongs to
+    SchemaCommand const *command;
+    // number of times the option is given, the last one at argv[token]
+    unsigned count;
+    unsigned token;
+  };
+  std::pmr::map<SchemaOption const *, EqCount> eq_count{&scratch};
+  // arguments that are neither a command, an option nor an argument of one, the first at argv[unknown_token]
+  AP_ViewVec unknown{&scratch};
+  unsigned unknown_token = 0;
+  // the options given to apply(), with their data before
+  struct Touched {
+    SchemaCommand const *owner;
+    SchemaOption const *option;
+    ArgumentData before;
+    // whether the option was given before, with constraints
+    bool given;
+  };
+  std::pmr::vector<Touched> touched{&scratch};
+  bool delta                       = false;
+  // the lazy command entered, which stops the walk until it is built
+  SchemaCommand const *unbuilt     = nullptr;
+  ParseError::Kind err_kind        = ParseError::NONE;
+  unsigned err_token               = 0;
+  SchemaCommand const *err_command = nullptr;
+  std::string err;
+};
+
 ArgParser::ArgParser() {}
 
 ArgParser::ArgParser(std::string const &name, std::string const &description, std::string const &envvar, unsigned arg_num,
@@ -49,6 +354,14 @@ ArgParser::ArgParser(std::string const &name, std::string const &description, st
   _top_level_command = ArgParser::Command(name, description, envvar, arg_num, f);
 }
 
+ArgParser::ArgParser(Schema const &schema)
+{
+  // the schema is not owned, so it has to outlive the parser and everything parsed
+  _schema        = std::shared_ptr<const Schema>(std::shared_ptr<const Schema>(), &schema);
+  _static_schema = &schema;
+  freeze_commands(_top_level_command, this);
+}
+
 ArgParser::~ArgParser() {}
 
 // add new options with args
@@ -59,6 +372,14 @@ ArgParser::add_option(std::string const &long_option, std::string const &short_o
   return _top_level_command.add_option(long_option, short_option, description, envvar, arg_num, default_value, key);
 }
 
+ArgParser::Command &
+ArgParser::add_typed_option(std::string const &long_option, std::string const &short_option, std::string const &description,
+                            ValueType type, std::string const &envvar, unsigned arg_num, std::string const &default_value,
+                            std::string const &key)
+{
+  return _top_level_command.add_typed_option(long_option, short_option, description, type, envvar, arg_num, default_value, key);
+}
+
 // add sub-command with only function
 ArgParser::Command &
 ArgParser::add_command(std::string const &cmd_name, std::string const &cmd_description, Function const &f, std::string const &key)
@@ -77,45 +398,74 @@ ArgParser::add_command(std::string const &cmd_name, std::string const &cmd_descr
 void
 ArgParser::add_global_usage(std::string const &usage)
 {
-  global_usage = usage;
+  if (_top_level_command.late("global usage added")) {
+    return;
+  }
+  _global_usage = usage;
 }
 
 void
-ArgParser::help_message(std::string_view err) const
+ArgParser::allow_abbreviations()
 {
-  _top_level_command.help_message(err);
+  if (_top_level_command.late("abbreviations allowed")) {
+    return;
+  }
+  _abbreviations = true;
 }
 
-// a graceful way to output help message
 void
-ArgParser::Command::help_message(std::string_view err) const
+ArgParser::allow_response_files()
 {
-  if (!err.empty()) {
-    std::cout << "Error: " << err << std::endl;
+  if (_top_level_command.late("response files allowed")) {
+    return;
   }
-  // output global usage
-  if (global_usage.size() > 0) {
-    std::cout << "\nUsage: " + global_usage << std::endl;
+  _response_files = true;
+}
+
+void
+ArgParser::enable_completion()
+{
+  if (_top_level_command.late("completion enabled")) {
+    return;
   }
-  // output subcommands
-  std::cout << "\nCommands ---------------------- Description -----------------------" << std::endl;
-  std::string prefix = "";
-  output_command(std::cout, prefix);
-  // output options
-  if (_option_list.size() > 0) {
-    std::cout << "\nOptions ======================= Default ===== Description =============" << std::endl;
-    output_option();
+  _completion = true;
+}
+
+void
+ArgParser::help_message(std::string_view err) const
+{
+  freeze();
+  // by default return EX_USAGE(64) when usage is called.
+  std::shared_ptr<const Schema> schema = current();
+  help_message(*schema, schema->commands[0], err, EX_USAGE);
+}
+
+void
+ArgParser::help_message(Schema const &schema, SchemaCommand const &cmd, std::string_view err, int return_code) const
+{
+  unsigned i = &cmd - schema.commands;
+  std::string rendered;
+  if (&schema == _help_schema) {
+    std::call_once(_help_once[i], [&]() { schema.render_help(_help[i], cmd); });
+  } else {
+    // a schema compiled again by build()
+    schema.render_help(rendered, cmd);
   }
-  // output example usage
-  if (!_example_usage.empty()) {
-    std::cout << "\nExample Usage: " << _example_usage << std::endl;
+  std::string const &help = &schema == _help_schema ? _help[i] : rendered;
+  if (err.empty()) {
+    std::cout.write(help.data(), help.size());
+  } else {
+    std::string text;
+    text.reserve(err.size() + help.size() + 8);
+    text.append("Error: ").append(err).append("\n").append(help);
+    std::cout.write(text.data(), text.size());
   }
-  // standard return code
-  exit(usage_return_code);
+  std::cout.flush();
+  exit(return_code);
 }
 
 void
-ArgParser::Command::version_message() const
+ArgParser::version_message() const
 {
   // // unified version message of ATS
   // AppVersionInfo appVersionInfo;
@@ -127,482 +477,2180 @@ ArgParser::Command::version_message() const
 void
 ArgParser::set_default_command(std::string const &cmd)
 {
-  if (default_command.empty()) {
-    if (_top_level_command._subcommand_list.find(cmd) == _top_level_command._subcommand_list.end()) {
-      std::cerr << "Error: Default command " << cmd << "not found" << std::endl;
+  if (_top_level_command.late("default command set")) {
+    return;
+  }
+  for (auto &it : _top_level_command._subcommand_list) {
+    if (it.second._is_default && it.first != cmd) {
+      std::cerr << "Error: Default command " << it.first << "already existed" << std::endl;
       exit(1);
     }
-    default_command = cmd;
-  } else if (cmd != default_command) {
-    std::cerr << "Error: Default command " << default_command << "already existed" << std::endl;
+  }
+  auto it = _top_level_command._subcommand_list.find(cmd);
+  if (it == _top_level_command._subcommand_list.end()) {
+    std::cerr << "Error: Default command " << cmd << "not found" << std::endl;
     exit(1);
   }
+  it->second._is_default = true;
 }
 
 // Top level call of parsing
 Arguments
-ArgParser::parse(const char **argv)
+ArgParser::parse(const char **argv) const
 {
-  // deal with argv first
-  int size = 0;
-  _argv.clear();
-  while (argv[size]) {
-    _argv.push_back(argv[size]);
-    size++;
-  }
-  if (size == 0) {
-    std::cout << "Error: invalid argv provided" << std::endl;
-    exit(1);
-  }
-  // the name of the program only
-  _argv[0]                 = _argv[0].substr(_argv[0].find_last_of('/') + 1);
-  _top_level_command._name = _argv[0];
-  _top_level_command._key  = _argv[0];
-  parser_program_name      = _argv[0];
-  Arguments ret; // the parsed arg object to return
-  AP_StrVec args = _argv;
-  // call the recrusive parse method in Command
-  if (!_top_level_command.parse(ret, args)) {
-    // deal with default command
-    if (!default_command.empty()) {
-      args = _argv;
-      args.insert(args.begin() + 1, default_command);
-      _top_level_command.parse(ret, args);
-    }
-  };
-  // if there is anything left, then output usage
-  if (!args.empty()) {
-    std::string msg = "Unknown command, option or args:";
-    for (const auto &it : args) {
-      msg = msg + " '" + it + "'";
-    }
-    // find the correct level to output help message
-    ArgParser::Command *command = &_top_level_command;
-    for (unsigned i = 1; i < _argv.size(); i++) {
-      auto it = command->_subcommand_list.find(_argv[i]);
-      if (it == command->_subcommand_list.end()) {
-        break;
-      }
-      command = &it->second;
-    }
-    command->help_message(msg);
-  }
+  ParseError error;
+  Arguments ret = parse(argv, error);
+  report(error);
   return ret;
 }
 
-ArgParser::Command &
-ArgParser::require_commands()
-{
-  return _top_level_command.require_commands();
-}
-
-void
-ArgParser::set_error(std::string e)
+Arguments
+ArgParser::parse_view(int argc, const char **argv) const
 {
-  _error_msg = e;
+  ParseError error;
+  Arguments ret = parse_view(argc, argv, error);
+  report(error);
+  return ret;
 }
 
-std::string
-ArgParser::get_error() const
+Arguments
+ArgParser::parse(const char **argv, ParseError &error) const
 {
-  return _error_msg;
+  unsigned argc = 0;
+  while (argv[argc]) {
+    argc++;
+  }
+  return parse_argv(argc, argv, true, error);
 }
 
-//=========================== Command class ================================
-ArgParser::Command::Command() {}
-
-ArgParser::Command::~Command() {}
-
-ArgParser::Command::Command(std::string const &name, std::string const &description, std::string const &envvar, unsigned arg_num,
-                            Function const &f, std::string const &key)
-  : _name(name), _description(description), _arg_num(arg_num), _envvar(envvar), _f(f), _key(key)
+Arguments
+ArgParser::parse_view(int argc, const char **argv, ParseError &error) const
 {
+  return parse_argv(argc < 0 ? 0 : argc, argv, false, error);
 }
 
-// check if this is a valid option before adding
 void
-ArgParser::Command::check_option(std::string const &long_option, std::string const &short_option, std::string const &key) const
+ArgParser::report(ParseError const &error) const
 {
-  if (long_option.size() < 3 || long_option[0] != '-' || long_option[1] != '-') {
-    // invalid name
-    std::cerr << "Error: invalid long option added: '" + long_option + "'" << std::endl;
-    exit(1);
-  }
-  if (short_option.size() > 2 || (short_option.size() > 0 && short_option[0] != '-')) {
-    // invalid short option
-    std::cerr << "Error: invalid short option added: '" + short_option + "'" << std::endl;
-    exit(1);
-  }
-  // find if existing in option list
-  if (_option_list.find(long_option) != _option_list.end()) {
-    std::cerr << "Error: long option '" + long_option + "' already existed" << std::endl;
-    exit(1);
-  } else if (_option_map.find(short_option) != _option_map.end()) {
-    std::cerr << "Error: short option '" + short_option + "' already existed" << std::endl;
-    exit(1);
+  switch (error.kind) {
+  case ParseError::NONE:
+    return;
+  case ParseError::INVALID_ARGV:
+  case ParseError::FROZEN:
+    std::cout << "Error: " << error.message << std::endl;
+    exit(error.return_code());
+  case ParseError::VERSION:
+    version_message();
+    return;
+  case ParseError::COMPLETE:
+    std::cout.write(error.message.data(), error.message.size());
+    std::cout.flush();
+    exit(error.return_code());
+  default:
+    help_message(*error.schema, *error.command, error.message, error.return_code());
   }
 }
 
-// check if this is a valid command before adding
-void
-ArgParser::Command::check_command(std::string const &name, std::string const &key) const
+std::vector<std::string_view>
+ArgParser::complete(int argc, const char **argv, int cword) const
 {
-  if (name.empty()) {
-    // invalid name
-    std::cerr << "Error: empty command cannot be added" << std::endl;
-    exit(1);
-  }
-  // find if existing in subcommand list
-  if (_subcommand_list.find(name) != _subcommand_list.end()) {
-    std::cerr << "Error: command already exists: '" + name + "'" << std::endl;
-    exit(1);
+  freeze();
+  std::shared_ptr<const Schema> schema = current();
+  for (;;) {
+    SchemaCommand const *unbuilt             = nullptr;
+    std::vector<std::string_view> candidates = schema->complete(argc < 0 ? 0 : argc, argv, cword < 0 ? 0 : cword, &unbuilt);
+    if (!unbuilt) {
+      return candidates;
+    }
+    schema = build(*schema, *unbuilt);
   }
 }
 
-// add new options with args
-ArgParser::Command &
-ArgParser::Command::add_option(std::string const &long_option, std::string const &short_option, std::string const &description,
-                               std::string const &envvar, unsigned arg_num, std::string const &default_value,
-                               std::string const &key)
+std::string
+ArgParser::completion_script(std::string_view shell, std::string_view program)
 {
-  std::string lookup_key = key.empty() ? long_option.substr(2) : key;
-  check_option(long_option, short_option, lookup_key);
-  _option_list[long_option] = {long_option, short_option == "-" ? "" : short_option, description, envvar, arg_num, default_value,
-                               lookup_key};
-  if (short_option != "-" && !short_option.empty()) {
-    _option_map[short_option] = long_option;
+  std::string function = "_";
+  for (char c : program) {
+    function += isalnum(static_cast<unsigned char>(c)) ? c : '_';
   }
-  return *this;
-}
-
-// add sub-command with only function
-ArgParser::Command &
-ArgParser::Command::add_command(std::string const &cmd_name, std::string const &cmd_description, Function const &f,
-                                std::string const &key)
-{
-  std::string lookup_key = key.empty() ? cmd_name : key;
-  check_command(cmd_name, lookup_key);
-  _subcommand_list[cmd_name] = ArgParser::Command(cmd_name, cmd_description, "", 0, f, lookup_key);
-  return _subcommand_list[cmd_name];
-}
-
-// add sub-command without args and function
-ArgParser::Command &
-ArgParser::Command::add_command(std::string const &cmd_name, std::string const &cmd_description, std::string const &cmd_envvar,
-                                unsigned cmd_arg_num, Function const &f, std::string const &key)
-{
-  std::string lookup_key = key.empty() ? cmd_name : key;
-  check_command(cmd_name, lookup_key);
-  _subcommand_list[cmd_name] = ArgParser::Command(cmd_name, cmd_description, cmd_envvar, cmd_arg_num, f, lookup_key);
-  return _subcommand_list[cmd_name];
+  function += "_complete";
+  std::string script;
+  if (shell == "bash") {
+    script.append("# bash completion for ").append(program).append("\n");
+    script.append(function).append("()\n{\n");
+    script.append("  local IFS=$'\\n'\n");
+    script.append("  COMPREPLY=($(\"${COMP_WORDS[0]}\" __complete \"$COMP_CWORD\" \"${COMP_WORDS[@]}\" 2>/dev/null))\n");
+    script.append("}\n");
+    script.append("complete -o default -F ").append(function).append(" ").append(program).append("\n");
+  } else if (shell == "zsh") {
+    script.append("#compdef ").append(program).append("\n");
+    script.append(function).append("()\n{\n");
+    script.append("  local -a candidates\n");
+    script.append("  candidates=(${(f)\"$(\"${words[1]}\" __complete $((CURRENT - 1)) \"${words[@]}\" 2>/dev/null)\"})\n");
+    script.append("  compadd -a candidates || _files\n");
+    script.append("}\n");
+    script.append("compdef ").append(function).append(" ").append(program).append("\n");
+  }
+  return script;
 }
 
-ArgParser::Command &
-ArgParser::Command::add_example_usage(std::string const &usage)
+bool
+ArgParser::completion_query(unsigned argc, const char **argv, ParseError &error) const
 {
-  _example_usage = usage;
-  return *this;
+  std::string_view query = argc >= 3 ? argv[1] : "";
+  if (query == "__complete") {
+    // program __complete <cword> <argv...>, the candidates one per line
+    char *end          = nullptr;
+    unsigned long word = strtoul(argv[2], &end, 10);
+    if (*end != '\0') {
+      word = 0;
+    }
+    for (std::string_view candidate : complete(argc - 3, argv + 3, word)) {
+      error.message.append(candidate).append("\n");
+    }
+  } else if (query == "__completion" && argc == 3) {
+    // program __completion <shell>
+    std::string_view program = argv[0];
+    error.message            = completion_script(argv[2], program.substr(program.find_last_of('/') + 1));
+  } else {
+    return false;
+  }
+  error.kind = ParseError::COMPLETE;
+  return true;
 }
 
-// method used by help_message()
-void
-ArgParser::Command::output_command(std::ostream &out, std::string const &prefix) const
+Arguments
+ArgParser::parse_argv(unsigned argc, const char **argv, bool copy, ParseError &error, EnvList *env) const
 {
-  if (_name != parser_program_name) {
-    // a nicely formated way to output command usage
-    std::string msg = prefix + _name;
-    // nicely formated output
-    if (!_description.empty()) {
-      if (INDENT_ONE - static_cast<int>(msg.size()) < 0) {
-        // if the command msg is too long
-        std::cout << msg << "\n" << std::string(INDENT_ONE, ' ') << _description << std::endl;
-      } else {
-        std::cout << msg << std::string(INDENT_ONE - msg.size(), ' ') << _description << std::endl;
+  freeze();
+  Arguments ret; // the parsed arg object to return
+  ret._schema          = current();
+  Schema const &schema = *ret._schema;
+  error                = ParseError();
+  error.schema         = ret._schema;
+  if (argc == 0) {
+    error.kind    = ParseError::INVALID_ARGV;
+    error.message = "invalid argv provided";
+    error.command = schema.commands;
+    return ret;
+  }
+  if (schema.completion && completion_query(argc, argv, error)) {
+    return ret;
+  }
+  // the response files, mapped and counted first
+  size_t arg_count = argc;
+  std::vector<std::string_view> texts;
+  if (schema.response_files) {
+    for (unsigned i = 1; i < argc; i++) {
+      if (argv[i][0] != '@' || argv[i][1] == '\0') {
+        continue;
       }
+      size_t size = 0;
+      ret._files.push_back(map_file(argv[i] + 1, size));
+      if (!ret._files.back()) {
+        error.kind    = ParseError::INVALID_ARGV;
+        error.token   = i;
+        error.message = "cannot read response file '" + std::string(argv[i] + 1) + "'";
+        error.command = schema.commands;
+        return ret;
+      }
+      texts.emplace_back(ret._files.back().get(), size);
+      arg_count = arg_count - 1 + split_response_file(texts.back(), nullptr, nullptr);
     }
   }
-  // recursive call
-  for (const auto &it : _subcommand_list) {
-    it.second.output_command(out, "  " + prefix);
+  // a single arena for everything ret holds, large enough for the values of all the arguments
+  size_t argv_size = 0;
+  if (copy) {
+    for (unsigned i = 0; i < argc; i++) {
+      argv_size += strlen(argv[i]);
+    }
+  }
+  size_t index_size = Schema::slot_count(arg_count + 2 + schema.implied_key_count) * sizeof(Arguments::Slot);
+  ret._arena        = std::make_shared<Arguments::Arena>(argv_size + 3 * arg_count * sizeof(std::string_view) + index_size + 1024);
+  // the arguments as views, into the copy of argv in the arena for the values to point into unless it outlives ret
+  auto args =
+    static_cast<std::string_view *>(ret._arena->allocate(arg_count * sizeof(std::string_view), alignof(std::string_view)));
+  size_t n  = 0;
+  auto text = texts.begin();
+  for (unsigned i = 0; i < argc; i++) {
+    if (i > 0 && schema.response_files && argv[i][0] == '@' && argv[i][1] != '\0') {
+      n += split_response_file(*text++, args + n, ret._arena.get());
+      continue;
+    }
+    std::string_view arg = argv[i];
+    if (copy) {
+      arg = {static_cast<const char *>(memcpy(ret._arena->allocate(arg.size(), 1), arg.data(), arg.size())), arg.size()};
+    }
+    args[n++] = arg;
   }
+  parse_args(ret, args, arg_count, copy, error, env);
+  return ret;
 }
 
-// a nicely formatted way to output option message for help.
 void
-ArgParser::Command::output_option() const
+ArgParser::parse_args(Arguments &ret, std::string_view const *args, unsigned arg_count, bool copy, ParseError &error,
+                      EnvList *env) const
 {
-  for (const auto &it : _option_list) {
-    std::string msg;
-    if (!it.second.short_option.empty()) {
-      msg = it.second.short_option + ", ";
-    }
-    msg += it.first;
-    unsigned num = it.second.arg_num;
-    if (num != 0) {
-      if (num == 1) {
-        msg = msg + " <arg>";
-      } else if (num == MORE_THAN_ZERO_ARG_N) {
-        msg = msg + " [<arg> ...]";
-      } else if (num == MORE_THAN_ONE_ARG_N) {
-        msg = msg + " <arg> ...";
-      } else {
-        msg = msg + " <arg1> ... <arg" + std::to_string(num) + ">";
-      }
+  Schema const &schema = *ret._schema;
+  ParseState state(ret, args, arg_count, copy);
+  // the name of the program only
+  state.program = args[0];
+  state.program = state.program.substr(state.program.find_last_of('/') + 1);
+  state.run(nullptr);
+  if (state.ok() && state.chain.size() == 1 && schema.default_command) {
+    // no command found, walk argv again as if the default command followed the program name
+    state.run(&schema.commands[schema.default_command]);
+  }
+  if (state.unbuilt) {
+    // parse again once the lazy command is in the schema
+    ret._schema  = build(schema, *state.unbuilt);
+    error.schema = ret._schema;
+    parse_args(ret, args, arg_count, copy, error, env);
+    return;
+  }
+  state.finish();
+  // if there is anything left, then output usage
+  if (state.ok() && !state.unknown.empty()) {
+    std::string msg = "Unknown command, option or args:";
+    for (const auto &it : state.unknown) {
+      msg.append(" '").append(it).append("'");
     }
-    if (!it.second.default_value.empty()) {
-      if (INDENT_ONE - static_cast<int>(msg.size()) < 0) {
-        msg = msg + "\n" + std::string(INDENT_ONE, ' ') + it.second.default_value;
-      } else {
-        msg = msg + std::string(INDENT_ONE - msg.size(), ' ') + it.second.default_value;
+    // find the correct level to output help message
+    SchemaCommand const *command = schema.commands;
+    for (unsigned i = 1; i < arg_count; i++) {
+      SchemaCommand const *next = schema.find_command(*command, args[i]);
+      if (!next) {
+        break;
       }
+      command = next;
     }
-    if (!it.second.description.empty()) {
-      if (INDENT_TWO - static_cast<int>(msg.size()) < 0) {
-        std::cout << msg << "\n" << std::string(INDENT_TWO, ' ') << it.second.description << std::endl;
-      } else {
-        std::cout << msg << std::string(INDENT_TWO - msg.size(), ' ') << it.second.description << std::endl;
+    state.fail(*command, ParseError::UNKNOWN_ARGUMENT, state.unknown_token, msg);
+  }
+  error.kind    = state.err_kind;
+  error.token   = state.err_token;
+  error.message = std::move(state.err);
+  error.command = state.err_command;
+  check_late(error);
+  if (env) {
+    for (unsigned env_id = 0; env_id < schema.envvar_count; env_id++) {
+      if (state.env[env_id].data()) {
+        env->emplace_back(schema.envvars[env_id], state.env[env_id]);
       }
     }
   }
 }
 
-// helper method to handle the arguments and put them nicely in arguments
-// can be switched to ts::errata
-static std::string
-handle_args(Arguments &ret, AP_StrVec &args, std::string const &name, unsigned arg_num, unsigned &index)
+std::vector<std::string_view>
+ArgParser::apply(Arguments &args, int count, const char **tokens, ParseError &error) const
 {
-  ArgumentData data;
-  ret.append(name, data);
-  // handle the args
-  if (arg_num == MORE_THAN_ZERO_ARG_N || arg_num == MORE_THAN_ONE_ARG_N) {
-    // infinite arguments
-    if (arg_num == MORE_THAN_ONE_ARG_N && args.size() <= index + 1) {
-      return "at least one argument expected by " + name;
+  freeze();
+  std::vector<std::string_view> changed;
+  error        = ParseError();
+  error.schema = current();
+  if (args._schema != error.schema) {
+    // or parsed before a lazy command is built
+    std::lock_guard<std::mutex> lock(_build_mutex);
+    if (std::find(_built.begin(), _built.end(), args._schema) == _built.end()) {
+      error.kind    = ParseError::INVALID_ARGV;
+      error.message = "arguments not parsed by this parser";
+      error.command = error.schema->commands;
+      return changed;
     }
-    for (unsigned j = index + 1; j < args.size(); j++) {
-      ret.append_arg(name, args[j]);
-    }
-    args.erase(args.begin() + index, args.end());
-    return "";
   }
-  // finite number of argument handling
-  for (unsigned j = 0; j < arg_num; j++) {
-    if (args.size() < index + j + 2 || args[index + j + 1].empty()) {
-      return std::to_string(arg_num) + " argument(s) expected by " + name;
-    }
-    ret.append_arg(name, args[index + j + 1]);
-  }
-  // erase the used arguments and append the data to the return structure
-  args.erase(args.begin() + index, args.begin() + index + arg_num + 1);
-  index -= 1;
-  return "";
-}
-
-// Append the args of option to parsed data. Return true if there is any option called
-void
-ArgParser::Command::append_option_data(Arguments &ret, AP_StrVec &args, int index)
-{
-  std::map<std::string, unsigned> check_map;
-  for (unsigned i = index; i < args.size(); i++) {
-    // find matches of the arg
-    if (args[i][0] == '-' && args[i][1] == '-' && args[i].find('=') != std::string::npos) {
-      // deal with --args=
-      std::string option_name = args[i].substr(0, args[i].find_first_of('='));
-      std::string value       = args[i].substr(args[i].find_last_of('=') + 1);
-      if (value.empty()) {
-        help_message("missing argument for '" + option_name + "'");
-      }
-      auto it = _option_list.find(option_name);
-      if (it != _option_list.end()) {
-        ArgParser::Option cur_option = it->second;
-        // handle environment variable
-        if (!cur_option.envvar.empty()) {
-          ret.set_env(cur_option.key, getenv(cur_option.envvar.c_str()) ? getenv(cur_option.envvar.c_str()) : "");
-        }
-        ret.append_arg(cur_option.key, value);
-        check_map[cur_option.long_option] += 1;
-        args.erase(args.begin() + i);
-        i -= 1;
-      }
-    } else {
-      // output version message
-      if ((args[i] == "--version" || args[i] == "-V") && _option_list.find("--version") != _option_list.end()) {
-        version_message();
-      }
-      // output help message
-      if ((args[i] == "--help" || args[i] == "-h") && _option_list.find("--help") != _option_list.end()) {
-        ArgParser::Command *command = this;
-        // find the correct level to output help messsage
-        for (unsigned i = 1; i < args.size(); i++) {
-          auto it = command->_subcommand_list.find(args[i]);
-          if (it == command->_subcommand_list.end()) {
-            break;
-          }
-          command = &it->second;
-        }
-        usage_return_code = 0;
-        command->help_message();
-      }
-      // deal with normal --arg val1 val2 ...
-      auto long_it  = _option_list.find(args[i]);
-      auto short_it = _option_map.find(args[i]);
-      // long option match or short option match
-      if (long_it != _option_list.end() || short_it != _option_map.end()) {
-        ArgParser::Option cur_option;
-        if (long_it != _option_list.end()) {
-          cur_option = long_it->second;
-        } else {
-          cur_option = _option_list.at(short_it->second);
-        }
-        // handle the arguments
-        std::string err = handle_args(ret, args, cur_option.key, cur_option.arg_num, i);
-        if (!err.empty()) {
-          help_message(err);
-        }
-        // handle environment variable
-        if (!cur_option.envvar.empty()) {
-          ret.set_env(cur_option.key, getenv(cur_option.envvar.c_str()) ? getenv(cur_option.envvar.c_str()) : "");
-        }
-      }
-    }
+  error.schema = args._schema;
+  // the program name then the tokens, copied into the arena of args for the values to point into
+  unsigned argc = 1 + (count < 0 ? 0 : count);
+  // a copy sharing its arena with others leaves it first, the arena is not thread safe
+  auto argv = static_cast<std::string_view *>(args.arena()->allocate(argc * sizeof(std::string_view), alignof(std::string_view)));
+  argv[0]   = args._program;
+  for (unsigned i = 1; i < argc; i++) {
+    argv[i] = args.own(tokens[i - 1]);
   }
-  // check for wrong number of arguments for --arg=...
-  for (const auto &it : check_map) {
-    unsigned num = _option_list.at(it.first).arg_num;
-    if (num != it.second && num < MORE_THAN_ONE_ARG_N) {
-      help_message(std::to_string(_option_list.at(it.first).arg_num) + " arguments expected by " + it.first);
+  ParseState state(args, argv, argc, true);
+  state.program = args._program;
+  state.apply();
+  if (!state.ok()) {
+    // args are left as they were
+    for (ParseState::Touched const &it : state.touched) {
+      args.find(it.option->id)->share(it.before);
+      if (!args._given.empty()) {
+        unsigned index = it.option - args._schema->options;
+        args._given[index / 64] &= ~(uint64_t(1) << (index % 64));
+        args._given[index / 64] |= uint64_t(it.given) << (index % 64);
+      }
     }
+    error.kind    = state.err_kind;
+    error.token   = state.err_token - 1;
+    error.message = std::move(state.err);
+    error.command = state.err_command;
+    return changed;
   }
-  // put in the default value of options
-  for (const auto &it : _option_list) {
-    if (!it.second.default_value.empty() && ret.get(it.second.key).empty()) {
-      std::istringstream ss(it.second.default_value);
-      std::string token;
-      while (std::getline(ss, token, ' ')) {
-        ret.append_arg(it.second.key, token);
-      }
+  for (ParseState::Touched const &it : state.touched) {
+    ArgumentData const &before = it.before;
+    ArgumentData const &after  = *args.find(it.option->id);
+    if (before._is_called != after._is_called || before._env_value != after._env_value || before.size() != after.size() ||
+        !std::equal(before.begin(), before.end(), after.begin())) {
+      changed.push_back(it.option->key);
     }
   }
+  check_late(error);
+  return changed;
 }
 
-// Main recursive logic of Parsing
-bool
-ArgParser::Command::parse(Arguments &ret, AP_StrVec &args)
-{
-  bool command_called = false;
-  // iterate through all arguments
-  for (unsigned i = 0; i < args.size(); i++) {
-    if (_name == args[i]) {
-      command_called = true;
-      // handle the option
-      append_option_data(ret, args, i);
-      // handle the action
-      if (_f) {
-        ret._action = _f;
-      }
-      std::string err = handle_args(ret, args, _key, _arg_num, i);
-      if (!err.empty()) {
-        help_message(err);
-      }
-      // set ENV var
-      if (!_envvar.empty()) {
-        ret.set_env(_key, getenv(_envvar.c_str()) ? getenv(_envvar.c_str()) : "");
-      }
+unsigned
+ArgParser::parse_batch(std::istream &in, std::string_view program, std::ostream &out,
+                       std::function<void(Arguments const &)> const &each) const
+{
+  freeze();
+  // a single Arguments and arena for all the lines, reset in between
+  char buffer[16384];
+  Arguments ret;
+  ret._schema = current();
+  ret._arena  = std::make_shared<Arguments::Arena>(buffer, sizeof(buffer));
+  ParseError error;
+  std::string line;
+  unsigned number = 0;
+  unsigned failed = 0;
+  while (std::getline(in, line)) {
+    number++;
+    size_t first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') {
+      continue;
+    }
+    ret._data.clear();
+    ret._arena->release();
+    // the program name, then the arguments of the line
+    unsigned arg_count = 1 + split_response_file(line, nullptr, nullptr);
+    auto args =
+      static_cast<std::string_view *>(ret._arena->allocate(arg_count * sizeof(std::string_view), alignof(std::string_view)));
+    args[0] = program;
+    split_response_file(line, args + 1, ret._arena.get());
+    error        = ParseError();
+    error.schema = ret._schema;
+    parse_args(ret, args, arg_count, false, error);
+    if (error.kind == ParseError::HELP) {
+      out << error.help();
+      continue;
+    }
+    if (error.kind == ParseError::VERSION) {
+      continue;
+    }
+    if (error) {
+      out << "line " << number << ": Error: " << error.message << std::endl;
+      failed++;
+      continue;
+    }
+    try {
+      if (each) {
+        each(ret);
+      }
+      ret.invoke();
+    } catch (std::exception const &e) {
+      out << "line " << number << ": Error: " << e.what() << std::endl;
+      failed++;
+    }
+  }
+  return failed;
+}
+
+// The cache of parse_cached(): the entries in the order they were last used, the most recent first, and an index
+// of them by the hash of their arguments. A hash collision replaces the older entry.
+struct ArgParser::ParseCache {
+  struct Entry {
+    uint64_t hash;
+    // the arguments, each followed by '\0'
+    std::string args;
+    // the environment variables the parse looked up, with their values then
+    EnvList env;
+    std::shared_ptr<const Arguments> arguments;
+  };
+
+  // FNV-1a over the arguments, each followed by '\0'
+  static uint64_t
+  hash(unsigned argc, const char **argv)
+  {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned i = 0; i < argc; i++) {
+      for (const char *c = argv[i];; c++) {
+        h = (h ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+        if (*c == '\0') {
+          break;
+        }
+      }
+    }
+    return h;
+  }
+
+  // whether the entry is the one of the command line, with the same values of the environment variables
+  static bool
+  matches(Entry const &entry, unsigned argc, const char **argv)
+  {
+    size_t pos = 0;
+    for (unsigned i = 0; i < argc; i++) {
+      size_t size = strlen(argv[i]);
+      if (entry.args.size() - pos < size + 1 || memcmp(entry.args.data() + pos, argv[i], size + 1) != 0) {
+        return false;
+      }
+      pos += size + 1;
+    }
+    if (pos != entry.args.size()) {
+      return false;
+    }
+    for (auto const &[name, value] : entry.env) {
+      const char *found = getenv(name.c_str());
+      if (value != (found ? found : "")) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t capacity;
+  std::mutex mutex;
+  std::list<Entry> entries;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+  // the schema the entries are parsed against
+  Schema const *schema = nullptr;
+  uint64_t hits        = 0;
+  uint64_t misses      = 0;
+};
+
+void
+ArgParser::enable_cache(size_t capacity)
+{
+  if (capacity == 0) {
+    _cache.reset();
+    return;
+  }
+  _cache           = std::make_unique<ParseCache>();
+  _cache->capacity = capacity;
+}
+
+ArgParser::ArgParser(ArgParser const &other)
+{
+  *this = other;
+}
+
+ArgParser &
+ArgParser::operator=(ArgParser const &other)
+{
+  if (this == &other) {
+    return *this;
+  }
+  _top_level_command = other._top_level_command;
+  _error_msg         = other._error_msg;
+  _global_usage      = other._global_usage;
+  _abbreviations     = other._abbreviations;
+  _response_files    = other._response_files;
+  _completion        = other._completion;
+  _static_schema     = other._static_schema;
+  // compiled again by the first parse of the copy, unless it is for a schema defined at compile time
+  _schema      = nullptr;
+  _freeze_once = std::make_unique<std::once_flag>();
+  _built.clear();
+  _built_commands.clear();
+  _late_error.clear();
+  _late        = 0;
+  _help        = nullptr;
+  _help_once   = nullptr;
+  _help_schema = nullptr;
+  _cache       = nullptr;
+  if (other._cache) {
+    enable_cache(other._cache->capacity);
+  }
+  freeze_commands(_top_level_command, nullptr);
+  if (_static_schema) {
+    _schema = std::shared_ptr<const Schema>(std::shared_ptr<const Schema>(), _static_schema);
+    freeze_commands(_top_level_command, this);
+  }
+  return *this;
+}
+
+std::shared_ptr<const Arguments>
+ArgParser::parse_cached(int argc, const char **argv) const
+{
+  ParseError error;
+  auto ret = parse_cached(argc, argv, error);
+  report(error);
+  return ret;
+}
+
+std::shared_ptr<const Arguments>
+ArgParser::parse_cached(int argc, const char **argv, ParseError &error) const
+{
+  freeze();
+  std::shared_ptr<const Schema> schema = current();
+  bool cacheable                       = _cache && argc > 0;
+  for (int i = 1; cacheable && schema->response_files && i < argc; i++) {
+    cacheable = argv[i][0] != '@' || argv[i][1] == '\0';
+  }
+  if (!cacheable) {
+    return std::make_shared<const Arguments>(parse_argv(argc < 0 ? 0 : argc, argv, true, error));
+  }
+  ParseCache &cache = *_cache;
+  uint64_t hash     = ParseCache::hash(argc, argv);
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.schema != schema.get()) {
+      // parsed against another schema, or one before a lazy command is built
+      cache.entries.clear();
+      cache.index.clear();
+      cache.schema = schema.get();
+    }
+    auto it = cache.index.find(hash);
+    if (it != cache.index.end() && ParseCache::matches(*it->second, argc, argv)) {
+      cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+      cache.hits++;
+      error        = ParseError();
+      error.schema = schema;
+      check_late(error);
+      return it->second->arguments;
+    }
+    cache.misses++;
+  }
+  // parsed out of the lock, a command line parsed by several threads at once is cached by each in turn
+  ParseCache::Entry entry;
+  entry.hash      = hash;
+  entry.arguments = std::make_shared<const Arguments>(parse_argv(argc, argv, true, error, &entry.env));
+  if (error) {
+    return entry.arguments;
+  }
+  for (int i = 0; i < argc; i++) {
+    entry.args.append(argv[i]).push_back('\0');
+  }
+  auto ret = entry.arguments;
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto it = cache.index.find(hash);
+  if (it != cache.index.end()) {
+    cache.entries.erase(it->second);
+    cache.index.erase(it);
+  }
+  cache.entries.push_front(std::move(entry));
+  cache.index.emplace(hash, cache.entries.begin());
+  if (cache.entries.size() > cache.capacity) {
+    cache.index.erase(cache.entries.back().hash);
+    cache.entries.pop_back();
+  }
+  return ret;
+}
+
+ArgParser::CacheStats
+ArgParser::cache_stats() const
+{
+  CacheStats stats;
+  if (_cache) {
+    std::lock_guard<std::mutex> lock(_cache->mutex);
+    stats.hits   = _cache->hits;
+    stats.misses = _cache->misses;
+    stats.size   = _cache->entries.size();
+  }
+  return stats;
+}
+
+void
+ArgParser::clear_cache() const
+{
+  if (_cache) {
+    std::lock_guard<std::mutex> lock(_cache->mutex);
+    _cache->entries.clear();
+    _cache->index.clear();
+  }
+}
+
+void
+ArgParser::freeze() const
+{
+  // the first parse of concurrent ones freezes the parser, the others wait for it
+  std::call_once(*_freeze_once, [this]() {
+    if (!_schema) {
+      _schema = compile();
+    }
+    _help        = std::make_unique<std::string[]>(_schema->command_count);
+    _help_once   = std::make_unique<std::once_flag[]>(_schema->command_count);
+    _help_schema = _schema.get();
+    freeze_commands(_top_level_command, this);
+  });
+}
+
+void
+ArgParser::freeze_commands(Command const &command, ArgParser const *parser)
+{
+  std::vector<Command const *> commands = {&command};
+  while (!commands.empty()) {
+    Command const *next = commands.back();
+    commands.pop_back();
+    next->_frozen = parser != nullptr;
+    next->_parser = parser;
+    for (auto const &it : next->_subcommand_list) {
+      commands.push_back(&it.second);
+    }
+  }
+}
+
+void
+ArgParser::late(std::string const &what) const
+{
+  // the first one only, the parses read it once it is written
+  int none = 0;
+  if (_late.compare_exchange_strong(none, 1)) {
+    _late_error = what + " after the parser is frozen";
+    _late.store(2, std::memory_order_release);
+  }
+}
+
+void
+ArgParser::check_late(ParseError &error) const
+{
+  if (!error && _late.load(std::memory_order_acquire) == 2) {
+    error.kind    = ParseError::FROZEN;
+    error.message = _late_error;
+    error.command = error.schema ? error.schema->commands : nullptr;
+  }
+}
+
+std::shared_ptr<const Schema>
+ArgParser::build(Schema const &schema, SchemaCommand const &cmd) const
+{
+  // a single build at a time, while the other parses go on against the schema they started with
+  std::lock_guard<std::mutex> lock(_build_mutex);
+  std::shared_ptr<const Schema> replaced = current();
+  if (replaced.get() != &schema) {
+    return replaced;
+  }
+  // built into a copy of the parser's own, the command tree defined is left as it is for the copies of the parser
+  unsigned index           = &cmd - schema.commands;
+  Command &command         = _built_commands.emplace_back(*static_cast<OwnedSchema const &>(schema).sources[index]);
+  Command::Builder builder = std::move(command._builder);
+  command._builder         = nullptr;
+  command._frozen          = false;
+  builder(command);
+  freeze_commands(command, this);
+  std::shared_ptr<const Schema> built = compile(replaced, index, &command);
+  _built.push_back(std::move(replaced));
+  std::atomic_store(&_schema, built);
+  return built;
+}
+
+std::shared_ptr<const Schema>
+ArgParser::current() const
+{
+  return std::atomic_load(&_schema);
+}
+
+Schema const *
+ArgParser::schema() const
+{
+  return current().get();
+}
+
+ArgKey
+ArgParser::key(std::string_view name)
+{
+  freeze();
+  std::shared_ptr<const Schema> schema = current();
+  if (!schema->find_key(name)) {
+    std::cerr << "Error: look-up key '" << name << "' not found" << std::endl;
+    exit(1);
+  }
+  return schema->key(name);
+}
+
+// flatten the command tree, breadth-first so that the subcommands of a command are adjacent. Given the schema base
+// compiled before and the command built in place of its lazy one at lazy_index, only the commands of the built one are
+// compiled, after the ones of base, which are copied as they are.
+std::shared_ptr<const Schema>
+ArgParser::compile(std::shared_ptr<const Schema> const &base, unsigned lazy_index, Command const *built) const
+{
+  auto schema                         = std::make_shared<OwnedSchema>();
+  std::vector<Command const *> source = {&_top_level_command};
+  if (base) {
+    auto const &owned       = static_cast<OwnedSchema const &>(*base);
+    schema->command_list    = owned.command_list;
+    schema->option_list     = owned.option_list;
+    schema->slot_list       = owned.slot_list;
+    schema->key_list        = owned.key_list;
+    schema->envvar_list     = owned.envvar_list;
+    schema->default_list    = owned.default_list;
+    schema->constraint_list = owned.constraint_list;
+    schema->mask_list       = owned.mask_list;
+    schema->default_command = owned.default_command;
+    schema->base            = base;
+    source                  = owned.sources;
+    source[lazy_index]      = built;
+  }
+  // the commands and options of base, the ones of the lazy command left unused
+  unsigned command_count = schema->command_list.size();
+  unsigned option_count  = schema->option_list.size();
+  // the commands compiled, in order
+  std::vector<unsigned> order;
+  auto compile_command = [&](unsigned i) {
+    Command const &command = *source[i];
+    SchemaCommand entry;
+    entry.name             = schema->intern(command._name);
+    entry.description      = schema->intern(command._description);
+    entry.arg_num          = command._arg_num;
+    entry.envvar           = schema->intern(command._envvar);
+    entry.example_usage    = schema->intern(command._example_usage);
+    entry.action           = nullptr;
+    entry.key              = schema->intern(command._key);
+    entry.command_required = command._command_required;
+    entry.lazy             = bool(command._builder);
+    // only a subcommand of the top level command can be the default one
+    if (command._is_default && i <= _top_level_command._subcommand_list.size()) {
+      schema->default_command = i;
+    }
+    // options, already sorted by long option
+    entry.option_begin = schema->option_list.size();
+    for (auto const &it : command._option_list) {
+      Option const &option = it.second;
+      schema->option_list.push_back({schema->intern(option.long_option), schema->intern(option.short_option),
+                                     schema->intern(option.description), schema->intern(option.envvar), option.arg_num,
+                                     schema->intern(option.default_value), schema->intern(option.key)});
+      schema->option_list.back().type = {option.type, schema->intern(option.choices)};
+      schema->option_list.back().min  = schema->intern(option.min);
+      schema->option_list.back().max  = schema->intern(option.max);
+    }
+    entry.option_end = schema->option_list.size();
+    // constraints, a mask over the words of the bitset of the options they name
+    entry.constraint_begin = schema->constraint_list.size();
+    for (Command::Constraint const &constraint : command._constraint_list) {
+      // the index of a long option of the command
+      auto find = [&](std::string const &name) -> unsigned {
+        auto first = schema->option_list.begin() + entry.option_begin;
+        auto last  = schema->option_list.begin() + entry.option_end;
+        return std::lower_bound(first, last, name, [](SchemaOption const &o, std::string const &n) { return o.long_option < n; }) -
+               schema->option_list.begin();
+      };
+      SchemaConstraint &compiled = schema->constraint_list.emplace_back();
+      compiled.kind              = constraint.kind;
+      if (constraint.kind == SchemaConstraint::REQUIRES) {
+        compiled.option = find(constraint.long_option);
+      }
+      std::vector<unsigned> indices;
+      for (std::string const &name : constraint.long_options) {
+        indices.push_back(find(name));
+      }
+      auto [first, last]  = std::minmax_element(indices.begin(), indices.end());
+      compiled.word       = *first / 64;
+      compiled.mask_begin = schema->mask_list.size();
+      compiled.mask_end   = compiled.mask_begin + *last / 64 - compiled.word + 1;
+      schema->mask_list.resize(compiled.mask_end);
+      for (unsigned index : indices) {
+        schema->mask_list[compiled.mask_begin + index / 64 - compiled.word] |= uint64_t(1) << (index % 64);
+      }
+    }
+    entry.constraint_end = schema->constraint_list.size();
+    // subcommands, already sorted by name
+    entry.command_begin = source.size();
+    for (auto const &it : command._subcommand_list) {
+      source.push_back(&it.second);
+    }
+    entry.command_end = source.size();
+    // the hash table
+    entry.slot_begin = schema->slot_list.size();
+    entry.slot_count =
+      Schema::slot_count(command._option_list.size() + command._option_map.size() + command._subcommand_list.size());
+    schema->slot_list.resize(entry.slot_begin + entry.slot_count, {0, 0});
+    SchemaSlot *table = schema->slot_list.data() + entry.slot_begin;
+    for (unsigned j = entry.option_begin; j < entry.option_end; j++) {
+      Schema::insert_slot(table, entry.slot_count, schema->option_list[j].long_option, j + 1);
+      if (!schema->option_list[j].short_option.empty()) {
+        Schema::insert_slot(table, entry.slot_count, schema->option_list[j].short_option, j + 1);
+      }
+    }
+    for (unsigned j = entry.command_begin; j < entry.command_end; j++) {
+      Schema::insert_slot(table, entry.slot_count, source[j]->_name, (j + 1) | SchemaSlot::COMMAND);
+    }
+    order.push_back(i);
+    if (i < command_count) {
+      // the built command is known by the same key, environment variable and function as the lazy one
+      SchemaCommand const &lazy = schema->command_list[i];
+      entry.id                  = lazy.id;
+      entry.env_id              = lazy.env_id;
+      entry.action              = lazy.action;
+      schema->command_list[i]   = entry;
+    } else {
+      schema->command_list.push_back(entry);
+    }
+  };
+  if (base) {
+    compile_command(lazy_index);
+  }
+  for (unsigned i = command_count; i < source.size(); i++) {
+    compile_command(i);
+  }
+  // the look-up keys, numbered in order of appearance, the ones of base keep theirs
+  std::map<std::string_view, unsigned> ids;
+  if (schema->key_list.empty()) {
+    schema->key_list.push_back({});
+  }
+  for (unsigned id = 1; id < schema->key_list.size(); id++) {
+    ids.emplace(schema->key_list[id], id);
+  }
+  auto add_key = [&](std::string_view name) {
+    auto it = ids.emplace(name, schema->key_list.size()).first;
+    if (it->second == schema->key_list.size()) {
+      schema->key_list.push_back(name);
+    }
+    return it->second;
+  };
+  for (unsigned i : order) {
+    SchemaCommand &command = schema->command_list[i];
+    if (i > 0 && i >= command_count) {
+      command.id = add_key(command.key);
+    }
+    for (unsigned j = command.option_begin; j < command.option_end; j++) {
+      schema->option_list[j].id = add_key(schema->option_list[j].key);
+    }
+  }
+  // the environment variables
+  std::map<std::string_view, unsigned> env_ids;
+  for (unsigned env_id = 0; env_id < schema->envvar_list.size(); env_id++) {
+    env_ids.emplace(schema->envvar_list[env_id], env_id);
+  }
+  auto add_envvar = [&](std::string_view name) {
+    auto it = env_ids.emplace(name, schema->envvar_list.size()).first;
+    if (it->second == schema->envvar_list.size()) {
+      schema->envvar_list.push_back(name);
+    }
+    return it->second;
+  };
+  for (unsigned i : order) {
+    SchemaCommand &command = schema->command_list[i];
+    if (!command.envvar.empty() && i >= command_count) {
+      command.env_id = add_envvar(command.envvar);
+    }
+  }
+  for (unsigned i = option_count; i < schema->option_list.size(); i++) {
+    SchemaOption &option = schema->option_list[i];
+    if (!option.envvar.empty()) {
+      option.env_id = add_envvar(option.envvar);
+    }
+  }
+  schema->envvar_count = schema->envvar_list.size();
+  // the default values
+  for (unsigned i = option_count; i < schema->option_list.size(); i++) {
+    SchemaOption &option = schema->option_list[i];
+    option.default_begin = schema->default_list.size();
+    schema->default_list.resize(option.default_begin + Schema::split_default(option.default_value, nullptr));
+    Schema::split_default(option.default_value, schema->default_list.data() + option.default_begin);
+    option.default_end = schema->default_list.size();
+  }
+  schema->key_count      = schema->key_list.size();
+  schema->key_slot_count = Schema::slot_count(schema->key_count - 1);
+  schema->key_slot_list.resize(schema->key_slot_count, {0, 0});
+  for (unsigned id = 1; id < schema->key_count; id++) {
+    Schema::insert_slot(schema->key_slot_list.data(), schema->key_slot_count, schema->key_list[id], id);
+  }
+  // the functions, which the commands point to
+  schema->actions.reserve(source.size() - command_count);
+  for (unsigned i = command_count; i < source.size(); i++) {
+    if (source[i]->_f) {
+      schema->command_list[i].action = &schema->actions.emplace_back(source[i]->_f);
+    }
+  }
+  schema->commands          = schema->command_list.data();
+  schema->command_count     = schema->command_list.size();
+  schema->options           = schema->option_list.data();
+  schema->option_count      = schema->option_list.size();
+  schema->usage             = schema->intern(_global_usage);
+  schema->abbreviations     = _abbreviations;
+  schema->response_files    = _response_files;
+  schema->completion        = _completion;
+  schema->slots             = schema->slot_list.data();
+  schema->keys              = schema->key_list.data();
+  schema->key_slots         = schema->key_slot_list.data();
+  schema->envvars           = schema->envvar_list.data();
+  schema->default_values    = schema->default_list.data();
+  schema->constraints       = schema->constraint_list.data();
+  schema->constraint_count  = schema->constraint_list.size();
+  schema->constraint_masks  = schema->mask_list.data();
+  schema->implied_key_count = Schema::count_implied_keys(schema->commands, schema->options, schema->commands[0]);
+  schema->sources           = std::move(source);
+  return schema;
+}
+
+ArgParser::Command &
+ArgParser::require_commands()
+{
+  return _top_level_command.require_commands();
+}
+
+ArgParser::Command &
+ArgParser::mutually_exclusive(std::vector<std::string> const &long_options)
+{
+  return _top_level_command.mutually_exclusive(long_options);
+}
+
+ArgParser::Command &
+ArgParser::require_one_of(std::vector<std::string> const &long_options)
+{
+  return _top_level_command.require_one_of(long_options);
+}
+
+ArgParser::Command &
+ArgParser::option_requires(std::string const &long_option, std::vector<std::string> const &long_options)
+{
+  return _top_level_command.option_requires(long_option, long_options);
+}
+
+ArgParser::Command &
+ArgParser::set_range(std::string const &long_option, std::string const &min, std::string const &max)
+{
+  return _top_level_command.set_range(long_option, min, max);
+}
+
+void
+ArgParser::set_error(std::string e)
+{
+  _error_msg = e;
+}
+
+std::string
+ArgParser::get_error() const
+{
+  return _error_msg;
+}
+
+//=========================== Command class ================================
+ArgParser::Command::Command() {}
+
+ArgParser::Command::~Command() {}
+
+ArgParser::Command::Command(std::string const &name, std::string const &description, std::string const &envvar, unsigned arg_num,
+                            Function const &f, std::string const &key)
+  : _name(name), _description(description), _arg_num(arg_num), _envvar(envvar), _f(f), _key(key)
+{
+}
+
+// check if this is a valid option before adding
+bool
+ArgParser::Command::late(std::string const &what) const
+{
+  if (!_frozen) {
+    return false;
+  }
+  _parser->late(what);
+  return true;
+}
+
+void
+ArgParser::Command::check_option(std::string const &long_option, std::string const &short_option, std::string const &key) const
+{
+  if (long_option.size() < 3 || long_option[0] != '-' || long_option[1] != '-') {
+    // invalid name
+    std::cerr << "Error: invalid long option added: '" + long_option + "'" << std::endl;
+    exit(1);
+  }
+  if (short_option.size() > 2 || (short_option.size() > 0 && short_option[0] != '-')) {
+    // invalid short option
+    std::cerr << "Error: invalid short option added: '" + short_option + "'" << std::endl;
+    exit(1);
+  }
+  // find if existing in option list
+  if (_option_list.find(long_option) != _option_list.end()) {
+    std::cerr << "Error: long option '" + long_option + "' already existed" << std::endl;
+    exit(1);
+  } else if (_option_map.find(short_option) != _option_map.end()) {
+    std::cerr << "Error: short option '" + short_option + "' already existed" << std::endl;
+    exit(1);
+  }
+}
+
+// check if this is a valid command before adding
+void
+ArgParser::Command::check_command(std::string const &name, std::string const &key) const
+{
+  if (name.empty()) {
+    // invalid name
+    std::cerr << "Error: empty command cannot be added" << std::endl;
+    exit(1);
+  }
+  // find if existing in subcommand list
+  if (_subcommand_list.find(name) != _subcommand_list.end()) {
+    std::cerr << "Error: command already exists: '" + name + "'" << std::endl;
+    exit(1);
+  }
+}
+
+// add new options with args
+ArgParser::Command &
+ArgParser::Command::add_option(std::string const &long_option, std::string const &short_option, std::string const &description,
+                               std::string const &envvar, unsigned arg_num, std::string const &default_value,
+                               std::string const &key)
+{
+  if (late("option '" + long_option + "' added")) {
+    return *this;
+  }
+  std::string lookup_key = key.empty() ? long_option.substr(2) : key;
+  check_option(long_option, short_option, lookup_key);
+  _option_list[long_option] = {long_option, short_option == "-" ? "" : short_option, description, envvar, arg_num, default_value,
+                               lookup_key};
+  if (short_option != "-" && !short_option.empty()) {
+    _option_map[short_option] = long_option;
+  }
+  return *this;
+}
+
+// add new options whose values are converted by the parse
+ArgParser::Command &
+ArgParser::Command::add_typed_option(std::string const &long_option, std::string const &short_option,
+                                     std::string const &description, ValueType type, std::string const &envvar, unsigned arg_num,
+                                     std::string const &default_value, std::string const &key)
+{
+  if (late("option '" + long_option + "' added")) {
+    return *this;
+  }
+  if (arg_num == 0) {
+    std::cerr << "Error: typed option '" + long_option + "' expects no argument" << std::endl;
+    exit(1);
+  }
+  if (type.kind == ValueType::ENUM && !type.valid_choices()) {
+    std::cerr << "Error: invalid choices '" << type.choices << "' for option '" + long_option + "'" << std::endl;
+    exit(1);
+  }
+  add_option(long_option, short_option, description, envvar, arg_num, default_value, key);
+  Option &option = _option_list[long_option];
+  option.type    = type.kind;
+  option.choices = type.choices;
+  // the default values are converted by every parse that puts them in
+  std::vector<std::string_view> defaults(Schema::split_default(default_value, nullptr));
+  Schema::split_default(default_value, defaults.data());
+  for (std::string_view value : defaults) {
+    ArgumentData::TypedValue converted;
+    if (const char *reason = ArgumentData::convert({option.type, option.choices}, value, converted)) {
+      std::cerr << "Error: invalid default value '" << value << "' of option '" + long_option + "': " << reason << std::endl;
+      exit(1);
+    }
+  }
+  return *this;
+}
+
+// add sub-command with only function
+ArgParser::Command &
+ArgParser::Command::add_command(std::string const &cmd_name, std::string const &cmd_description, Function const &f,
+                                std::string const &key)
+{
+  if (late("command '" + cmd_name + "' added")) {
+    return *this;
+  }
+  std::string lookup_key = key.empty() ? cmd_name : key;
+  check_command(cmd_name, lookup_key);
+  _subcommand_list[cmd_name] = ArgParser::Command(cmd_name, cmd_description, "", 0, f, lookup_key);
+  return _subcommand_list[cmd_name];
+}
+
+// add sub-command without args and function
+ArgParser::Command &
+ArgParser::Command::add_command(std::string const &cmd_name, std::string const &cmd_description, std::string const &cmd_envvar,
+                                unsigned cmd_arg_num, Function const &f, std::string const &key)
+{
+  if (late("command '" + cmd_name + "' added")) {
+    return *this;
+  }
+  std::string lookup_key = key.empty() ? cmd_name : key;
+  check_command(cmd_name, lookup_key);
+  _subcommand_list[cmd_name] = ArgParser::Command(cmd_name, cmd_description, cmd_envvar, cmd_arg_num, f, lookup_key);
+  return _subcommand_list[cmd_name];
+}
+
+ArgParser::Command &
+ArgParser::Command::add_lazy_command(std::string const &cmd_name, std::string const &cmd_description, Builder const &builder,
+                                     Function const &f, std::string const &key)
+{
+  if (late("command '" + cmd_name + "' added")) {
+    return *this;
+  }
+  Command &command = add_command(cmd_name, cmd_description, f, key);
+  command._builder = builder;
+  return command;
+}
+
+ArgParser::Command &
+ArgParser::Command::add_example_usage(std::string const &usage)
+{
+  if (late("example usage added")) {
+    return *this;
+  }
+  _example_usage = usage;
+  return *this;
+}
+
+ArgParser::Command &
+ArgParser::Command::mutually_exclusive(std::vector<std::string> const &long_options)
+{
+  if (late("constraint added")) {
+    return *this;
+  }
+  check_constraint(long_options, 2);
+  _constraint_list.push_back({SchemaConstraint::EXCLUSIVE, "", long_options});
+  return *this;
+}
+
+ArgParser::Command &
+ArgParser::Command::require_one_of(std::vector<std::string> const &long_options)
+{
+  if (late("constraint added")) {
+    return *this;
+  }
+  check_constraint(long_options, 1);
+  _constraint_list.push_back({SchemaConstraint::ONE_OF, "", long_options});
+  return *this;
+}
+
+ArgParser::Command &
+ArgParser::Command::option_requires(std::string const &long_option, std::vector<std::string> const &long_options)
+{
+  if (late("constraint added")) {
+    return *this;
+  }
+  check_constraint({long_option}, 1);
+  check_constraint(long_options, 1);
+  _constraint_list.push_back({SchemaConstraint::REQUIRES, long_option, long_options});
+  return *this;
+}
+
+ArgParser::Command &
+ArgParser::Command::set_range(std::string const &long_option, std::string const &min, std::string const &max)
+{
+  if (late("range of option '" + long_option + "' set")) {
+    return *this;
+  }
+  check_constraint({long_option}, 1);
+  Option &option = _option_list[long_option];
+  if (option.type == ValueType::STRING || option.type == ValueType::BOOL || option.type == ValueType::ENUM) {
+    std::cerr << "Error: range of option '" + long_option + "', which is not a number" << std::endl;
+    exit(1);
+  }
+  for (std::string const &bound : {min, max}) {
+    ArgumentData::TypedValue converted;
+    if (const char *reason = bound.empty() ? nullptr : ArgumentData::convert(option.type, bound, converted)) {
+      std::cerr << "Error: invalid bound '" + bound + "' of option '" + long_option + "': " << reason << std::endl;
+      exit(1);
+    }
+  }
+  option.min = min;
+  option.max = max;
+  // the default values are checked by every parse that puts them in
+  std::vector<std::string_view> defaults(Schema::split_default(option.default_value, nullptr));
+  Schema::split_default(option.default_value, defaults.data());
+  for (std::string_view value : defaults) {
+    ArgumentData::TypedValue converted;
+    ArgumentData::convert(option.type, value, converted);
+    if (!ArgumentData::in_range(option.type, converted, option.min, option.max)) {
+      std::cerr << "Error: default value '" << value << "' of option '" + long_option + "' "
+                << ArgumentData::range_error(option.min, option.max) << std::endl;
+      exit(1);
+    }
+  }
+  return *this;
+}
+
+void
+ArgParser::Command::check_constraint(std::vector<std::string> const &long_options, size_t min_count) const
+{
+  if (long_options.size() < min_count) {
+    std::cerr << "Error: constraint between fewer than " << min_count << " options" << std::endl;
+    exit(1);
+  }
+  for (std::string const &long_option : long_options) {
+    if (_option_list.find(long_option) == _option_list.end()) {
+      std::cerr << "Error: option '" + long_option + "' of a constraint not found" << std::endl;
+      exit(1);
+    }
+  }
+}
+
+//=========================== Schema ================================
+
+void
+Schema::error(std::string_view msg)
+{
+  std::cerr << "Error: " << msg << std::endl;
+  exit(1);
+}
+
+SchemaOption const *
+Schema::find_option(SchemaCommand const &cmd, std::string_view name) const
+{
+  uint32_t hash = Schema::hash(name);
+  for (uint32_t i = hash & (cmd.slot_count - 1); cmd.slot_count; i = (i + 1) & (cmd.slot_count - 1)) {
+    SchemaSlot const &slot = slots[cmd.slot_begin + i];
+    if (!slot.entry) {
+      break;
+    }
+    if (slot.hash == hash && !(slot.entry & SchemaSlot::COMMAND)) {
+      SchemaOption const &option = options[slot.entry - 1];
+      if (option.long_option == name || option.short_option == name) {
+        return &option;
+      }
+    }
+  }
+  return nullptr;
+}
+
+SchemaCommand const *
+Schema::find_command(SchemaCommand const &cmd, std::string_view name) const
+{
+  uint32_t hash = Schema::hash(name);
+  for (uint32_t i = hash & (cmd.slot_count - 1); cmd.slot_count; i = (i + 1) & (cmd.slot_count - 1)) {
+    SchemaSlot const &slot = slots[cmd.slot_begin + i];
+    if (!slot.entry) {
       break;
     }
+    if (slot.hash == hash && (slot.entry & SchemaSlot::COMMAND)) {
+      SchemaCommand const &command = commands[(slot.entry & ~SchemaSlot::COMMAND) - 1];
+      if (command.name == name) {
+        return &command;
+      }
+    }
+  }
+  return nullptr;
+}
+
+std::vector<std::string_view>
+Schema::complete(unsigned argc, const char **argv, unsigned cword, SchemaCommand const **unbuilt) const
+{
+  std::vector<std::string_view> candidates;
+  if (cword == 0 || cword > argc) {
+    return candidates;
+  }
+  // walk the words before, skipping the arguments of the options
+  std::vector<SchemaCommand const *> chain = {commands};
+  unsigned skip                            = 0;
+  for (unsigned i = 1; i < cword; i++) {
+    std::string_view arg = argv[i];
+    if (skip > 0) {
+      skip--;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      std::string_view name = arg.substr(0, arg.find('='));
+      for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        SchemaOption const *option = find_option(**it, name);
+        if (option) {
+          skip = name.size() == arg.size() && option->arg_num < MORE_THAN_ONE_ARG_N ? option->arg_num : 0;
+          break;
+        }
+      }
+    } else if (SchemaCommand const *command = find_command(*chain.back(), arg)) {
+      chain.push_back(command);
+    }
+  }
+  if (skip > 0) {
+    // the argument of an option, left to the shell
+    return candidates;
+  }
+  SchemaCommand const &cmd = *chain.back();
+  if (chain.size() == 1 && default_command) {
+    // the options of the default command are recognized without it
+    chain.push_back(&commands[default_command]);
+  }
+  for (SchemaCommand const *command : chain) {
+    if (command->lazy && unbuilt) {
+      *unbuilt = command;
+      return candidates;
+    }
+  }
+  std::string_view word = cword < argc ? argv[cword] : "";
+  if (!word.empty() && word[0] == '-') {
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      for (auto [option, end] = option_range(**it, word); option != end; option++) {
+        candidates.push_back(option->long_option);
+      }
+    }
+  } else {
+    for (auto [command, end] = command_range(cmd, word); command != end; command++) {
+      candidates.push_back(command->name);
+    }
+  }
+  return candidates;
+}
+
+std::pair<SchemaOption const *, SchemaOption const *>
+Schema::option_range(SchemaCommand const &cmd, std::string_view prefix) const
+{
+  SchemaOption const *end = options + cmd.option_end;
+  SchemaOption const *begin =
+    std::lower_bound(options + cmd.option_begin, end, prefix,
+                     [](SchemaOption const &option, std::string_view prefix) { return option.long_option < prefix; });
+  SchemaOption const *last = begin;
+  while (last != end && last->long_option.substr(0, prefix.size()) == prefix) {
+    last++;
+  }
+  return {begin, last};
+}
+
+std::pair<SchemaCommand const *, SchemaCommand const *>
+Schema::command_range(SchemaCommand const &cmd, std::string_view prefix) const
+{
+  SchemaCommand const *end = commands + cmd.command_end;
+  SchemaCommand const *begin =
+    std::lower_bound(commands + cmd.command_begin, end, prefix,
+                     [](SchemaCommand const &command, std::string_view prefix) { return command.name < prefix; });
+  SchemaCommand const *last = begin;
+  while (last != end && last->name.substr(0, prefix.size()) == prefix) {
+    last++;
+  }
+  return {begin, last};
+}
+
+// a graceful way to output help message
+void
+Schema::help_message(SchemaCommand const &cmd, std::string_view err, int return_code) const
+{
+  output_help(std::cout, cmd, err);
+  std::cout.flush();
+  // standard return code
+  exit(return_code);
+}
+
+void
+Schema::output_help(std::ostream &out, SchemaCommand const &cmd, std::string_view err) const
+{
+  std::string text;
+  if (!err.empty()) {
+    text.append("Error: ").append(err).append("\n");
+  }
+  render_help(text, cmd);
+  out.write(text.data(), text.size());
+}
+
+void
+Schema::render_help(std::string &out, SchemaCommand const &cmd) const
+{
+  // output global usage
+  if (usage.size() > 0) {
+    out.append("\nUsage: ").append(usage).append("\n");
+  }
+  // output subcommands
+  out.append("\nCommands ---------------------- Description -----------------------\n");
+  output_command(out, cmd, 0);
+  // output options
+  if (cmd.option_end > cmd.option_begin) {
+    out.append("\nOptions ======================= Default ===== Description =============\n");
+    output_option(out, cmd);
+  }
+  // output example usage
+  if (!cmd.example_usage.empty()) {
+    out.append("\nExample Usage: ").append(cmd.example_usage).append("\n");
+  }
+}
+
+// method used by render_help(), the name in the first column and the description from INDENT_ONE on
+void
+Schema::output_command(std::string &out, SchemaCommand const &cmd, unsigned indent) const
+{
+  if (&cmd != commands && !cmd.description.empty()) {
+    size_t width = indent + cmd.name.size();
+    out.append(indent, ' ').append(cmd.name);
+    // if the command name is too long, the description goes on the next line
+    if (width > INDENT_ONE) {
+      out.append("\n");
+      width = 0;
+    }
+    out.append(INDENT_ONE - width, ' ').append(cmd.description).append("\n");
+  }
+  // recursive call
+  for (unsigned i = cmd.command_begin; i < cmd.command_end; i++) {
+    output_command(out, commands[i], indent + 2);
+  }
+}
+
+// a nicely formatted way to output option message for help: the default value from INDENT_ONE on and the
+// description from INDENT_TWO on
+void
+Schema::output_option(std::string &out, SchemaCommand const &cmd) const
+{
+  for (unsigned i = cmd.option_begin; i < cmd.option_end; i++) {
+    SchemaOption const &option = options[i];
+    if (option.description.empty()) {
+      continue;
+    }
+    size_t start = out.size();
+    if (!option.short_option.empty()) {
+      out.append(option.short_option).append(", ");
+    }
+    out.append(option.long_option);
+    unsigned num = option.arg_num;
+    if (num != 0) {
+      if (num == 1) {
+        out.append(" <arg>");
+      } else if (num == MORE_THAN_ZERO_ARG_N) {
+        out.append(" [<arg> ...]");
+      } else if (num == MORE_THAN_ONE_ARG_N) {
+        out.append(" <arg> ...");
+      } else {
+        out.append(" <arg1> ... <arg").append(std::to_string(num)).append(">");
+      }
+    }
+    if (!option.default_value.empty()) {
+      if (out.size() - start > INDENT_ONE) {
+        out.append("\n").append(INDENT_ONE, ' ');
+      } else {
+        out.append(INDENT_ONE - (out.size() - start), ' ');
+      }
+      out.append(option.default_value);
+    }
+    // the width of what comes before, counting all of it if the default value went to the next line
+    if (out.size() - start > INDENT_TWO) {
+      out.append("\n").append(INDENT_TWO, ' ');
+    } else {
+      out.append(INDENT_TWO - (out.size() - start), ' ');
+    }
+    out.append(option.description).append("\n");
+  }
+}
+
+//=========================== Parsing engine ================================
+
+void
+ArgParser::ParseState::run(SchemaCommand const *default_cmd)
+{
+  // the keys of argv, one per argument at most, then the top level and default commands and the implied ones
+  ret._data.clear();
+  ret._index_size = 0;
+  ret.reserve(argc + 2 + schema.implied_key_count);
+  ret._data_map.clear();
+  ret._given.assign(schema.constraint_count ? (schema.option_count + 63) / 64 : 0, 0);
+  ret._program = program;
+  ret._action  = nullptr;
+  cursor       = 1;
+  chain.clear();
+  eq_count.clear();
+  unknown.clear();
+  enter(schema.commands[0]);
+  if (default_cmd) {
+    enter(*default_cmd);
   }
-  if (command_called) {
-    bool flag = false;
-    // recursively call subcommand
-    for (auto &it : _subcommand_list) {
-      if (it.second.parse(ret, args)) {
-        flag = true;
+  while (cursor < argc && ok()) {
+    if (consume_option(chain.size())) {
+      continue;
+    }
+    SchemaCommand const *command = schema.find_command(*chain.back(), argv[cursor]);
+    if (!command && schema.abbreviations) {
+      command = abbreviated_command(argv[cursor]);
+      if (!ok()) {
         break;
       }
     }
-    // check for command required
-    if (!flag && _command_required) {
-      help_message("No subcommand found for " + _name);
+    if (command) {
+      cursor++;
+      enter(*command);
+    } else {
+      if (unknown.empty()) {
+        unknown_token = cursor;
+      }
+      unknown.emplace_back(argv[cursor++]);
+    }
+  }
+}
+
+void
+ArgParser::ParseState::finish()
+{
+  // check for command required
+  SchemaCommand const &last = *chain.back();
+  if (ok() && last.command_required) {
+    fail(last, ParseError::COMMAND_REQUIRED, argc, "No subcommand found for " + std::string(name(last)));
+  }
+  check_counts();
+  if (!ok()) {
+    return;
+  }
+  // put in the default value of options, and convert the values of typed ones
+  for (SchemaCommand const *command : chain) {
+    for (unsigned i = command->option_begin; i < command->option_end && ok(); i++) {
+      SchemaOption const &option = schema.options[i];
+      if (option.default_begin != option.default_end) {
+        ArgumentData &value = data(option.id);
+        if (value.empty()) {
+          value.assign_values(schema.default_values + option.default_begin, schema.default_values + option.default_end,
+                              ret._arena.get());
+        }
+      }
+      if (option.type.kind != ValueType::STRING) {
+        convert(*command, option);
+      }
+    }
+  }
+  check_constraints();
+}
+
+void
+ArgParser::ParseState::check_counts()
+{
+  // check for wrong number of arguments for --arg=...
+  for (const auto &it : eq_count) {
+    unsigned num = it.first->arg_num;
+    if (ok() && num != it.second.count && num < MORE_THAN_ONE_ARG_N) {
+      fail(*it.second.command, ParseError::ARGUMENT_NUMBER, it.second.token,
+           std::to_string(num) + " arguments expected by " + std::string(it.first->long_option));
+    }
+  }
+}
+
+void
+ArgParser::ParseState::apply()
+{
+  // the commands entered by the parse, a single subcommand of each one
+  for (SchemaCommand const *command = schema.commands; command;) {
+    chain.push_back(command);
+    SchemaCommand const *next = nullptr;
+    for (unsigned i = command->command_begin; i < command->command_end && !next; i++) {
+      if (ArgumentData const *value = ret.find(schema.commands[i].id); value && *value) {
+        next = &schema.commands[i];
+      }
+    }
+    command = next;
+  }
+  // an option per token at most
+  ret.reserve(argc);
+  delta = true;
+  while (cursor < argc && ok()) {
+    if (!consume_option(chain.size())) {
+      if (unknown.empty()) {
+        unknown_token = cursor;
+      }
+      unknown.emplace_back(argv[cursor++]);
+    }
+  }
+  check_counts();
+  if (ok() && !unknown.empty()) {
+    std::string msg = "Unknown option or args:";
+    for (const auto &it : unknown) {
+      msg.append(" '").append(it).append("'");
+    }
+    fail(*chain.back(), ParseError::UNKNOWN_ARGUMENT, unknown_token, msg);
+  }
+  // the default value and the conversion of the options given only
+  for (unsigned i = 0; i < touched.size() && ok(); i++) {
+    SchemaOption const &option = *touched[i].option;
+    ArgumentData &value        = *ret.find(option.id);
+    if (option.default_begin != option.default_end && value.empty()) {
+      value.assign_values(schema.default_values + option.default_begin, schema.default_values + option.default_end,
+                          ret._arena.get());
+    }
+    if (option.type.kind != ValueType::STRING) {
+      convert(*touched[i].owner, option);
+    }
+  }
+  check_constraints();
+}
+
+void
+ArgParser::ParseState::check_constraints()
+{
+  if (ret._given.empty() || !ok()) {
+    return;
+  }
+  for (SchemaCommand const *command : chain) {
+    for (unsigned i = command->constraint_begin; i < command->constraint_end && ok(); i++) {
+      SchemaConstraint const &constraint = schema.constraints[i];
+      uint64_t const *mask               = schema.constraint_masks + constraint.mask_begin;
+      uint64_t const *given              = ret._given.data() + constraint.word;
+      // a word at a time: whether any, several or not all of the options are given
+      bool any     = false;
+      bool several = false;
+      bool missing = false;
+      for (unsigned w = 0; w < constraint.mask_end - constraint.mask_begin; w++) {
+        uint64_t bits = given[w] & mask[w];
+        several |= (any && bits) || (bits & (bits - 1));
+        any |= bits != 0;
+        missing |= bits != mask[w];
+      }
+      if (constraint.kind == SchemaConstraint::EXCLUSIVE && several) {
+        fail(*command, ParseError::CONSTRAINT, argc, constraint_options(constraint, true, true) + " cannot be given together");
+      } else if (constraint.kind == SchemaConstraint::ONE_OF && !any) {
+        fail(*command, ParseError::CONSTRAINT, argc, "one of " + constraint_options(constraint, false, false) + " is required");
+      } else if (constraint.kind == SchemaConstraint::REQUIRES && missing &&
+                 (ret._given[constraint.option / 64] >> (constraint.option % 64) & 1)) {
+        std::string option = std::string(schema.options[constraint.option].long_option);
+        fail(*command, ParseError::CONSTRAINT, argc, option + " requires " + constraint_options(constraint, true, false));
+      }
+    }
+  }
+}
+
+std::string
+ArgParser::ParseState::constraint_options(SchemaConstraint const &constraint, bool given, bool set) const
+{
+  std::string names;
+  for (unsigned w = 0; w < constraint.mask_end - constraint.mask_begin; w++) {
+    uint64_t bits = schema.constraint_masks[constraint.mask_begin + w];
+    if (given) {
+      bits &= set ? ret._given[constraint.word + w] : ~ret._given[constraint.word + w];
+    }
+    for (unsigned bit = 0; bit < 64; bit++) {
+      if (bits >> bit & 1) {
+        names.append(names.empty() ? "" : ", ").append(schema.options[(constraint.word + w) * 64 + bit].long_option);
+      }
+    }
+  }
+  return names;
+}
+
+void
+ArgParser::ParseState::touch(SchemaCommand const &owner, SchemaOption const &option)
+{
+  for (Touched const &it : touched) {
+    if (it.option->id == option.id) {
+      return;
+    }
+  }
+  ArgumentData &value = ret.insert(option.id);
+  unsigned index      = &option - schema.options;
+  touched.push_back({&owner, &option, ArgumentData(), !ret._given.empty() && (ret._given[index / 64] >> (index % 64) & 1)});
+  touched.back().before.share(value);
+  if (!ret._given.empty()) {
+    ret._given[index / 64] &= ~(uint64_t(1) << (index % 64));
+  }
+  value.clear_values();
+  value._run_count   = 0;
+  value._typed_count = 0;
+  value._env_value   = {};
+}
+
+void
+ArgParser::ParseState::convert(SchemaCommand const &owner, SchemaOption const &option)
+{
+  ArgumentData &value = ret.insert(option.id);
+  size_t count        = value.size();
+  value._type         = option.type.kind;
+  if (count == 0) {
+    return;
+  }
+  value._typed = static_cast<ArgumentData::TypedValue *>(
+    ret._arena->allocate(count * sizeof(ArgumentData::TypedValue), alignof(ArgumentData::TypedValue)));
+  for (std::string_view arg : value) {
+    if (const char *reason = ArgumentData::convert(option.type, arg, value._typed[value._typed_count])) {
+      std::string msg = "invalid value '" + std::string(arg) + "' for " + std::string(option.long_option) + ": " + reason;
+      if (option.type.kind == ValueType::ENUM) {
+        msg.append(option.type.choices);
+      }
+      fail(owner, ParseError::INVALID_VALUE, token(arg), msg);
+      return;
+    }
+    if ((!option.min.empty() || !option.max.empty()) &&
+        !ArgumentData::in_range(option.type.kind, value._typed[value._typed_count], option.min, option.max)) {
+      fail(owner, ParseError::INVALID_VALUE, token(arg),
+           "invalid value '" + std::string(arg) + "' for " + std::string(option.long_option) + ": " +
+             ArgumentData::range_error(option.min, option.max));
+      return;
+    }
+    value._typed_count++;
+  }
+}
+
+void
+ArgParser::ParseState::enter(SchemaCommand const &cmd)
+{
+  if (cmd.lazy) {
+    unbuilt = &cmd;
+    return;
+  }
+  chain.push_back(&cmd);
+  ArgumentData &command_data = data(cmd.id);
+  command_data.clear_values();
+  command_data._run_count = 0;
+  command_data._env_value = {};
+  // handle the action
+  if (cmd.action) {
+    ret._action = cmd.action;
+  }
+  // set ENV var
+  if (!cmd.envvar.empty()) {
+    command_data._env_value = env_value(cmd.env_id);
+  }
+  take_args(cmd, key(cmd), cmd.id, cmd.arg_num, chain.size());
+}
+
+bool
+ArgParser::ParseState::consume_option(unsigned limit)
+{
+  std::string_view arg = argv[cursor];
+  // deal with --args=
+  bool with_value                = arg.substr(0, 2) == "--" && arg.find('=') != std::string_view::npos;
+  std::string_view option_name   = with_value ? arg.substr(0, arg.find_first_of('=')) : arg;
+  SchemaOption const *cur_option = nullptr;
+  unsigned level                 = 0;
+  for (; level < limit; level++) {
+    SchemaCommand const &command = *chain[level];
+    if (!with_value) {
+      // output version message
+      if ((arg == "--version" || arg == "-V") && schema.find_option(command, "--version")) {
+        fail(command, ParseError::VERSION, cursor, "");
+        return true;
+      }
+      // output help message of the command we are at
+      if ((arg == "--help" || arg == "-h") && schema.find_option(command, "--help")) {
+        fail(*chain.back(), ParseError::HELP, cursor, "");
+        return true;
+      }
+    }
+    cur_option = schema.find_option(command, option_name);
+    if (cur_option) {
+      break;
+    }
+  }
+  if (!cur_option && schema.abbreviations) {
+    cur_option = abbreviated_option(option_name, limit, level);
+    if (!ok()) {
+      return true;
+    }
+  }
+  if (!cur_option) {
+    return false;
+  }
+  if (delta) {
+    touch(*chain[level], *cur_option);
+  }
+  if (!ret._given.empty()) {
+    unsigned index = cur_option - schema.options;
+    ret._given[index / 64] |= uint64_t(1) << (index % 64);
+  }
+  ArgumentData &option_data = data(cur_option->id);
+  if (with_value) {
+    std::string_view value = arg.substr(arg.find_last_of('=') + 1);
+    if (value.empty()) {
+      fail(*chain[level], ParseError::MISSING_ARGUMENT, cursor, "missing argument for '" + std::string(option_name) + "'");
+      return true;
+    }
+    // handle environment variable
+    if (!cur_option->envvar.empty()) {
+      option_data._env_value = env_value(cur_option->env_id);
+    }
+    option_data.push_value(value, ret._arena.get());
+    EqCount &count = eq_count[cur_option];
+    count.command  = chain[level];
+    count.count += 1;
+    count.token = cursor++;
+    return true;
+  }
+  // deal with normal --arg val1 val2 ...
+  cursor++;
+  option_data.clear_values();
+  option_data._run_count = 0;
+  option_data._env_value = {};
+  // the arguments of an option can only be interrupted by options of the outer commands
+  take_args(*chain[level], cur_option->key, cur_option->id, cur_option->arg_num, level);
+  // handle environment variable
+  if (!cur_option->envvar.empty()) {
+    option_data._env_value = env_value(cur_option->env_id);
+  }
+  return true;
+}
+
+SchemaOption const *
+ArgParser::ParseState::abbreviated_option(std::string_view name, unsigned limit, unsigned &level)
+{
+  if (name.size() <= 2 || name.substr(0, 2) != "--") {
+    return nullptr;
+  }
+  // the same long option in several commands is the one of the outermost, as when given in full
+  SchemaOption const *found = nullptr;
+  bool ambiguous            = false;
+  for (unsigned i = 0; i < limit; i++) {
+    for (auto [option, end] = schema.option_range(*chain[i], name); option != end; option++) {
+      if (!found) {
+        found = option;
+        level = i;
+      } else if (option->long_option != found->long_option) {
+        ambiguous = true;
+      }
+    }
+  }
+  if (ambiguous) {
+    std::vector<std::string_view> candidates;
+    for (unsigned i = 0; i < limit; i++) {
+      for (auto [option, end] = schema.option_range(*chain[i], name); option != end; option++) {
+        if (std::find(candidates.begin(), candidates.end(), option->long_option) == candidates.end()) {
+          candidates.push_back(option->long_option);
+        }
+      }
+    }
+    std::string msg = "ambiguous option '" + std::string(name) + "', could be";
+    for (std::string_view candidate : candidates) {
+      msg.append(" ").append(candidate);
+    }
+    fail(*chain.back(), ParseError::AMBIGUOUS, cursor, msg);
+    return nullptr;
+  }
+  return found;
+}
+
+SchemaCommand const *
+ArgParser::ParseState::abbreviated_command(std::string_view name)
+{
+  if (name.empty() || name[0] == '-') {
+    return nullptr;
+  }
+  auto [command, end] = schema.command_range(*chain.back(), name);
+  if (end - command > 1) {
+    std::string msg = "ambiguous command '" + std::string(name) + "', could be";
+    for (; command != end; command++) {
+      msg.append(" ").append(command->name);
+    }
+    fail(*chain.back(), ParseError::AMBIGUOUS, cursor, msg);
+    return nullptr;
+  }
+  return command != end ? command : nullptr;
+}
+
+void
+ArgParser::ParseState::take_args(SchemaCommand const &owner, std::string_view key, unsigned id, unsigned arg_num, unsigned limit)
+{
+  ArgumentData &value = data(id);
+  if (arg_num == MORE_THAN_ZERO_ARG_N || arg_num == MORE_THAN_ONE_ARG_N) {
+    // infinite arguments, not copied: the data only keeps the runs of them in between the options
+    size_t taken = 0;
+    while (cursor < argc && ok()) {
+      if (!consume_option(limit)) {
+        add_run(value, argv + cursor++);
+        taken++;
+      }
+    }
+    if (arg_num == MORE_THAN_ONE_ARG_N && taken == 0) {
+      fail(owner, ParseError::MISSING_ARGUMENT, cursor, "at least one argument expected by " + std::string(key));
+    }
+    return;
+  }
+  // finite number of argument handling
+  for (unsigned j = 0; j < arg_num && ok(); j++) {
+    while (cursor < argc && ok() && consume_option(limit)) {
     }
-    if (_name == parser_program_name) {
-      // if we are at the top level
-      return flag;
+    if (cursor >= argc || argv[cursor].empty()) {
+      fail(owner, ParseError::MISSING_ARGUMENT, cursor, std::to_string(arg_num) + " argument(s) expected by " + std::string(key));
+      return;
     }
+    value.push_value(argv[cursor++], ret._arena.get());
+  }
+}
+
+void
+ArgParser::ParseState::add_run(ArgumentData &value, std::string_view const *arg)
+{
+  if (value._run_count > 0 && value._runs[value._run_count - 1].last == arg) {
+    value._runs[value._run_count - 1].last++;
+    return;
+  }
+  // one more run than the options given in between the values, usually a single one. The capacity is the
+  // run count rounded up to a power of 2.
+  unsigned count = value._run_count;
+  if ((count & (count - 1)) == 0) {
+    auto runs = static_cast<ArgumentData::Run *>(
+      ret._arena->allocate((count ? 2 * count : 1) * sizeof(ArgumentData::Run), alignof(ArgumentData::Run)));
+    std::copy(value._runs, value._runs + count, runs);
+    value._runs = runs;
+  }
+  value._runs[value._run_count++] = {arg, arg + 1};
+}
+
+void
+ArgParser::ParseState::fail(SchemaCommand const &cmd, ParseError::Kind kind, unsigned token, std::string const &msg)
+{
+  if (ok()) {
+    err_kind    = kind;
+    err_token   = token;
+    err_command = &cmd;
+    err         = msg;
+  }
+}
+
+ArgumentData &
+ArgParser::ParseState::data(unsigned id)
+{
+  ArgumentData &value = ret.insert(id);
+  value._is_called    = true;
+  return value;
+}
+
+ArgParser::Command &
+ArgParser::Command::require_commands()
+{
+  if (late("subcommands required")) {
+    return *this;
+  }
+  _command_required = true;
+  return *this;
+}
+
+ArgParser::Command &
+ArgParser::Command::set_default()
+{
+  if (late("default command set")) {
+    return *this;
+  }
+  _is_default = true;
+  return *this;
+}
+
+//=========================== ParseError ================================
+
+std::string
+ParseError::help() const
+{
+  if (!schema || !command) {
+    return message;
+  }
+  std::string text;
+  if (kind != HELP && kind != VERSION && !message.empty()) {
+    text.append("Error: ").append(message).append("\n");
+  }
+  schema->render_help(text, *command);
+  return text;
+}
+
+int
+ParseError::return_code() const noexcept
+{
+  switch (kind) {
+  case NONE:
+  case HELP:
+  case VERSION:
+  case COMPLETE:
+    // if -h or --help is called specifically, return 0
+    return 0;
+  case INVALID_ARGV:
+  case FROZEN:
+    return 1;
+  default:
+    // by default return EX_USAGE(64) when usage is called.
+    return EX_USAGE;
+  }
+}
+
+//=========================== Arguments class ================================
+
+Arguments::Arguments() {}
+
+Arguments::Arguments(Arguments const &other)
+  : _data(other._data.size()),
+    _index(other._index),
+    _index_size(other._index_size),
+    _program(other._program),
+    _action(other._action),
+    _arena(other._arena),
+    _schema(other._schema),
+    _files(other._files),
+    _given(other._given)
+{
+  // the data are views of the storage shared with other, not copies of their own
+  for (size_t i = 0; i < _data.size(); i++) {
+    _data[i].share(other._data[i]);
+  }
+  for (const auto &it : other._data_map) {
+    _data_map.emplace_hint(_data_map.end(), it.first, ArgumentData())->second.share(it.second);
   }
-  return command_called;
 }
 
-ArgParser::Command &
-ArgParser::Command::require_commands()
+Arguments::~Arguments()
 {
-  _command_required = true;
-  return *this;
+  // the values have to go before the arena they are allocated from
+  _data.clear();
 }
 
-ArgParser::Command &
-ArgParser::Command::set_default()
+Arguments &
+Arguments::operator=(Arguments const &other)
 {
-  default_command = _name;
-  return *this;
+  return *this = Arguments(other);
 }
 
-//=========================== Arguments class ================================
-
-Arguments::Arguments() {}
-Arguments::~Arguments() {}
+ArgumentData const &
+Arguments::get(std::string_view name) const
+{
+  static const ArgumentData not_found;
+  if (ArgumentData const *value = find(index(name))) {
+    return *value;
+  }
+  auto it = _data_map.find(name);
+  return it == _data_map.end() ? not_found : it->second;
+}
 
-ArgumentData
-Arguments::get(std::string const &name)
+ArgumentData const &
+Arguments::get(ArgKey key) const
 {
-  if (_data_map.find(name) != _data_map.end()) {
-    _data_map[name]._is_called = true;
-    return _data_map[name];
+  static const ArgumentData not_found;
+  if (ArgumentData const *value = find(key.id)) {
+    return *value;
+  }
+  // appended after the parse
+  if (_data_map.empty() || !_schema || key.id >= _schema->key_count) {
+    return not_found;
   }
-  return ArgumentData();
+  auto it = _data_map.find(key.id ? _schema->keys[key.id] : _program);
+  return it == _data_map.end() ? not_found : it->second;
 }
 
 void
 Arguments::append(std::string const &key, ArgumentData const &value)
 {
   // perform overwrite for now
-  _data_map[key] = value;
+  ArgumentData &data = this->data(key);
+  if (&data == &value) {
+    return;
+  }
+  // the values are copied into the arena, as the ones of a parse
+  data.clear_values();
+  data._run_count = 0;
+  for (std::string_view arg : value) {
+    std::string_view owned = own(arg);
+    data.push_value(owned, _arena.get());
+  }
+  data._env_value   = own(value._env_value);
+  data._type        = value._type;
+  data._typed_count = value._typed_count;
+  if (value._typed_count) {
+    data._typed = static_cast<ArgumentData::TypedValue *>(
+      arena()->allocate(value._typed_count * sizeof(ArgumentData::TypedValue), alignof(ArgumentData::TypedValue)));
+    std::copy(value._typed, value._typed + value._typed_count, data._typed);
+  }
 }
 
 void
 Arguments::append_arg(std::string const &key, std::string const &value)
 {
-  _data_map[key]._values.push_back(value);
+  std::string_view owned = own(value);
+  data(key).push_value(owned, _arena.get());
 }
 
 void
 Arguments::set_env(std::string const &key, std::string const &value)
 {
   // perform overwrite for now
-  _data_map[key]._env_value = value;
+  std::string_view owned = own(value);
+  ArgumentData &data     = this->data(key);
+  data.clear_strings();
+  data._env_value = owned;
+}
+
+ArgumentData &
+Arguments::data(std::string_view key)
+{
+  // the keys the parse did not give go to _data_map, so that _data never grows after the parse
+  ArgumentData *found = find(index(key));
+  ArgumentData &value = found ? *found : _data_map.emplace(key, ArgumentData()).first->second;
+  value._is_called    = true;
+  return value;
+}
+
+unsigned
+Arguments::index(std::string_view key) const
+{
+  if (!_schema) {
+    return NOT_FOUND;
+  }
+  if (key == _program) {
+    return 0;
+  }
+  unsigned id = _schema->find_key(key);
+  return id ? id : NOT_FOUND;
+}
+
+ArgumentData *
+Arguments::find(unsigned id) const
+{
+  for (unsigned i = id & (_index_size - 1); _index_size; i = (i + 1) & (_index_size - 1)) {
+    if (!_index[i].pos) {
+      break;
+    }
+    if (_index[i].id == id) {
+      // a moved-from object keeps the table of the data it lost
+      return _index[i].pos <= _data.size() ? const_cast<ArgumentData *>(&_data[_index[i].pos - 1]) : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+ArgumentData &
+Arguments::insert(unsigned id)
+{
+  unsigned i = id & (_index_size - 1);
+  for (; _index[i].pos; i = (i + 1) & (_index_size - 1)) {
+    if (_index[i].id == id) {
+      return _data[_index[i].pos - 1];
+    }
+  }
+  // past what reserve() made room for, the data would move under the references taken by the parse
+  assert(_data.size() < _data.capacity() && "more data than reserved for the parse");
+  _index[i] = {id, static_cast<unsigned>(_data.size() + 1)};
+  return _data.emplace_back();
+}
+
+void
+Arguments::reserve(unsigned count)
+{
+  // reserved once per parse, the references to the data stay valid until the next one
+  _data.reserve(_data.size() + count);
+  Slot const *old   = _index;
+  unsigned old_size = _index_size;
+  _index_size       = Schema::slot_count(_data.size() + count);
+  _index            = static_cast<Slot *>(arena()->allocate(_index_size * sizeof(Slot), alignof(Slot)));
+  std::fill(_index, _index + _index_size, Slot{0, 0});
+  for (unsigned i = 0; i < old_size; i++) {
+    if (old[i].pos) {
+      unsigned j = old[i].id & (_index_size - 1);
+      while (_index[j].pos) {
+        j = (j + 1) & (_index_size - 1);
+      }
+      _index[j] = old[i];
+    }
+  }
+}
+
+std::pmr::memory_resource *
+Arguments::arena()
+{
+  // a copy sharing the arena is the only other owner of it, nobody else can get it while this one is changed
+  if (!_arena || _arena.use_count() > 1) {
+    auto arena    = std::make_shared<Arena>();
+    arena->parent = std::move(_arena);
+    _arena        = std::move(arena);
+  }
+  return _arena.get();
+}
+
+std::string_view
+Arguments::own(std::string_view s)
+{
+  char *p = static_cast<char *>(arena()->allocate(s.size(), 1));
+  return {static_cast<char *>(memcpy(p, s.data(), s.size())), s.size()};
 }
 
 void
 Arguments::show_all_configuration() const
 {
-  for (const auto &it : _data_map) {
-    std::cout << "name: " + it.first << std::endl;
+  auto show = [](std::string_view name, ArgumentData const &data) {
+    std::cout << "name: " << name << std::endl;
     std::string msg;
     msg = "args value:";
-    for (const auto &it_data : it.second._values) {
-      msg += " " + it_data;
+    for (const auto &it_data : data) {
+      msg.append(" ").append(it_data);
     }
     std::cout << msg << std::endl;
-    std::cout << "env value: " + it.second._env_value << std::endl << std::endl;
+    std::cout << "env value: " << data._env_value << std::endl << std::endl;
+  };
+  // sorted by name, whether in the schema or not
+  std::vector<std::pair<std::string_view, ArgumentData const *>> all;
+  for (unsigned i = 0; i < _index_size; i++) {
+    if (_index[i].pos && _data[_index[i].pos - 1]._is_called) {
+      all.emplace_back(_index[i].id ? _schema->keys[_index[i].id] : _program, &_data[_index[i].pos - 1]);
+    }
+  }
+  for (const auto &it : _data_map) {
+    all.emplace_back(it.first, &it.second);
+  }
+  std::sort(all.begin(), all.end());
+  for (const auto &it : all) {
+    show(it.first, *it.second);
   }
 }
 
 // invoke the function with the args
 void
-Arguments::invoke()
+Arguments::invoke() const
 {
   if (_action) {
     // call the std::function
-    _action();
+    (*_action)();
   } else {
     throw std::runtime_error("no function to invoke");
   }
@@ -616,54 +2664,663 @@ Arguments::has_action() const
 
 //=========================== ArgumentData class ================================
 
+static_assert(sizeof(ArgumentData) <= 72, "the data of a look-up key fits in a cache line and a pointer");
+
+ArgumentData::ArgumentData(ArgumentData const &other) : _is_called(other._is_called), _type(other._type)
+{
+  // the values are copied into strings of its own, which the views point into
+  auto strings = new Strings{std::string(other._env_value), {other.begin(), other.end()},
+                             {other._typed, other._typed + other._typed_count}, {}, {}};
+  for (std::string const &value : strings->values) {
+    push_value(value, nullptr);
+  }
+  _env_value   = strings->env;
+  _typed       = strings->typed.data();
+  _typed_count = other._typed_count;
+  _strings.store(strings, std::memory_order_relaxed);
+}
+
+ArgumentData::ArgumentData(ArgumentData &&other) noexcept
+{
+  *this = std::move(other);
+}
+
+ArgumentData &
+ArgumentData::operator=(ArgumentData const &other)
+{
+  if (this != &other) {
+    *this = ArgumentData(other);
+  }
+  return *this;
+}
+
+ArgumentData &
+ArgumentData::operator=(ArgumentData &&other) noexcept
+{
+  if (this == &other) {
+    return *this;
+  }
+  clear_values();
+  if (other._count <= 1) {
+    _value = other._value;
+  } else {
+    _array = other._array;
+  }
+  _env_value   = other._env_value;
+  _runs        = other._runs;
+  _typed       = other._typed;
+  _count       = other._count;
+  _run_count   = other._run_count;
+  _typed_count = other._typed_count;
+  _is_called   = other._is_called;
+  _type        = other._type;
+  _owned       = other._owned;
+  _strings.store(other._strings.exchange(nullptr, std::memory_order_relaxed), std::memory_order_relaxed);
+  // nothing left pointing into the values taken
+  other._env_value   = {};
+  other._count       = 0;
+  other._run_count   = 0;
+  other._typed_count = 0;
+  other._owned       = false;
+  return *this;
+}
+
+void
+ArgumentData::share(ArgumentData const &other)
+{
+  assign_values(other.values(), other.values() + other._count, nullptr);
+  _env_value   = other._env_value;
+  _runs        = other._runs;
+  _typed       = other._typed;
+  _run_count   = other._run_count;
+  _typed_count = other._typed_count;
+  _is_called   = other._is_called;
+  _type        = other._type;
+}
+
+ArgumentData::Strings &
+ArgumentData::strings() const
+{
+  Strings *strings = _strings.load(std::memory_order_acquire);
+  if (strings) {
+    return *strings;
+  }
+  // the threads reading the data at the same time make them each, the first one to store them wins. The values are
+  // left to at(), which only makes the ones asked for.
+  std::unique_ptr<Strings> made(new Strings{std::string(_env_value), {}, {}, {}, {}});
+  if (_strings.compare_exchange_strong(strings, made.get(), std::memory_order_acq_rel)) {
+    return *made.release();
+  }
+  return *strings;
+}
+
+void
+ArgumentData::clear_strings() noexcept
+{
+  delete _strings.exchange(nullptr, std::memory_order_relaxed);
+}
+
+ArgumentData::~ArgumentData()
+{
+  clear_values();
+}
+
+unsigned
+ArgumentData::capacity(unsigned count) noexcept
+{
+  unsigned capacity = 2;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+std::string_view *
+ArgumentData::allocate_values(unsigned capacity, std::pmr::memory_resource *resource)
+{
+  if (!resource) {
+    return new std::string_view[capacity];
+  }
+  return static_cast<std::string_view *>(resource->allocate(capacity * sizeof(std::string_view), alignof(std::string_view)));
+}
+
+void
+ArgumentData::push_value(std::string_view value, std::pmr::memory_resource *resource)
+{
+  clear_strings();
+  if (_count == 0) {
+    _value = value;
+    _count = 1;
+    return;
+  }
+  // the inline value or the array is full when the count is a power of 2
+  if ((_count & (_count - 1)) == 0) {
+    unsigned count          = _count;
+    std::string_view *array = allocate_values(capacity(count + 1), resource);
+    std::copy(values(), values() + count, array);
+    clear_values();
+    _array = array;
+    _count = count;
+    _owned = !resource;
+  }
+  _array[_count++] = value;
+}
+
+void
+ArgumentData::assign_values(std::string_view const *first, std::string_view const *last, std::pmr::memory_resource *resource)
+{
+  clear_values();
+  unsigned count = last - first;
+  if (count <= 1) {
+    _value = count ? *first : std::string_view();
+  } else {
+    _array = allocate_values(capacity(count), resource);
+    _owned = !resource;
+    std::copy(first, last, _array);
+  }
+  _count = count;
+}
+
+void
+ArgumentData::clear_values() noexcept
+{
+  if (_owned) {
+    delete[] _array;
+    _owned = false;
+  }
+  _count = 0;
+  clear_strings();
+}
+
 std::string const &
-ArgumentData::env() const noexcept
+ArgumentData::env() const
 {
-  return _env_value;
+  return strings().env;
 }
 
 std::string const &
 ArgumentData::at(unsigned index) const
 {
-  if (index >= _values.size()) {
+  if (index >= size()) {
     throw std::out_of_range("argument not fonud at index: " + std::to_string(index));
   }
-  return _values.at(index);
+  Strings &strings = this->strings();
+  if (!strings.values.empty()) {
+    return strings.values[index];
+  }
+  // a single value of a variadic option, not the whole of its runs
+  std::lock_guard<std::mutex> lock(strings.mutex);
+  auto [it, added] = strings.made.try_emplace(index);
+  if (added) {
+    it->second = at_view(index);
+  }
+  return it->second;
 }
 
 std::string const &
-ArgumentData::value() const noexcept
+ArgumentData::value() const
+{
+  static const std::string empty;
+  return _count == 0 && _run_count == 0 ? empty : at(0);
+}
+
+std::string_view
+ArgumentData::env_view() const noexcept
+{
+  return _env_value;
+}
+
+std::string_view
+ArgumentData::at_view(unsigned index) const
+{
+  size_t rest = index;
+  for (unsigned i = 0; i < _run_count; i++) {
+    size_t length = _runs[i].last - _runs[i].first;
+    if (rest < length) {
+      return _runs[i].first[rest];
+    }
+    rest -= length;
+  }
+  if (rest < _count) {
+    return values()[rest];
+  }
+  throw std::out_of_range("argument not fonud at index: " + std::to_string(index));
+}
+
+std::string_view
+ArgumentData::value_view() const noexcept
 {
-  if (_values.empty()) {
-    // To prevent compiler warning
-    static const std::string empty = "";
-    return empty;
+  if (_run_count > 0) {
+    return *_runs[0].first;
   }
-  return _values.at(0);
+  return _count > 0 ? values()[0] : std::string_view();
 }
 
 size_t
 ArgumentData::size() const noexcept
 {
-  return _values.size();
+  size_t size = _count;
+  for (unsigned i = 0; i < _run_count; i++) {
+    size += _runs[i].last - _runs[i].first;
+  }
+  return size;
 }
 
 bool
 ArgumentData::empty() const noexcept
 {
-  return _values.empty() && _env_value.empty();
+  return _count == 0 && _run_count == 0 && _env_value.empty();
 }
 
-AP_StrVec::const_iterator
+ArgumentData::const_iterator
 ArgumentData::begin() const noexcept
 {
-  return _values.begin();
+  if (_run_count == 0) {
+    return {values(), values() + _count, _runs, _runs, {}};
+  }
+  Run stored = _count > 0 ? Run{values(), values() + _count} : Run{};
+  return {_runs[0].first, _runs[0].last, _runs + 1, _runs + _run_count, stored};
 }
 
-AP_StrVec::const_iterator
+ArgumentData::const_iterator
 ArgumentData::end() const noexcept
 {
-  return _values.end();
+  std::string_view const *last = _count > 0 || _run_count == 0 ? values() + _count : _runs[_run_count - 1].last;
+  return {last, last, _runs + _run_count, _runs + _run_count, {}};
+}
+
+int64_t
+ArgumentData::as_int(unsigned index) const
+{
+  return typed(ValueType::INT, index).i;
+}
+
+uint64_t
+ArgumentData::as_unsigned(unsigned index) const
+{
+  return typed(ValueType::UNSIGNED, index).u;
+}
+
+double
+ArgumentData::as_double(unsigned index) const
+{
+  return typed(ValueType::DOUBLE, index).d;
+}
+
+bool
+ArgumentData::as_bool(unsigned index) const
+{
+  return typed(ValueType::BOOL, index).b;
+}
+
+uint64_t
+ArgumentData::as_bytes(unsigned index) const
+{
+  return typed(ValueType::BYTES, index).u;
+}
+
+std::chrono::nanoseconds
+ArgumentData::as_duration(unsigned index) const
+{
+  return std::chrono::nanoseconds(typed(ValueType::DURATION, index).i);
+}
+
+unsigned
+ArgumentData::as_enum(unsigned index) const
+{
+  return typed(ValueType::ENUM, index).u;
+}
+
+ArgumentData::TypedValue const &
+ArgumentData::typed(ValueType::Kind kind, unsigned index) const
+{
+  if (index >= _typed_count) {
+    throw std::out_of_range("converted argument not found at index: " + std::to_string(index));
+  }
+  if (kind != _type) {
+    throw std::invalid_argument("argument converted to another type");
+  }
+  return _typed[index];
+}
+
+const char *
+ArgumentData::convert(ValueType type, std::string_view value, TypedValue &out)
+{
+  const char *first = value.data();
+  const char *last  = value.data() + value.size();
+  std::from_chars_result result{first, std::errc::invalid_argument};
+  const char *invalid = "not a number";
+  switch (type.kind) {
+  case ValueType::STRING:
+    return nullptr;
+  case ValueType::INT:
+    result  = std::from_chars(first, last, out.i);
+    invalid = "not an integer";
+    break;
+  case ValueType::UNSIGNED:
+    result  = std::from_chars(first, last, out.u);
+    invalid = "not an unsigned integer";
+    break;
+  case ValueType::DOUBLE:
+    result = std::from_chars(first, last, out.d);
+    break;
+  case ValueType::BOOL:
+    if (value == "true" || value == "yes" || value == "on" || value == "1") {
+      out.b = true;
+      return nullptr;
+    }
+    if (value == "false" || value == "no" || value == "off" || value == "0") {
+      out.b = false;
+      return nullptr;
+    }
+    return "not a boolean";
+  case ValueType::BYTES:
+    result  = std::from_chars(first, last, out.u);
+    invalid = "not a size";
+    if (result.ec == std::errc() && result.ptr != last) {
+      // a binary suffix, then an optional B
+      constexpr std::string_view suffixes = "KMGTPE";
+      size_t suffix                       = suffixes.find(toupper(*result.ptr));
+      if (suffix != std::string_view::npos) {
+        unsigned shift = 10 * (suffix + 1);
+        if (out.u > std::numeric_limits<uint64_t>::max() >> shift) {
+          return "out of range";
+        }
+        out.u <<= shift;
+        result.ptr++;
+      }
+      if (result.ptr != last && *result.ptr == 'B') {
+        result.ptr++;
+      }
+    }
+    break;
+  case ValueType::DURATION:
+    result  = std::from_chars(first, last, out.i);
+    invalid = "not a duration";
+    if (result.ec == std::errc()) {
+      // the number of nanoseconds of a unit, seconds without one
+      static constexpr std::pair<std::string_view, int64_t> units[] = {
+        {"", 1000000000}, {"ns", 1}, {"us", 1000}, {"ms", 1000000}, {"s", 1000000000}, {"m", 60000000000},
+        {"h", 3600000000000}, {"d", 86400000000000}};
+      std::string_view unit(result.ptr, last - result.ptr);
+      auto it = std::find_if(std::begin(units), std::end(units), [unit](auto const &u) { return u.first == unit; });
+      if (it == std::end(units)) {
+        return "unknown unit, expected ns, us, ms, s, m, h or d";
+      }
+      if (out.i > std::numeric_limits<int64_t>::max() / it->second || out.i < std::numeric_limits<int64_t>::min() / it->second) {
+        return "out of range";
+      }
+      out.i *= it->second;
+      return nullptr;
+    }
+    break;
+  case ValueType::ENUM:
+    out.u = 0;
+    for (std::string_view choices = type.choices;; out.u++) {
+      size_t end = choices.find('|');
+      if (choices.substr(0, end) == value) {
+        return nullptr;
+      }
+      if (end == std::string_view::npos) {
+        return "expected one of ";
+      }
+      choices.remove_prefix(end + 1);
+    }
+  }
+  if (result.ec == std::errc::result_out_of_range) {
+    return "out of range";
+  }
+  if (result.ec != std::errc() || result.ptr != last) {
+    return invalid;
+  }
+  return nullptr;
+}
+
+bool
+ArgumentData::in_range(ValueType::Kind kind, TypedValue value, std::string_view min, std::string_view max)
+{
+  // -1, 0 or 1 as the value is below, within or above the bound, below or above an invalid one
+  auto compare = [kind, value](std::string_view bound, int invalid) {
+    TypedValue b;
+    if (convert(kind, bound, b)) {
+      return invalid;
+    }
+    switch (kind) {
+    case ValueType::INT:
+    case ValueType::DURATION:
+      return value.i < b.i ? -1 : value.i > b.i;
+    case ValueType::DOUBLE:
+      return value.d < b.d ? -1 : value.d > b.d;
+    default:
+      return value.u < b.u ? -1 : value.u > b.u;
+    }
+  };
+  return (min.empty() || compare(min, -1) >= 0) && (max.empty() || compare(max, 1) <= 0);
+}
+
+std::string
+ArgumentData::range_error(std::string_view min, std::string_view max)
+{
+  if (max.empty()) {
+    return "less than " + std::string(min);
+  }
+  if (min.empty()) {
+    return "greater than " + std::string(max);
+  }
+  return "not between " + std::string(min) + " and " + std::string(max);
+}
+
+//=========================== Executor ================================
+
+struct Executor::Pool {
+  // The part of the batch left to a thread, [front, back) packed in a word for both ends to move atomically. The
+  // thread takes from the front, the others steal from the back.
+  struct alignas(64) Range {
+    std::atomic<uint64_t> bounds{0};
+  };
+  static uint64_t pack(uint64_t front, uint64_t back) { return front | back << 32; }
+  static size_t front(uint64_t bounds) { return bounds & 0xFFFFFFFF; }
+  static size_t back(uint64_t bounds) { return bounds >> 32; }
+
+  explicit Pool(unsigned n) : ranges(new Range[n]), concurrency(n) {}
+
+  // the loop of the thread `self`, which runs each batch until there is nothing left to take or steal
+  void work(unsigned self);
+  // the index of the next Arguments for the thread `self` to run, false if there is none left
+  bool take(unsigned self, size_t &index);
+
+  std::vector<std::thread> threads;
+  std::unique_ptr<Range[]> ranges;
+  unsigned concurrency;
+  // a single batch at a time
+  std::mutex run_mutex;
+  // the batch, set before the ranges are, under `mutex`
+  std::vector<Arguments> *batch                      = nullptr;
+  std::function<void(Arguments const &)> const *each = nullptr;
+  std::vector<ActionResult> results;
+  // guards the rest
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished_cv;
+  // the indices of the results not reported yet
+  std::vector<size_t> finished;
+  // incremented for each batch
+  unsigned generation = 0;
+  bool stop           = false;
+};
+
+void
+Executor::Pool::work(unsigned self)
+{
+  unsigned seen = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&]() { return stop || generation != seen; });
+      if (stop) {
+        return;
+      }
+      seen = generation;
+    }
+    size_t index = 0;
+    while (take(self, index)) {
+      ActionResult result;
+      result.index    = index;
+      Arguments &args = (*batch)[index];
+      try {
+        if (*each) {
+          (*each)(args);
+        }
+        args.invoke();
+      } catch (std::exception const &e) {
+        result.ok        = false;
+        result.error     = e.what();
+        result.exception = std::current_exception();
+      } catch (...) {
+        result.ok        = false;
+        result.error     = "unknown exception";
+        result.exception = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        results[index] = std::move(result);
+        finished.push_back(index);
+      }
+      finished_cv.notify_one();
+    }
+  }
+}
+
+bool
+Executor::Pool::take(unsigned self, size_t &index)
+{
+  Range &own      = ranges[self];
+  uint64_t bounds = own.bounds.load(std::memory_order_acquire);
+  while (front(bounds) < back(bounds)) {
+    if (own.bounds.compare_exchange_weak(bounds, bounds + 1, std::memory_order_acq_rel)) {
+      index = front(bounds);
+      return true;
+    }
+  }
+  for (unsigned i = 1; i < concurrency; i++) {
+    Range &other = ranges[(self + i) % concurrency];
+    bounds       = other.bounds.load(std::memory_order_acquire);
+    while (front(bounds) < back(bounds)) {
+      if (other.bounds.compare_exchange_weak(bounds, bounds - pack(0, 1), std::memory_order_acq_rel)) {
+        index = back(bounds) - 1;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+Executor::Executor(unsigned concurrency)
+{
+  if (concurrency == 0) {
+    concurrency = std::max(1u, std::thread::hardware_concurrency());
+  }
+  _pool = std::make_unique<Pool>(concurrency);
+  _pool->threads.reserve(concurrency);
+  for (unsigned i = 0; i < concurrency; i++) {
+    _pool->threads.emplace_back(&Pool::work, _pool.get(), i);
+  }
+}
+
+Executor::~Executor()
+{
+  {
+    std::lock_guard<std::mutex> lock(_pool->mutex);
+    _pool->stop = true;
+  }
+  _pool->wake.notify_all();
+  for (std::thread &thread : _pool->threads) {
+    thread.join();
+  }
+}
+
+unsigned
+Executor::concurrency() const noexcept
+{
+  return _pool->concurrency;
+}
+
+void
+Executor::run(std::vector<Arguments> &batch, std::function<void(ActionResult const &)> const &done, Completion completion,
+              std::function<void(Arguments const &)> const &each)
+{
+  Pool &pool = *_pool;
+  std::lock_guard<std::mutex> run_lock(pool.run_mutex);
+  size_t size = batch.size();
+  if (size == 0) {
+    return;
+  }
+  if (size > 0xFFFFFFFF) {
+    throw std::length_error("batch too large");
+  }
+  {
+    // a thread still looping on the previous batch takes from the ranges as soon as they are stored, so they are stored
+    // with the rest of the batch under the lock its results are pushed under
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.batch = &batch;
+    pool.each  = &each;
+    pool.results.assign(size, ActionResult());
+    pool.finished.clear();
+    // a contiguous range for each thread
+    for (unsigned i = 0; i < pool.concurrency; i++) {
+      uint64_t bounds = Pool::pack(size * i / pool.concurrency, size * (i + 1) / pool.concurrency);
+      pool.ranges[i].bounds.store(bounds, std::memory_order_release);
+    }
+    pool.generation++;
+  }
+  pool.wake.notify_all();
+  // report the results here, in order or as they come. The batch is run to the end even if `done` throws.
+  std::exception_ptr thrown;
+  auto report = [&](ActionResult const &result) {
+    if (!thrown) {
+      try {
+        done(result);
+      } catch (...) {
+        thrown = std::current_exception();
+      }
+    }
+  };
+  std::vector<size_t> finished;
+  std::vector<bool> ready(completion == ORDERED ? size : 0);
+  size_t next     = 0;
+  size_t reported = 0;
+  while (reported < size) {
+    {
+      std::unique_lock<std::mutex> lock(pool.mutex);
+      pool.finished_cv.wait(lock, [&]() { return !pool.finished.empty(); });
+      finished.swap(pool.finished);
+    }
+    for (size_t index : finished) {
+      if (completion == UNORDERED) {
+        report(pool.results[index]);
+        reported++;
+        continue;
+      }
+      ready[index] = true;
+      for (; next < size && ready[next]; next++) {
+        report(pool.results[next]);
+        reported++;
+      }
+    }
+    finished.clear();
+  }
+  if (thrown) {
+    std::rethrow_exception(thrown);
+  }
+}
+
+std::vector<ActionResult>
+Executor::run(std::vector<Arguments> &batch, Completion completion, std::function<void(Arguments const &)> const &each)
+{
+  std::vector<ActionResult> results;
+  results.reserve(batch.size());
+  run(batch, [&results](ActionResult const &result) { results.push_back(result); }, completion, each);
+  return results;
 }
 
 } // namespace ts
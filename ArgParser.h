@@ -23,12 +23,24 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <cstdint>
+#include <exception>
 #include <map>
 #include <vector>
 #include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <string_view>
+#include <type_traits>
 
 // more than zero arguments
 constexpr unsigned MORE_THAN_ZERO_ARG_N = ~0;
@@ -40,37 +52,1111 @@ constexpr int INDENT_TWO = 46;
 
 namespace ts
 {
-using AP_StrVec = std::vector<std::string>;
+using AP_StrVec  = std::vector<std::string>;
+using AP_ViewVec = std::pmr::vector<std::string_view>;
+// The type of the values of an option added by add_typed_option(), converted once by the parse
+struct ValueType {
+  enum Kind : unsigned char {
+    STRING,   // not converted
+    INT,      // int64_t
+    UNSIGNED, // uint64_t
+    DOUBLE,   // double
+    BOOL,     // true, yes, on or 1, and false, no, off or 0
+    BYTES,    // uint64_t, with an optional binary suffix: 512, 64K, 64M, 2G, 1T
+    DURATION, // std::chrono::nanoseconds, seconds by default or with a unit: 500ms, 30s, 5m, 2h, 1d, also ns and us
+    ENUM,     // the index of the value in choices
+  };
+
+  constexpr ValueType(Kind k = STRING, std::string_view c = {}) : kind(k), choices(c) {}
+
+  /** Whether a value can be converted to the type, as ArgumentData::convert() does for the parse. It is constexpr
+      for a StaticSchema to check its default values at compile time, only the range of a DOUBLE is left to the parse.
+  */
+  constexpr bool
+  valid(std::string_view value) const
+  {
+    uint64_t n            = 0;
+    size_t length         = 0;
+    bool negative         = !value.empty() && value[0] == '-';
+    uint64_t limit        = (uint64_t(1) << 63) - !negative;
+    std::string_view rest = value.substr(negative);
+    switch (kind) {
+    case STRING:
+      return true;
+    case INT:
+      length = read_digits(rest, limit, n);
+      return length != 0 && length == rest.size();
+    case UNSIGNED:
+      length = read_digits(value, ~uint64_t(0), n);
+      return length != 0 && length == value.size();
+    case DOUBLE:
+      return valid_double(rest);
+    case BOOL:
+      return value == "true" || value == "yes" || value == "on" || value == "1" || value == "false" || value == "no" ||
+             value == "off" || value == "0";
+    case BYTES: {
+      length = read_digits(value, ~uint64_t(0), n);
+      if (length == 0 || length == std::string_view::npos) {
+        return false;
+      }
+      rest = value.substr(length);
+      // a binary suffix, then an optional B
+      size_t suffix = rest.empty() ? std::string_view::npos : std::string_view("KMGTPE").find(upper(rest[0]));
+      if (suffix != std::string_view::npos) {
+        if (n > ~uint64_t(0) >> (10 * (suffix + 1))) {
+          return false;
+        }
+        rest.remove_prefix(1);
+      }
+      return rest.empty() || rest == "B";
+    }
+    case DURATION: {
+      length = read_digits(rest, limit, n);
+      if (length == 0 || length == std::string_view::npos) {
+        return false;
+      }
+      // the number of nanoseconds of the unit, seconds without one
+      std::string_view unit = rest.substr(length);
+      uint64_t scale        = unit.empty() || unit == "s" ? 1000000000
+                              : unit == "ns"              ? 1
+                              : unit == "us"              ? 1000
+                              : unit == "ms"              ? 1000000
+                              : unit == "m"               ? 60000000000
+                              : unit == "h"               ? 3600000000000
+                              : unit == "d"               ? 86400000000000
+                                                          : 0;
+      return scale != 0 && n <= limit / scale;
+    }
+    case ENUM:
+      for (std::string_view list = choices;;) {
+        size_t end = list.find('|');
+        if (list.substr(0, end) == value) {
+          return true;
+        }
+        if (end == std::string_view::npos) {
+          return false;
+        }
+        list.remove_prefix(end + 1);
+      }
+    }
+    return false;
+  }
+  // Whether the choices of an ENUM are distinct and not empty
+  constexpr bool
+  valid_choices() const
+  {
+    if (choices.empty()) {
+      return false;
+    }
+    for (std::string_view list = choices; !list.empty();) {
+      size_t end            = list.find('|');
+      std::string_view name = list.substr(0, end);
+      if (name.empty() || end == list.size() - 1) {
+        return false;
+      }
+      list.remove_prefix(end == std::string_view::npos ? list.size() : end + 1);
+      for (std::string_view next = list; !next.empty();) {
+        size_t pos = next.find('|');
+        if (next.substr(0, pos) == name) {
+          return false;
+        }
+        next.remove_prefix(pos == std::string_view::npos ? next.size() : pos + 1);
+      }
+    }
+    return true;
+  }
+
+  Kind kind;
+  // the values of an ENUM separated by '|', e.g. "fast|slow"
+  std::string_view choices;
+
+private:
+  static constexpr char
+  upper(char c)
+  {
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+  }
+  // Read the decimal digits at the beginning of value into n, the number of them or npos if n is greater than max
+  static constexpr size_t
+  read_digits(std::string_view value, uint64_t max, uint64_t &n)
+  {
+    size_t length = 0;
+    for (; length < value.size() && value[length] >= '0' && value[length] <= '9'; length++) {
+      unsigned digit = value[length] - '0';
+      if (n > (max - digit) / 10) {
+        return std::string_view::npos;
+      }
+      n = n * 10 + digit;
+    }
+    return length;
+  }
+  // The syntax of std::from_chars for a double without its sign: inf, infinity, nan, or a decimal number with an
+  // optional exponent
+  static constexpr bool
+  valid_double(std::string_view value)
+  {
+    auto equal = [](std::string_view a, std::string_view b) {
+      if (a.size() != b.size()) {
+        return false;
+      }
+      for (size_t i = 0; i < a.size(); i++) {
+        if (upper(a[i]) != upper(b[i])) {
+          return false;
+        }
+      }
+      return true;
+    };
+    if (equal(value, "inf") || equal(value, "infinity") || equal(value, "nan") ||
+        (value.size() > 4 && equal(value.substr(0, 4), "nan(") && value.back() == ')')) {
+      return true;
+    }
+    size_t digits = 0;
+    size_t i      = 0;
+    for (; i < value.size() && value[i] >= '0' && value[i] <= '9'; i++) {
+      digits++;
+    }
+    if (i < value.size() && value[i] == '.') {
+      for (i++; i < value.size() && value[i] >= '0' && value[i] <= '9'; i++) {
+        digits++;
+      }
+    }
+    if (digits == 0) {
+      return false;
+    }
+    if (i < value.size() && (value[i] == 'e' || value[i] == 'E')) {
+      i++;
+      if (i < value.size() && (value[i] == '+' || value[i] == '-')) {
+        i++;
+      }
+      size_t exponent = i;
+      for (; i < value.size() && value[i] >= '0' && value[i] <= '9'; i++) {
+      }
+      if (i == exponent) {
+        return false;
+      }
+    }
+    return i == value.size();
+  }
+};
+
 // The class holding both the ENV and String arguments
+// The values of the data in the Arguments are views, either into the storage of the Arguments or into the argv given
+// to ArgParser::parse_view(). A copy owns its values.
 class ArgumentData
 {
+  // A contiguous run of the values of a variadic option in the arguments of the parse, see take_args()
+  struct Run {
+    std::string_view const *first;
+    std::string_view const *last;
+  };
+
 public:
+  /** Forward iterator over the values in the order they are given: the runs of a variadic option, then the ones
+      stored, given as --option=value or appended. The values of a variadic option are not copied out of the
+      arguments parsed, they are only read when iterated.
+  */
+  class const_iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type        = std::string_view;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = std::string_view const *;
+    using reference         = std::string_view const &;
+
+    const_iterator() = default;
+    reference operator*() const noexcept { return *_pos; }
+    pointer operator->() const noexcept { return _pos; }
+    const_iterator &
+    operator++() noexcept
+    {
+      if (++_pos != _last) {
+        return *this;
+      }
+      if (_next != _end) {
+        _pos  = _next->first;
+        _last = _next->last;
+        ++_next;
+      } else if (_stored.first != _stored.last) {
+        _pos    = _stored.first;
+        _last   = _stored.last;
+        _stored = {};
+      }
+      return *this;
+    }
+    const_iterator
+    operator++(int) noexcept
+    {
+      const_iterator it = *this;
+      ++*this;
+      return it;
+    }
+    bool
+    operator==(const_iterator const &other) const noexcept
+    {
+      return _pos == other._pos && _next == other._next && _stored.first == other._stored.first;
+    }
+    bool operator!=(const_iterator const &other) const noexcept { return !(*this == other); }
+
+  private:
+    const_iterator(pointer pos, pointer last, Run const *next, Run const *end, Run stored)
+      : _pos(pos), _last(last), _next(next), _end(end), _stored(stored)
+    {
+    }
+
+    // the current value and the end of its run
+    pointer _pos  = nullptr;
+    pointer _last = nullptr;
+    // the runs left, which tell apart the end of a run from the beginning of another one at the same address
+    Run const *_next = nullptr;
+    Run const *_end  = nullptr;
+    // the values stored, left after the runs, empty once reached
+    Run _stored = {};
+
+    friend class ArgumentData;
+  };
+
+  ArgumentData() = default;
+  // a copy owns its values, so that it outlives the Arguments it is copied from
+  ArgumentData(ArgumentData const &other);
+  ArgumentData(ArgumentData &&other) noexcept;
+  ArgumentData &operator=(ArgumentData const &other);
+  ArgumentData &operator=(ArgumentData &&other) noexcept;
+  ~ArgumentData();
   // bool to check if certain command/option is called
   operator bool() const noexcept { return _is_called; }
   // index accessing []
-  std::string const &operator[](int x) const { return _values.at(x); }
+  std::string const &operator[](int x) const { return at(x); }
   // return the Environment variable
-  std::string const &env() const noexcept;
+  std::string const &env() const;
   // iterator for arguments
-  AP_StrVec::const_iterator begin() const noexcept;
-  AP_StrVec::const_iterator end() const noexcept;
+  const_iterator begin() const noexcept;
+  const_iterator end() const noexcept;
   // index accessing
   std::string const &at(unsigned index) const;
   // access the first index, equivalent to at(0)
-  std::string const &value() const noexcept;
-  // size of _values
+  std::string const &value() const;
+  /** The same as views, which are not copied out of the values. The strings returned by reference are made for the
+      data in the Arguments one value at a time, the first time each is asked for, these are free.
+  */
+  std::string_view env_view() const noexcept;
+  // linear in the number of runs of a variadic option
+  std::string_view at_view(unsigned index) const;
+  std::string_view value_view() const noexcept;
+  // number of values
   size_t size() const noexcept;
-  // return true if _values and _env_value are both empty
+  // return true if there are no values and _env_value is empty
   bool empty() const noexcept;
+  /** The value at index of an option added with a ValueType, converted by the parse.
+      They throw std::out_of_range past the end and std::invalid_argument for an option of another type.
+  */
+  int64_t as_int(unsigned index = 0) const;
+  uint64_t as_unsigned(unsigned index = 0) const;
+  double as_double(unsigned index = 0) const;
+  bool as_bool(unsigned index = 0) const;
+  uint64_t as_bytes(unsigned index = 0) const;
+  std::chrono::nanoseconds as_duration(unsigned index = 0) const;
+  unsigned as_enum(unsigned index = 0) const;
 
 private:
-  bool _is_called = false;
+  // A converted value, the member is given by the type of the option
+  union TypedValue {
+    int64_t i;  // INT, DURATION in nanoseconds
+    uint64_t u; // UNSIGNED, BYTES, ENUM
+    double d;   // DOUBLE
+    bool b;     // BOOL
+  };
+
+  // Convert a value of the type, nullptr if it succeeds or else the reason it is invalid
+  static const char *convert(ValueType type, std::string_view value, TypedValue &out);
+  // Whether a converted value of a number is within the bounds, in the format of the values, empty for none
+  static bool in_range(ValueType::Kind kind, TypedValue value, std::string_view min, std::string_view max);
+  // the reason a value is out of the bounds
+  static std::string range_error(std::string_view min, std::string_view max);
+  // the converted value at index, checked against the type
+  TypedValue const &typed(ValueType::Kind kind, unsigned index) const;
+
+  // The values as strings, for the accessors returning them by reference. A copy holds its values in them, the data
+  // in the Arguments makes each of them when it is first asked for and drops them when it changes.
+  struct Strings {
+    std::string env;
+    std::vector<std::string> values;
+    std::vector<TypedValue> typed;
+    // the values of the data in the Arguments made so far, by index
+    std::mutex mutex;
+    std::map<unsigned, std::string> made;
+  };
+  Strings &strings() const;
+  // the copy of the views of other, for the data of a copy of the Arguments, which shares their storage
+  void share(ArgumentData const &other);
+
+  // the values stored
+  std::string_view const *values() const noexcept { return _count <= 1 ? &_value : _array; }
+  // add a value, the array of several of them is allocated from resource, with new[] if it is nullptr
+  void push_value(std::string_view value, std::pmr::memory_resource *resource);
+  void assign_values(std::string_view const *first, std::string_view const *last, std::pmr::memory_resource *resource);
+  void clear_values() noexcept;
+  // drop the strings made of the values, for the values to change
+  void clear_strings() noexcept;
+  // an array for capacity values, and the capacity of the array of count values
+  std::string_view *allocate_values(unsigned capacity, std::pmr::memory_resource *resource);
+  static unsigned capacity(unsigned count) noexcept;
+
+  // 72 bytes in all, the data of a look-up key holds in a cache line but for the pointer to its strings
   // the environment variable
-  std::string _env_value;
-  // the arguments stored
-  AP_StrVec _values;
+  std::string_view _env_value;
+  // the values stored: a single one inline, which is the common case, several ones in an array whose capacity is
+  // their count rounded up to a power of 2
+  union {
+    std::string_view _value{};
+    std::string_view *_array;
+  };
+  // the values of a variadic option, runs of the arguments of the parse in its arena
+  Run *_runs = nullptr;
+  // the values converted by the parse, in the same arena
+  TypedValue *_typed    = nullptr;
+  unsigned _count       = 0;
+  unsigned _run_count   = 0;
+  unsigned _typed_count = 0;
+  bool _is_called       = false;
+  // the type of _typed
+  ValueType::Kind _type = ValueType::STRING;
+  // whether _array is allocated with new[] rather than from an arena
+  bool _owned = false;
+  // the strings, nullptr until made, set once by the first of the threads reading the data
+  mutable std::atomic<Strings *> _strings{nullptr};
 
   friend class Arguments;
+  friend class ArgParser;
+};
+
+// The handle of a look-up key in the Arguments parsed against a schema, see ArgParser::key()
+struct ArgKey {
+  unsigned id = 0;
+};
+
+// The compiled, immutable form of a command tree that ArgParser::parse runs against, see ArgParser::freeze().
+// The options and subcommands of each command are contiguous ranges of flat arrays sorted by name. Each
+// command also has its own open addressing hash table over the names of its options and subcommands, so
+// that each argument is looked up with a single hash and usually a single string comparison.
+struct SchemaOption {
+  std::string_view long_option;   // long option: --arg
+  std::string_view short_option;  // short option: -a
+  std::string_view description;   // help description
+  std::string_view envvar;        // stored ENV variable
+  unsigned arg_num;               // number of argument expected
+  std::string_view default_value; // default value of option
+  std::string_view key;           // look-up key
+  unsigned id = 0;                // the id of the look-up key
+  unsigned env_id = 0;            // the index of envvar in Schema::envvars
+  // the default value split by spaces, in Schema::default_values
+  unsigned default_begin = 0;
+  unsigned default_end   = 0;
+  // the type the values are converted to, see ArgParser::Command::add_typed_option()
+  ValueType type = ValueType::STRING;
+  // the bounds of the values of a number, empty if none, see ArgParser::Command::set_range()
+  std::string_view min = {};
+  std::string_view max = {};
+};
+
+struct SchemaCommand {
+  std::string_view name;
+  std::string_view description;
+  unsigned arg_num;
+  std::string_view envvar;
+  std::string_view example_usage;
+  // the function associated, nullptr if none
+  std::function<void()> const *action;
+  std::string_view key;
+  bool command_required;
+  // [begin, end) of the options of this command in Schema::options, sorted by long option
+  unsigned option_begin = 0;
+  unsigned option_end   = 0;
+  // [begin, end) of the subcommands in Schema::commands, sorted by name
+  unsigned command_begin = 0;
+  unsigned command_end   = 0;
+  // the hash table of this command in Schema::slots, slot_count is a power of 2
+  unsigned slot_begin = 0;
+  unsigned slot_count = 0;
+  // the id of the look-up key, 0 for the top level command whose key is the program name
+  unsigned id = 0;
+  // the index of envvar in Schema::envvars
+  unsigned env_id = 0;
+  // [begin, end) of the constraints between the options of this command in Schema::constraints
+  unsigned constraint_begin = 0;
+  unsigned constraint_end   = 0;
+  // its options and subcommands are not in the schema until a parse enters it, see ArgParser::Command::add_command()
+  bool lazy = false;
+};
+
+// A constraint between the options of a command, checked by the parse when the command is called. The options
+// are identified by their index in Schema::options, the parse sets the bit of each option given in a bitset of
+// them, and a constraint is a mask of the same bitset, over the words its options are in only.
+struct SchemaConstraint {
+  enum Kind : unsigned char {
+    EXCLUSIVE, // at most one of the options
+    ONE_OF,    // at least one of the options
+    REQUIRES,  // all of the options if `option` is given
+  };
+
+  Kind kind = EXCLUSIVE;
+  // the option requiring the others, for REQUIRES
+  unsigned option = 0;
+  // the mask in Schema::constraint_masks [mask_begin, mask_end), whose first word is the word `word` of the bitset
+  unsigned word       = 0;
+  unsigned mask_begin = 0;
+  unsigned mask_end   = 0;
+};
+
+// A slot of the hash table of a command
+struct SchemaSlot {
+  // the hash of the long option, short option or command name
+  uint32_t hash;
+  // 0 if empty, otherwise 1 + the index in Schema::options, or in Schema::commands if COMMAND is set
+  uint32_t entry;
+
+  static constexpr uint32_t COMMAND = 1u << 31;
+};
+
+struct Schema {
+  // FNV-1a, the hash of the slots
+  static constexpr uint32_t
+  hash(std::string_view name)
+  {
+    uint32_t h = 2166136261u;
+    for (char c : name) {
+      h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return h;
+  }
+  // the number of slots of the hash table of a command with `names` names, so that it is at most half full
+  static constexpr unsigned
+  slot_count(unsigned names)
+  {
+    unsigned count = names ? 2 : 0;
+    while (count < 2 * names) {
+      count *= 2;
+    }
+    return count;
+  }
+  // add an entry to the hash table [table, table + count)
+  static constexpr void
+  insert_slot(SchemaSlot *table, unsigned count, std::string_view name, uint32_t entry)
+  {
+    uint32_t h = hash(name);
+    uint32_t i = h & (count - 1);
+    while (table[i].entry) {
+      i = (i + 1) & (count - 1);
+    }
+    table[i] = {h, entry};
+  }
+  // split a default value by spaces into out, which can be nullptr, return the number of values
+  static constexpr unsigned
+  split_default(std::string_view value, std::string_view *out)
+  {
+    unsigned count = 0;
+    while (!value.empty()) {
+      size_t pos = value.find(' ');
+      if (out) {
+        out[count] = value.substr(0, pos);
+      }
+      count++;
+      if (pos == std::string_view::npos) {
+        break;
+      }
+      value.remove_prefix(pos + 1);
+    }
+    return count;
+  }
+  // report an invalid schema and exit, a compile time error when a StaticSchema is built
+  [[noreturn]] static void error(std::string_view msg);
+  // the id of a look-up key, 0 if there is no such key
+  constexpr unsigned
+  find_key(std::string_view name) const
+  {
+    uint32_t h = hash(name);
+    for (uint32_t i = h & (key_slot_count - 1); key_slot_count; i = (i + 1) & (key_slot_count - 1)) {
+      if (!key_slots[i].entry) {
+        break;
+      }
+      if (key_slots[i].hash == h && keys[key_slots[i].entry] == name) {
+        return key_slots[i].entry;
+      }
+    }
+    return 0;
+  }
+  // the handle of a look-up key, which has to exist
+  constexpr ArgKey
+  key(std::string_view name) const
+  {
+    unsigned id = find_key(name);
+    if (!id) {
+      error("look-up key not found");
+    }
+    return {id};
+  }
+  // the most options with a default value or a type in a chain of commands from cmd down, see implied_key_count
+  static constexpr unsigned
+  count_implied_keys(SchemaCommand const *commands, SchemaOption const *options, SchemaCommand const &cmd)
+  {
+    unsigned deepest = 0;
+    for (unsigned i = cmd.command_begin; i < cmd.command_end; i++) {
+      deepest = std::max(deepest, count_implied_keys(commands, options, commands[i]));
+    }
+    unsigned count = 0;
+    for (unsigned j = cmd.option_begin; j < cmd.option_end; j++) {
+      count += options[j].default_begin != options[j].default_end || options[j].type.kind != ValueType::STRING;
+    }
+    return count + deepest;
+  }
+  // find an option of the command by its long or short option
+  SchemaOption const *find_option(SchemaCommand const &cmd, std::string_view name) const;
+  // find a subcommand of the command by its name
+  SchemaCommand const *find_command(SchemaCommand const &cmd, std::string_view name) const;
+  /** The subcommands, or the long options if it starts with '-', completing the word argv[cword] of a command line,
+      which is empty if cword is argc. The words before it are walked like a parse, without keeping any data.
+      If they walk into a lazy command, there is no candidate and it is stored in unbuilt, if not nullptr.
+  */
+  std::vector<std::string_view> complete(unsigned argc, const char **argv, unsigned cword,
+                                         SchemaCommand const **unbuilt = nullptr) const;
+  // the options of the command whose long option starts with prefix, a range since they are sorted
+  std::pair<SchemaOption const *, SchemaOption const *> option_range(SchemaCommand const &cmd, std::string_view prefix) const;
+  // the subcommands of the command whose name starts with prefix
+  std::pair<SchemaCommand const *, SchemaCommand const *> command_range(SchemaCommand const &cmd, std::string_view prefix) const;
+  // The help message of a command, then exit with return_code
+  void help_message(SchemaCommand const &cmd, std::string_view err, int return_code) const;
+  // The help message of a command with the error message if any, in a single write
+  void output_help(std::ostream &out, SchemaCommand const &cmd, std::string_view err) const;
+  // Helper methods for output_help: append the help message of a command, without the error message, to out
+  void render_help(std::string &out, SchemaCommand const &cmd) const;
+  void output_command(std::string &out, SchemaCommand const &cmd, unsigned indent) const;
+  void output_option(std::string &out, SchemaCommand const &cmd) const;
+
+  // commands[0] is the top level command
+  SchemaCommand const *commands = nullptr;
+  unsigned command_count        = 0;
+  SchemaOption const *options   = nullptr;
+  unsigned option_count         = 0;
+  SchemaSlot const *slots       = nullptr;
+  // the look-up keys by id, keys[0] stands for the program name
+  std::string_view const *keys = nullptr;
+  unsigned key_count           = 0;
+  // the most keys a parse gives data to besides the ones of argv, the options with a default value or a type of
+  // the commands it enters
+  unsigned implied_key_count = 0;
+  // hash table of the look-up keys, the entries are the ids
+  SchemaSlot const *key_slots = nullptr;
+  unsigned key_slot_count     = 0;
+  // the environment variables of the commands and options, each of them looked up once per parse
+  std::string_view const *envvars = nullptr;
+  unsigned envvar_count           = 0;
+  // the default values of the options, split once
+  std::string_view const *default_values = nullptr;
+  // the constraints between options, by command, and their masks
+  SchemaConstraint const *constraints = nullptr;
+  unsigned constraint_count           = 0;
+  uint64_t const *constraint_masks    = nullptr;
+  // the global usage for the help message
+  std::string_view usage;
+  // the subcommand of the top level command parsed when there is none in argv, 0 if none
+  unsigned default_command = 0;
+  // a long option or subcommand can be given by any prefix of it no other one has
+  bool abbreviations = false;
+  // an argument @path stands for the arguments in the file at path
+  bool response_files = false;
+  // the hidden commands __complete and __completion are answered, see ArgParser::enable_completion()
+  bool completion = false;
+};
+
+// An entry of a command tree defined at compile time, see StaticSchema. A command is named by its path from
+// the top level command, e.g. "init subinit", and an option by the path of the command it belongs to. The
+// command with an empty path, if any, describes the top level command.
+struct SchemaDef {
+  // the equivalents of Command::add_command()
+  static constexpr SchemaDef
+  command(std::string_view path, std::string_view description, std::function<void()> const *f = nullptr,
+          std::string_view key = "")
+  {
+    return command(path, description, "", 0, f, key);
+  }
+  static constexpr SchemaDef
+  command(std::string_view path, std::string_view description, std::string_view envvar, unsigned arg_num,
+          std::function<void()> const *f = nullptr, std::string_view key = "")
+  {
+    return {true, path, {}, {}, description, envvar, arg_num, {}, key, f, {}, false, false, {}, false, false, {}};
+  }
+  // the equivalent of Command::add_option()
+  static constexpr SchemaDef
+  option(std::string_view path, std::string_view long_option, std::string_view short_option, std::string_view description,
+         std::string_view envvar = "", unsigned arg_num = 0, std::string_view default_value = "", std::string_view key = "")
+  {
+    return {false, path, long_option, short_option, description, envvar, arg_num, default_value, key, nullptr, {}, false, false,
+            {}, false, false, {}};
+  }
+  // the equivalent of Command::add_typed_option()
+  static constexpr SchemaDef
+  typed_option(std::string_view path, std::string_view long_option, std::string_view short_option, std::string_view description,
+               ValueType type, std::string_view envvar = "", unsigned arg_num = 1, std::string_view default_value = "",
+               std::string_view key = "")
+  {
+    SchemaDef def = option(path, long_option, short_option, description, envvar, arg_num, default_value, key);
+    def.type      = type;
+    return def;
+  }
+  /** The equivalents of Command::mutually_exclusive(), Command::require_one_of() and Command::option_requires(),
+      between options of the command at path, given by their long options separated by spaces: "--json --yaml"
+  */
+  static constexpr SchemaDef
+  mutually_exclusive(std::string_view path, std::string_view long_options)
+  {
+    return constraint(path, SchemaConstraint::EXCLUSIVE, {}, long_options);
+  }
+  static constexpr SchemaDef
+  require_one_of(std::string_view path, std::string_view long_options)
+  {
+    return constraint(path, SchemaConstraint::ONE_OF, {}, long_options);
+  }
+  static constexpr SchemaDef
+  option_requires(std::string_view path, std::string_view long_option, std::string_view long_options)
+  {
+    return constraint(path, SchemaConstraint::REQUIRES, long_option, long_options);
+  }
+  static constexpr SchemaDef
+  constraint(std::string_view path, SchemaConstraint::Kind kind, std::string_view long_option, std::string_view long_options)
+  {
+    SchemaDef def       = option(path, long_option, "", "");
+    def.is_constraint   = true;
+    def.constraint_kind = kind;
+    def.options         = long_options;
+    return def;
+  }
+  // the equivalent of Command::set_range(), for an option
+  constexpr SchemaDef
+  set_range(std::string_view min_value, std::string_view max_value) const
+  {
+    SchemaDef def = *this;
+    def.min       = min_value;
+    def.max       = max_value;
+    return def;
+  }
+  // the equivalents of Command::require_commands(), Command::add_example_usage() and Command::set_default()
+  constexpr SchemaDef
+  require_commands() const
+  {
+    SchemaDef def        = *this;
+    def.command_required = true;
+    return def;
+  }
+  constexpr SchemaDef
+  add_example_usage(std::string_view usage) const
+  {
+    SchemaDef def     = *this;
+    def.example_usage = usage;
+    return def;
+  }
+  constexpr SchemaDef
+  set_default() const
+  {
+    SchemaDef def  = *this;
+    def.is_default = true;
+    return def;
+  }
+  // the equivalent of ArgParser::add_global_usage(), for the top level command
+  constexpr SchemaDef
+  add_global_usage(std::string_view usage) const
+  {
+    SchemaDef def    = *this;
+    def.global_usage = usage;
+    return def;
+  }
+  // the equivalent of ArgParser::allow_abbreviations(), for the top level command
+  constexpr SchemaDef
+  allow_abbreviations() const
+  {
+    SchemaDef def     = *this;
+    def.abbreviations = true;
+    return def;
+  }
+  // the equivalent of ArgParser::allow_response_files(), for the top level command
+  constexpr SchemaDef
+  allow_response_files() const
+  {
+    SchemaDef def      = *this;
+    def.response_files = true;
+    return def;
+  }
+  // the equivalent of ArgParser::enable_completion(), for the top level command
+  constexpr SchemaDef
+  enable_completion() const
+  {
+    SchemaDef def  = *this;
+    def.completion = true;
+    return def;
+  }
+  // the name of a command, the last element of its path
+  constexpr std::string_view
+  name() const
+  {
+    return path.substr(path.rfind(' ') + 1);
+  }
+  // the path of the command a command or option belongs to
+  constexpr std::string_view
+  parent() const
+  {
+    if (!is_command) {
+      return path;
+    }
+    size_t pos = path.rfind(' ');
+    return pos == std::string_view::npos ? std::string_view() : path.substr(0, pos);
+  }
+
+  bool is_command;
+  std::string_view path;
+  std::string_view long_option;
+  std::string_view short_option;
+  std::string_view description;
+  std::string_view envvar;
+  unsigned arg_num;
+  std::string_view default_value;
+  std::string_view key;
+  // the function associated with a command, it has to outlive the schema
+  std::function<void()> const *action;
+  std::string_view example_usage;
+  bool command_required;
+  bool is_default;
+  std::string_view global_usage;
+  bool abbreviations;
+  bool response_files;
+  ValueType type;
+  // the bounds of an option, see set_range()
+  std::string_view min = {};
+  std::string_view max = {};
+  // a constraint between the options `options`, see constraint()
+  bool is_constraint                     = false;
+  SchemaConstraint::Kind constraint_kind = SchemaConstraint::EXCLUSIVE;
+  std::string_view options               = {};
+  // see enable_completion()
+  bool completion = false;
+};
+
+/** A Schema built by the compiler from a constant table of SchemaDef, so that nothing is left to do at
+    run time but parsing. It points into itself, so it has to be defined with static storage duration:
+
+      static constexpr ts::SchemaDef defs[] = {ts::SchemaDef::command("init", "initialize"),
+                                               ts::SchemaDef::option("init", "--path", "-p", "the path", "", 1)};
+      static constexpr ts::StaticSchema schema(defs);
+      ts::ArgParser parser(schema);
+*/
+template <size_t N, size_t D = 4 * N> class StaticSchema : public Schema
+{
+public:
+  constexpr StaticSchema(SchemaDef const (&defs)[N]);
+  StaticSchema(StaticSchema const &) = delete;
+  StaticSchema &operator=(StaticSchema const &) = delete;
+
+private:
+  std::array<SchemaCommand, N + 1> _command_list{};
+  std::array<SchemaOption, N> _option_list{};
+  // a command with n names has less than 4 * n slots, and there are at most 2 * N names
+  std::array<SchemaSlot, 8 * N> _slot_list{};
+  std::array<std::string_view, N + 1> _key_list{};
+  std::array<SchemaSlot, 4 * N> _key_slot_list{};
+  std::array<std::string_view, N + 1> _envvar_list{};
+  // room for D default values in all, see the template parameter
+  std::array<std::string_view, D + 1> _default_list{};
+  std::array<SchemaConstraint, N> _constraint_list{};
+  // the mask of a constraint is usually a single word
+  std::array<uint64_t, 2 * N> _mask_list{};
+};
+
+// Same layout as ArgParser::compile(): the commands breadth-first, the options and subcommands of each
+// command sorted by name
+template <size_t N, size_t D> constexpr StaticSchema<N, D>::StaticSchema(SchemaDef const (&defs)[N])
+{
+  std::array<std::string_view, N + 1> paths{};
+  unsigned command_num = 1;
+  unsigned option_num  = 0;
+  unsigned slot_num    = 0;
+  // the top level command
+  for (SchemaDef const &def : defs) {
+    if (def.is_command && def.path.empty()) {
+      _command_list[0] = {{}, def.description, def.arg_num, def.envvar, def.example_usage, def.action, {}, def.command_required};
+      usage            = def.global_usage;
+      abbreviations    = def.abbreviations;
+      response_files   = def.response_files;
+      completion       = def.completion;
+    }
+  }
+  for (unsigned i = 0; i < command_num; i++) {
+    SchemaCommand &command = _command_list[i];
+    // subcommands, sorted by name
+    command.command_begin = command_num;
+    for (SchemaDef const &def : defs) {
+      if (!def.is_command || def.path.empty() || def.parent() != paths[i]) {
+        continue;
+      }
+      if (def.name().empty()) {
+        Schema::error("empty command cannot be added");
+      }
+      unsigned j = command_num++;
+      for (; j > command.command_begin && _command_list[j - 1].name > def.name(); j--) {
+        _command_list[j] = _command_list[j - 1];
+        paths[j]         = paths[j - 1];
+      }
+      if (j > command.command_begin && _command_list[j - 1].name == def.name()) {
+        Schema::error("command already exists");
+      }
+      std::string_view key = def.key.empty() ? def.name() : def.key;
+      _command_list[j]     = {def.name(), def.description, def.arg_num, def.envvar, def.example_usage, def.action, key,
+                              def.command_required};
+      paths[j]             = def.path;
+    }
+    command.command_end = command_num;
+    // options, sorted by long option
+    command.option_begin = option_num;
+    unsigned short_num   = 0;
+    for (SchemaDef const &def : defs) {
+      if (def.is_command || def.is_constraint || def.path != paths[i]) {
+        continue;
+      }
+      if (def.long_option.size() < 3 || def.long_option[0] != '-' || def.long_option[1] != '-') {
+        Schema::error("invalid long option added");
+      }
+      if (def.short_option.size() > 2 || (def.short_option.size() > 0 && def.short_option[0] != '-')) {
+        Schema::error("invalid short option added");
+      }
+      std::string_view short_option = def.short_option == "-" ? std::string_view() : def.short_option;
+      for (unsigned j = command.option_begin; j < option_num; j++) {
+        if (!short_option.empty() && _option_list[j].short_option == short_option) {
+          Schema::error("short option already existed");
+        }
+      }
+      unsigned j = option_num++;
+      for (; j > command.option_begin && _option_list[j - 1].long_option > def.long_option; j--) {
+        _option_list[j] = _option_list[j - 1];
+      }
+      if (j > command.option_begin && _option_list[j - 1].long_option == def.long_option) {
+        Schema::error("long option already existed");
+      }
+      std::string_view key = def.key.empty() ? def.long_option.substr(2) : def.key;
+      _option_list[j]      = {def.long_option, short_option, def.description, def.envvar, def.arg_num, def.default_value, key};
+      _option_list[j].type = def.type;
+      _option_list[j].min  = def.min;
+      _option_list[j].max  = def.max;
+      if ((!def.min.empty() || !def.max.empty()) &&
+          (def.type.kind == ValueType::STRING || def.type.kind == ValueType::BOOL || def.type.kind == ValueType::ENUM)) {
+        Schema::error("range of an option that is not a number");
+      }
+      if (def.type.kind != ValueType::STRING && def.arg_num == 0) {
+        Schema::error("typed option expects no argument");
+      }
+      if (def.type.kind == ValueType::ENUM && !def.type.valid_choices()) {
+        Schema::error("invalid choices of an enum option");
+      }
+      short_num += !short_option.empty();
+    }
+    command.option_end = option_num;
+    // the hash table
+    command.slot_begin = slot_num;
+    command.slot_count =
+      slot_count(command.option_end - command.option_begin + short_num + command.command_end - command.command_begin);
+    slot_num += command.slot_count;
+    for (unsigned j = command.option_begin; j < command.option_end; j++) {
+      insert_slot(&_slot_list[command.slot_begin], command.slot_count, _option_list[j].long_option, j + 1);
+      if (!_option_list[j].short_option.empty()) {
+        insert_slot(&_slot_list[command.slot_begin], command.slot_count, _option_list[j].short_option, j + 1);
+      }
+    }
+    for (unsigned j = command.command_begin; j < command.command_end; j++) {
+      insert_slot(&_slot_list[command.slot_begin], command.slot_count, _command_list[j].name, (j + 1) | SchemaSlot::COMMAND);
+    }
+  }
+  // everything has to be reachable from the top level command
+  unsigned def_num = 1;
+  for (SchemaDef const &def : defs) {
+    def_num += (!def.path.empty() || !def.is_command) && !def.is_constraint;
+  }
+  if (command_num + option_num != def_num) {
+    Schema::error("command not found for an option or a subcommand");
+  }
+  // the default command
+  for (SchemaDef const &def : defs) {
+    if (!def.is_default) {
+      continue;
+    }
+    if (default_command) {
+      Schema::error("default command already existed");
+    }
+    for (unsigned i = _command_list[0].command_begin; i < _command_list[0].command_end; i++) {
+      if (paths[i] == def.path) {
+        default_command = i;
+      }
+    }
+    if (!default_command) {
+      Schema::error("default command not found");
+    }
+  }
+  // the look-up keys, numbered in order of appearance
+  key_count = 1;
+  auto add_key = [&](std::string_view name) {
+    for (unsigned id = 1; id < key_count; id++) {
+      if (_key_list[id] == name) {
+        return id;
+      }
+    }
+    _key_list[key_count] = name;
+    return key_count++;
+  };
+  for (unsigned i = 0; i < command_num; i++) {
+    if (i > 0) {
+      _command_list[i].id = add_key(_command_list[i].key);
+    }
+    for (unsigned j = _command_list[i].option_begin; j < _command_list[i].option_end; j++) {
+      _option_list[j].id = add_key(_option_list[j].key);
+    }
+  }
+  // the environment variables
+  auto add_envvar = [&](std::string_view name) {
+    for (unsigned i = 0; i < envvar_count; i++) {
+      if (_envvar_list[i] == name) {
+        return i;
+      }
+    }
+    _envvar_list[envvar_count] = name;
+    return envvar_count++;
+  };
+  for (unsigned i = 0; i < command_num; i++) {
+    if (!_command_list[i].envvar.empty()) {
+      _command_list[i].env_id = add_envvar(_command_list[i].envvar);
+    }
+  }
+  for (unsigned i = 0; i < option_num; i++) {
+    if (!_option_list[i].envvar.empty()) {
+      _option_list[i].env_id = add_envvar(_option_list[i].envvar);
+    }
+  }
+  // the default values
+  unsigned default_num = 0;
+  for (unsigned i = 0; i < option_num; i++) {
+    _option_list[i].default_begin = default_num;
+    if (default_num + split_default(_option_list[i].default_value, nullptr) > D) {
+      error("too many default values, raise the second template parameter of StaticSchema");
+    }
+    default_num += split_default(_option_list[i].default_value, _default_list.data() + default_num);
+    _option_list[i].default_end = default_num;
+    for (unsigned j = _option_list[i].default_begin; j < default_num; j++) {
+      if (!_option_list[i].type.valid(_default_list[j])) {
+        error("invalid default value of a typed option");
+      }
+    }
+  }
+  key_slot_count = slot_count(key_count - 1);
+  for (unsigned id = 1; id < key_count; id++) {
+    insert_slot(_key_slot_list.data(), key_slot_count, _key_list[id], id);
+  }
+  // the constraints, by command
+  unsigned constraint_num = 0;
+  unsigned mask_num       = 0;
+  for (unsigned i = 0; i < command_num; i++) {
+    SchemaCommand &command   = _command_list[i];
+    command.constraint_begin = constraint_num;
+    for (SchemaDef const &def : defs) {
+      if (!def.is_constraint || def.path != paths[i]) {
+        continue;
+      }
+      // the index of a long option of the command
+      auto find = [&](std::string_view name) {
+        for (unsigned j = command.option_begin; j < command.option_end; j++) {
+          if (_option_list[j].long_option == name) {
+            return j;
+          }
+        }
+        Schema::error("option of a constraint not found");
+      };
+      SchemaConstraint &constraint = _constraint_list[constraint_num++];
+      constraint.kind              = def.constraint_kind;
+      if (def.constraint_kind == SchemaConstraint::REQUIRES) {
+        constraint.option = find(def.long_option);
+      }
+      std::array<unsigned, N> indices{};
+      unsigned count = 0;
+      for (std::string_view names = def.options; !names.empty();) {
+        size_t pos = names.find(' ');
+        if (pos != 0) {
+          indices[count++] = find(names.substr(0, pos));
+        }
+        names.remove_prefix(pos == std::string_view::npos ? names.size() : pos + 1);
+      }
+      if (count < (def.constraint_kind == SchemaConstraint::EXCLUSIVE ? 2 : 1)) {
+        Schema::error("too few options in a constraint");
+      }
+      unsigned first = indices[0];
+      unsigned last  = indices[0];
+      for (unsigned j = 1; j < count; j++) {
+        first = indices[j] < first ? indices[j] : first;
+        last  = indices[j] > last ? indices[j] : last;
+      }
+      constraint.word       = first / 64;
+      constraint.mask_begin = mask_num;
+      constraint.mask_end   = mask_num + last / 64 - first / 64 + 1;
+      if (constraint.mask_end > _mask_list.size()) {
+        Schema::error("too many constraints between options far apart");
+      }
+      for (unsigned j = 0; j < count; j++) {
+        _mask_list[mask_num + indices[j] / 64 - constraint.word] |= uint64_t(1) << (indices[j] % 64);
+      }
+      mask_num = constraint.mask_end;
+    }
+    command.constraint_end = constraint_num;
+  }
+  commands          = _command_list.data();
+  command_count     = command_num;
+  options           = _option_list.data();
+  option_count      = option_num;
+  slots             = _slot_list.data();
+  keys              = _key_list.data();
+  key_slots         = _key_slot_list.data();
+  envvars           = _envvar_list.data();
+  default_values    = _default_list.data();
+  constraints       = _constraint_list.data();
+  constraint_count  = constraint_num;
+  constraint_masks  = _mask_list.data();
+  implied_key_count = count_implied_keys(commands, options, commands[0]);
+}
+
+// The error of a parse that does not exit, see ArgParser::parse(argv, error)
+struct ParseError {
+  enum Kind {
+    NONE,
+    INVALID_ARGV,     // argv is empty or a response file cannot be read
+    UNKNOWN_ARGUMENT, // neither a command, an option nor an argument of one
+    MISSING_ARGUMENT, // fewer arguments than a command or option expects
+    ARGUMENT_NUMBER,  // a number of --arg=value other than the number of arguments expected
+    COMMAND_REQUIRED, // no subcommand for a command requiring one
+    AMBIGUOUS,        // the abbreviation of several long options or subcommands
+    INVALID_VALUE,    // a value of a typed option that cannot be converted, or is out of range
+    CONSTRAINT,       // options mutually exclusive given together, or an option given without the ones it requires
+    FROZEN,           // a command, option or setting added after the parser is frozen, which is left out
+    HELP,             // --help or -h, not an error as such
+    VERSION,          // --version or -V, not an error as such
+    COMPLETE,         // __complete or __completion once enabled, the message is their output, not an error as such
+  };
+
+  // true if the parse stopped on an error, help or version request
+  explicit operator bool() const noexcept { return kind != NONE; }
+  // the help message of the command the error is about, with the error message
+  std::string help() const;
+  // the exit code of the process when ArgParser::parse(argv) runs into it
+  int return_code() const noexcept;
+
+  Kind kind = NONE;
+  // the index in argv of the offending argument, argc if it is missing at the end. The arguments read from a
+  // response file are counted in place of it.
+  unsigned token = 0;
+  std::string message;
+  // the command whose help message to show, in schema
+  SchemaCommand const *command = nullptr;
+  std::shared_ptr<const Schema> schema;
 };
 
 // The class holding all the parsed data after ArgParser::parse()
@@ -79,8 +1165,15 @@ class Arguments
 public:
   Arguments();
   ~Arguments();
+  Arguments(Arguments const &other);
+  Arguments(Arguments &&) = default;
+  Arguments &operator=(Arguments const &other);
+  Arguments &operator=(Arguments &&) = default;
 
-  ArgumentData get(std::string const &name);
+  // the data of a look-up key, empty if the key is not found
+  ArgumentData const &get(std::string_view name) const;
+  // the same in constant time, for a key of the schema parsed against
+  ArgumentData const &get(ArgKey key) const;
 
   void append(std::string const &key, ArgumentData const &value);
   // Append value to the arg to the map of key
@@ -92,16 +1185,64 @@ public:
   /** Invoke the function associated with the parsed command.
       @return The return value of the executed command (int).
   */
-  void invoke();
+  void invoke() const;
   // return true if there is any function to invoke
   bool has_action() const;
 
 private:
-  // A map of all the called parsed args/data
+  // The arena of an Arguments, which keeps the arena it was detached from, see arena()
+  struct Arena : std::pmr::monotonic_buffer_resource {
+    using std::pmr::monotonic_buffer_resource::monotonic_buffer_resource;
+    std::shared_ptr<Arena> parent;
+  };
+
+  // _arena to allocate from, made if there is none, or detached first from the copies of this object sharing it
+  std::pmr::memory_resource *arena();
+  // Copy the string into _arena, return the view of the copy
+  std::string_view own(std::string_view s);
+  // the data of a look-up key, added if not there yet
+  ArgumentData &data(std::string_view key);
+  // the id of a look-up key, NOT_FOUND if it is not in the schema
+  unsigned index(std::string_view key) const;
+  // the data given by the parse to the look-up key with this id, nullptr if none
+  ArgumentData *find(unsigned id) const;
+  // the same, added if not there yet. Only a parse adds data, after reserve().
+  ArgumentData &insert(unsigned id);
+  // make room for the data of `count` more look-up keys, in _data and in a new _index of their own
+  void reserve(unsigned count);
+
+  static constexpr unsigned NOT_FOUND = ~0u;
+  // A slot of _index
+  struct Slot {
+    unsigned id;
+    // 0 if empty, otherwise 1 + the position in _data
+    unsigned pos;
+  };
+
+  // The parsed args/data of the look-up keys of the schema given by the parse, in the order they are given. A parse
+  // only pays for the keys it gives, however large the schema is.
+  std::vector<ArgumentData> _data;
+  // The hash table of the positions in _data by id, in _arena. Copies share it as they have the same positions, and
+  // it is only filled once reserved in an arena of their own, so it is never shared while it changes.
+  Slot *_index         = nullptr;
+  unsigned _index_size = 0;
+  // The name of the program, the look-up key with id 0
+  std::string_view _program;
+  // A map of the args/data appended with keys that are not in the schema
   // Key: "command/option", value: ENV and args
-  std::map<std::string, ArgumentData> _data_map;
-  // The function associated. invoke() will call this func
-  std::function<void()> _action;
+  std::map<std::string, ArgumentData, std::less<>> _data_map;
+  // The function associated, owned by the schema. invoke() will call this func
+  std::function<void()> const *_action = nullptr;
+  // The single arena a parse allocates from: the copy of argv, the owned strings and the values of _data.
+  // It is shared with copies of this object, which the owned strings are the views of, until one of them allocates
+  // from it. That one then allocates from an arena of its own, so that copies can be changed by several threads.
+  std::shared_ptr<Arena> _arena;
+  // The schema of the parser, which the default values point into
+  std::shared_ptr<const Schema> _schema;
+  // The response files mapped in memory, which the values read from them point into
+  std::vector<std::shared_ptr<const char>> _files;
+  // The bitset of the options given, by index in the schema, empty if it has no constraint
+  std::vector<uint64_t> _given;
 
   friend class ArgParser;
   friend class ArgumentData;
@@ -123,12 +1264,21 @@ public:
     unsigned arg_num;          // number of argument expected
     std::string default_value; // default value of option
     std::string key;           // look-up key
+    // the type of the values, see Command::add_typed_option(), and the choices of an ENUM
+    ValueType::Kind type = ValueType::STRING;
+    std::string choices  = "";
+    // the bounds of the values, see Command::set_range()
+    std::string min = "";
+    std::string max = "";
   };
 
   // Class for commands in a nested way
   class Command
   {
   public:
+    // Adds the options and subcommands of a lazy command, see add_command()
+    using Builder = std::function<void(Command &)>;
+
     // Constructor and destructor
     Command();
     ~Command();
@@ -138,6 +1288,14 @@ public:
     Command &add_option(std::string const &long_option, std::string const &short_option, std::string const &description,
                         std::string const &envvar = "", unsigned arg_num = 0, std::string const &default_value = "",
                         std::string const &key = "");
+    /** Add an option whose values are converted by the parse, so that ArgumentData::as_int() and the like
+        return them as is. A value that cannot be converted is an error of the parse, an invalid default value
+        an error of the registration.
+        @return The Command instance for chained calls.
+    */
+    Command &add_typed_option(std::string const &long_option, std::string const &short_option, std::string const &description,
+                              ValueType type, std::string const &envvar = "", unsigned arg_num = 1,
+                              std::string const &default_value = "", std::string const &key = "");
 
     /** Two ways of adding a sub-command to current command:
         @return The new sub-command instance.
@@ -146,6 +1304,18 @@ public:
                          std::string const &key = "");
     Command &add_command(std::string const &cmd_name, std::string const &cmd_description, std::string const &cmd_envvar,
                          unsigned cmd_arg_num, Function const &f = nullptr, std::string const &key = "");
+    /** Add a lazy sub-command: builder adds its options and subcommands the first time a parse enters it or
+        completes the words after it, rather than every process paying for all of them up front. Until then it
+        is listed by the help message of its parent without its subcommands.
+        @return The new sub-command instance.
+    */
+    template <typename B, typename = std::enable_if_t<std::is_invocable_v<B const &, Command &>>>
+    Command &
+    add_command(std::string const &cmd_name, std::string const &cmd_description, B const &builder, Function const &f = nullptr,
+                std::string const &key = "")
+    {
+      return add_lazy_command(cmd_name, cmd_description, builder, f, key);
+    }
     /** Add an example usage of current command for the help message
         @return The Command instance for chained calls.
     */
@@ -154,6 +1324,18 @@ public:
         @return The Command instance for chained calls.
     */
     Command &require_commands();
+    /** Constraints between options of this command, given by their long options, checked by the parse when the
+        command is called: at most one of them, at least one of them, and all of them if long_option is given.
+        @return The Command instance for chained calls.
+    */
+    Command &mutually_exclusive(std::vector<std::string> const &long_options);
+    Command &require_one_of(std::vector<std::string> const &long_options);
+    Command &option_requires(std::string const &long_option, std::vector<std::string> const &long_options);
+    /** Bound the values of a typed option of a number, min or max in the format of its values, or empty for no bound.
+        A value out of range is an error of the parse.
+        @return The Command instance for chained calls.
+    */
+    Command &set_range(std::string const &long_option, std::string const &min, std::string const &max);
     /** set the current command as default
         @return The Command instance for chained calls.
     */
@@ -163,21 +1345,19 @@ public:
     // Main constructor called by add_command()
     Command(std::string const &name, std::string const &description, std::string const &envvar, unsigned arg_num, Function const &f,
             std::string const &key = "");
+    /** Whether the parser is frozen, in which case `what` is not done but reported by the parses instead,
+        see ParseError::FROZEN.
+    */
+    bool late(std::string const &what) const;
     // Helper method for add_option to check the validity of option
     void check_option(std::string const &long_option, std::string const &short_option, std::string const &key) const;
     // Helper method for add_command to check the validity of command
     void check_command(std::string const &name, std::string const &key) const;
-    // Helper method for ArgParser::help_message
-    void output_command(std::ostream &out, std::string const &prefix) const;
-    // Helper method for ArgParser::help_message
-    void output_option() const;
-    // Helper method for ArgParser::parse
-    bool parse(Arguments &ret, AP_StrVec &args);
-    // The help & version messages
-    void help_message(std::string_view err = "") const;
-    void version_message() const;
-    // Helpr method for parse()
-    void append_option_data(Arguments &ret, AP_StrVec &args, int index);
+    // Helper method for the constraints to check that the options are options of this command
+    void check_constraint(std::vector<std::string> const &long_options, size_t min_count) const;
+    // Helper method for add_command with a builder
+    Command &add_lazy_command(std::string const &cmd_name, std::string const &cmd_description, Builder const &builder,
+                              Function const &f, std::string const &key);
     // The command name and help message
     std::string _name;
     std::string _description;
@@ -192,18 +1372,33 @@ public:
     Function _f;
     // look up key
     std::string _key;
+    // Adds the options and subcommands of a lazy command when it is built, empty afterwards
+    Builder _builder;
 
     // list of all subcommands of current command
     // Key: command name. Value: Command object
-    std::map<std::string, Command> _subcommand_list;
+    std::map<std::string, Command, std::less<>> _subcommand_list;
     // list of all options of current command
     // Key: option name. Value: Option object
-    std::map<std::string, Option> _option_list;
+    std::map<std::string, Option, std::less<>> _option_list;
     // Map for fast searching: <short option: long option>
-    std::map<std::string, std::string> _option_map;
+    std::map<std::string, std::string, std::less<>> _option_map;
+    // A constraint between options, see mutually_exclusive()
+    struct Constraint {
+      SchemaConstraint::Kind kind;
+      std::string long_option;
+      std::vector<std::string> long_options;
+    };
+    std::vector<Constraint> _constraint_list;
 
     // require command / option for this parser
     bool _command_required = false;
+    // the default command of the parser
+    bool _is_default = false;
+    // set by ArgParser::freeze(), nothing can be added afterwards
+    mutable bool _frozen = false;
+    // the parser that froze the command, which reports what is added afterwards
+    mutable ArgParser const *_parser = nullptr;
 
     friend class ArgParser;
   };
@@ -211,6 +1406,11 @@ public:
   ArgParser();
   ArgParser(std::string const &name, std::string const &description, std::string const &envvar, unsigned arg_num,
             Function const &f);
+  // A parser for a schema defined at compile time, see StaticSchema. It is already frozen.
+  explicit ArgParser(Schema const &schema);
+  // A copy of the definition of the parser, not frozen yet, without the command lines cached
+  ArgParser(ArgParser const &other);
+  ArgParser &operator=(ArgParser const &other);
   ~ArgParser();
 
   /** Add an option to current command with arguments
@@ -219,6 +1419,10 @@ public:
   Command &add_option(std::string const &long_option, std::string const &short_option, std::string const &description,
                       std::string const &envvar = "", unsigned arg_num = 0, std::string const &default_value = "",
                       std::string const &key = "");
+  // Add an option to current command whose values are converted by the parse, see Command::add_typed_option()
+  Command &add_typed_option(std::string const &long_option, std::string const &short_option, std::string const &description,
+                            ValueType type, std::string const &envvar = "", unsigned arg_num = 1,
+                            std::string const &default_value = "", std::string const &key = "");
 
   /** Two ways of adding command to the parser:
       @return The new command instance.
@@ -227,35 +1431,238 @@ public:
                        std::string const &key = "");
   Command &add_command(std::string const &cmd_name, std::string const &cmd_description, std::string const &cmd_envvar,
                        unsigned cmd_arg_num, Function const &f = nullptr, std::string const &key = "");
+  // Add a lazy sub-command to the top level command, see Command::add_command()
+  template <typename B, typename = std::enable_if_t<std::is_invocable_v<B const &, Command &>>>
+  Command &
+  add_command(std::string const &cmd_name, std::string const &cmd_description, B const &builder, Function const &f = nullptr,
+              std::string const &key = "")
+  {
+    return _top_level_command.add_command(cmd_name, cmd_description, builder, f, key);
+  }
   // give a defaut command to this parser
   void set_default_command(std::string const &cmd);
   /** Main parsing function
       @return The Arguments object available for program using
   */
-  Arguments parse(const char **argv);
+  Arguments parse(const char **argv) const;
+  /** Zero-copy parsing: the values of the returned Arguments point into argv directly,
+      so argv has to outlive the returned object.
+      @return The Arguments object available for program using
+  */
+  Arguments parse_view(int argc, const char **argv) const;
+  /** The same without exiting, for a program that has to survive a bad command line: the parse stops at the
+      first error, which is returned in error, along with what has been parsed so far.
+      The help and version options are reported as errors too.
+  */
+  Arguments parse(const char **argv, ParseError &error) const;
+  Arguments parse_view(int argc, const char **argv, ParseError &error) const;
+  /** Apply the options of `tokens`, e.g. {"--globalx", "a", "b"}, on top of the Arguments parsed by this parser,
+      as if they were given at the end of the command line, but only the options given are checked and set: their
+      values replace the ones they had. They can be options of any command called. An error, reported at the
+      index of the token, leaves args as they were. The tokens are copied into the arena of args.
+      @return The look-up keys of the options whose values changed, in the order they are given.
+  */
+  std::vector<std::string_view> apply(Arguments &args, int count, const char **tokens, ParseError &error) const;
+  /** Batch mode: parse each line of `in` as the arguments of `program` and invoke the function of the command, in
+      order. The arguments are separated by white space, and can be quoted or escaped like in a response file.
+      Blank lines and lines starting with # are skipped, and response files are not read. An error is written
+      to `out` with the number of the line, and so is a help message, then the next line is parsed. `each`, if
+      any, is called with the Arguments of a line right before its function, for the function to get them: they
+      are only valid until the next line.
+      @return The number of lines with an error.
+  */
+  unsigned parse_batch(std::istream &in, std::string_view program, std::ostream &out = std::cout,
+                       std::function<void(Arguments const &)> const &each = nullptr) const;
+  /** Keep the Arguments of the last `capacity` distinct command lines parsed by parse_cached(), the least
+      recently used one is dropped for a new one. 0 turns the cache off. Call it before the parser is shared.
+  */
+  void enable_cache(size_t capacity);
+  /** parse() through the cache: a command line with the same arguments, including the program name, and the
+      same values of the environment variables the parse looked up as a cached one returns its Arguments,
+      shared and immutable, without parsing again. A command line with an error, the help or the version is
+      never cached, neither is one with a response file, whose content can change.
+  */
+  std::shared_ptr<const Arguments> parse_cached(int argc, const char **argv) const;
+  std::shared_ptr<const Arguments> parse_cached(int argc, const char **argv, ParseError &error) const;
+  // The counters of the cache of parse_cached()
+  struct CacheStats {
+    uint64_t hits   = 0;
+    uint64_t misses = 0;
+    // the number of command lines cached
+    size_t size = 0;
+  };
+  CacheStats cache_stats() const;
+  // Drop the Arguments cached, for the environment variables to be looked up again; the counters are kept
+  void clear_cache() const;
+  /** Compile the commands and options into the immutable schema parsing runs against.
+      Nothing can be added to the parser afterwards. parse() calls it if needed.
+      Parsing is then reentrant, a parser can be shared by several threads.
+  */
+  void freeze() const;
+  // The schema compiled by freeze(), nullptr before
+  Schema const *schema() const;
+  /** The handle of a look-up key, to get its data from the parsed Arguments in constant time.
+      It freezes the parser.
+  */
+  ArgKey key(std::string_view name);
   // Add the usage to global_usage for help_message(). Something like: traffic_blabla [--SWITCH [ARG]]
   void add_global_usage(std::string const &usage);
+  /** Accept any prefix of a long option or subcommand no other one has, like --glob for --globalx.
+      The exact name always wins, an ambiguous prefix is an error listing the candidates.
+  */
+  void allow_abbreviations();
+  /** Read the arguments in the file at path for an argument @path, to get past the limit of the size of argv.
+      The arguments are separated by white space, and can be quoted or escaped like in a shell. The file is
+      mapped in memory for as long as the Arguments parsed from it, which point into it.
+  */
+  void allow_response_files();
+  /** Answer the hidden commands `program __complete <cword> <argv...>` and `program __completion <shell>` of the
+      shell completion in parse(), see complete() and completion_script(). They are arguments as any other
+      otherwise.
+  */
+  void enable_completion();
   // help message that can be called
   void help_message(std::string_view err = "") const;
+  void version_message() const;
+  /** Complete the word argv[cword] of a command line, see Schema::complete(). It freezes the parser.
+      parse() answers `program __complete <cword> <argv...>` with the same, one per line, see enable_completion().
+  */
+  std::vector<std::string_view> complete(int argc, const char **argv, int cword) const;
+  /** The completion script of the program for "bash" or "zsh", empty for another shell, which calls
+      `program __complete`. parse() answers `program __completion <shell>` with it, see enable_completion().
+  */
+  static std::string completion_script(std::string_view shell, std::string_view program);
   /** Require subcommand/options for this command
       @return The Command instance for chained calls.
   */
   Command &require_commands();
+  // Constraints between the options of the top level command, see Command::mutually_exclusive()
+  Command &mutually_exclusive(std::vector<std::string> const &long_options);
+  Command &require_one_of(std::vector<std::string> const &long_options);
+  Command &option_requires(std::string const &long_option, std::vector<std::string> const &long_options);
+  Command &set_range(std::string const &long_option, std::string const &min, std::string const &max);
   // set the error message
   void set_error(std::string e);
   // get the error message
   std::string get_error() const;
 
 protected:
-  // Converted from 'const char **argv' for the use of parsing and help
-  AP_StrVec _argv;
+  // The state of a single pass over argv, see ArgParser.cc
+  struct ParseState;
+  // The names and values of the environment variables a parse looked up, see parse_cached()
+  using EnvList = std::vector<std::pair<std::string, std::string>>;
+  // Helper method for parse and parse_view
+  Arguments parse_argv(unsigned argc, const char **argv, bool copy, ParseError &error, EnvList *env = nullptr) const;
+  // Helper method for parse_argv and parse_batch: parse the arguments into ret, whose arena has them unless copy is false
+  void parse_args(Arguments &ret, std::string_view const *args, unsigned arg_count, bool copy, ParseError &error,
+                  EnvList *env = nullptr) const;
+  // Helper method for parse_argv: answer __complete and __completion, return false for any other command line
+  bool completion_query(unsigned argc, const char **argv, ParseError &error) const;
+  // output the help or version message of the error and exit
+  void report(ParseError const &error) const;
+  // output the help message of a command of schema, rendered once, with the error message if any, then exit
+  void help_message(Schema const &schema, SchemaCommand const &cmd, std::string_view err, int return_code) const;
+  /** Helper method for freeze and build: flatten the command tree, or extend base, compiled from it before, with the
+      command built in place of its lazy command at lazy_index, compiling that one only.
+  */
+  std::shared_ptr<const Schema> compile(std::shared_ptr<const Schema> const &base = nullptr, unsigned lazy_index = 0,
+                                        Command const *built = nullptr) const;
+  // Helper method for freeze and build: nothing can be added to the command and its subcommands of parser any more,
+  // or everything can again if parser is nullptr
+  static void freeze_commands(Command const &command, ArgParser const *parser);
+  // Report what is added after the parser is frozen by the parses, see Command::late()
+  void late(std::string const &what) const;
+  // Helper method for the parses: the error of what was added after the parser was frozen, if there is no other one
+  void check_late(ParseError &error) const;
+  /** Call the builder of a lazy command of schema on a copy of the command, and extend the schema with it, return the
+      schema to parse against then. It is the one of the parser if another parse replaced schema in the meantime.
+  */
+  std::shared_ptr<const Schema> build(Schema const &schema, SchemaCommand const &cmd) const;
+  // The schema of the parser, replaced when a lazy command is built
+  std::shared_ptr<const Schema> current() const;
+
   // the top level command object for program use
   Command _top_level_command;
   // user-customized error message output
   std::string _error_msg;
+  // the usage of the help message
+  std::string _global_usage;
+  // see allow_abbreviations(), allow_response_files() and enable_completion()
+  bool _abbreviations  = false;
+  bool _response_files = false;
+  bool _completion     = false;
+  // the schema compiled by freeze(), once, then again by build() for each lazy command
+  mutable std::shared_ptr<const Schema> _schema;
+  mutable std::unique_ptr<std::once_flag> _freeze_once = std::make_unique<std::once_flag>();
+  // the schemas replaced by build(), which the views and pointers parses return can point into
+  mutable std::vector<std::shared_ptr<const Schema>> _built;
+  // the lazy commands built by build(), copies of the ones defined which are left unbuilt for the copies of the parser
+  mutable std::list<Command> _built_commands;
+  mutable std::mutex _build_mutex;
+  // the first thing added after the parser is frozen, written once _late is 1 and read once it is 2
+  mutable std::string _late_error;
+  mutable std::atomic<int> _late{0};
+  // the schema defined at compile time the parser is for, nullptr if none
+  Schema const *_static_schema = nullptr;
+  // the help messages of the commands of the schema compiled by freeze() without the error message, by index,
+  // rendered on demand
+  mutable std::unique_ptr<std::string[]> _help;
+  mutable std::unique_ptr<std::once_flag[]> _help_once;
+  mutable Schema const *_help_schema = nullptr;
+  // the Arguments of parse_cached(), nullptr unless enable_cache() is called, see ArgParser.cc
+  struct ParseCache;
+  std::unique_ptr<ParseCache> _cache;
 
   friend class Command;
   friend class Arguments;
 };
 
+// The outcome of the function of one of the Arguments run by an Executor
+struct ActionResult {
+  // the index of the Arguments in the batch
+  size_t index = 0;
+  // false if the function threw, or if there is none
+  bool ok = true;
+  // the message and the exception thrown otherwise
+  std::string error;
+  std::exception_ptr exception;
+};
+
+/** Runs the functions of many parsed Arguments on a pool of threads, so that independent commands run in
+    parallel. The batch is split into a range for each thread, which takes the Arguments from the front of its
+    own range and, once done, steals from the back of the others'. The completions are reported on the calling
+    thread, in the order of the batch or as they come.
+*/
+class Executor
+{
+public:
+  enum Completion {
+    ORDERED,   // in the order of the batch
+    UNORDERED, // as soon as each function returns
+  };
+
+  // A pool of `concurrency` threads, one per hardware thread if 0
+  explicit Executor(unsigned concurrency = 0);
+  ~Executor();
+  Executor(Executor const &) = delete;
+  Executor &operator=(Executor const &) = delete;
+
+  // the number of threads of the pool
+  unsigned concurrency() const noexcept;
+  /** Invoke the function of each of the Arguments of the batch and call `done` with its result, on this thread.
+      `each`, if any, is called on the thread of the pool with the Arguments right before their function, for it
+      to get them. A single batch runs at a time.
+  */
+  void run(std::vector<Arguments> &batch, std::function<void(ActionResult const &)> const &done, Completion completion = ORDERED,
+           std::function<void(Arguments const &)> const &each = nullptr);
+  // the same, returning the results in the order they are reported
+  std::vector<ActionResult> run(std::vector<Arguments> &batch, Completion completion = ORDERED,
+                                std::function<void(Arguments const &)> const &each = nullptr);
+
+private:
+  // The threads and the state of the batch they run, see ArgParser.cc
+  struct Pool;
+  std::unique_ptr<Pool> _pool;
+};
+
 } // namespace ts
@@ -0,0 +1,805 @@
+/** @file
+
+  Benchmark for ArgParser
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+
+#include "catch.hpp"
+#include "ArgParser.h"
+
+#include <atomic>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+// number of tokens parsed in each run, divide the mean to get the per-token cost
+constexpr unsigned TOKEN_NUM = 1000;
+
+TEST_CASE("Option lookup", "[lookup]")
+{
+  for (unsigned option_num : {500, 1000, 5000}) {
+    ts::ArgParser parser;
+    // the string-keyed tree the options used to be looked up in
+    std::map<std::string, unsigned, std::less<>> option_map;
+    std::vector<std::string> names;
+    for (unsigned i = 0; i < option_num; i++) {
+      names.push_back("--option" + std::to_string(i));
+      parser.add_option(names.back(), "", "option " + std::to_string(i));
+      option_map[names.back()] = i;
+    }
+    parser.freeze();
+
+    std::mt19937 rng(option_num);
+    std::vector<const char *> argv = {"traffic_bench"};
+    for (unsigned i = 0; i < TOKEN_NUM; i++) {
+      argv.push_back(names[rng() % option_num].c_str());
+    }
+
+    std::string suffix = std::to_string(option_num) + " options, " + std::to_string(TOKEN_NUM) + " tokens";
+    BENCHMARK("std::map lookup, " + suffix)
+    {
+      unsigned found = 0;
+      for (unsigned i = 1; i < argv.size(); i++) {
+        found += option_map.find(std::string_view(argv[i])) != option_map.end();
+      }
+      return found;
+    };
+    BENCHMARK("schema lookup, " + suffix)
+    {
+      ts::Schema const &schema = *parser.schema();
+      unsigned found           = 0;
+      for (unsigned i = 1; i < argv.size(); i++) {
+        found += schema.find_option(schema.commands[0], argv[i]) != nullptr;
+      }
+      return found;
+    };
+    BENCHMARK("parse, " + suffix) { return parser.parse_view(argv.size(), argv.data()); };
+
+    // the same options given by an abbreviation
+    ts::ArgParser abbreviating;
+    abbreviating.allow_abbreviations();
+    std::map<std::string_view, std::string> abbreviations;
+    for (auto const &name : names) {
+      abbreviating.add_option(name + "-long", "", "option");
+      abbreviations[name] = name + "-";
+    }
+    std::vector<const char *> abbreviated = {"traffic_bench"};
+    for (unsigned i = 1; i < argv.size(); i++) {
+      abbreviated.push_back(abbreviations[argv[i]].c_str());
+    }
+    BENCHMARK("parse with abbreviations, " + suffix)
+    {
+      return abbreviating.parse_view(abbreviated.size(), abbreviated.data());
+    };
+  }
+}
+
+// a command tree the size of a typical tool
+static constexpr ts::SchemaDef tool_defs[] = {
+  ts::SchemaDef::option("", "--help", "-h", "Print usage information"),
+  ts::SchemaDef::option("", "--version", "-V", "Print version string"),
+  ts::SchemaDef::option("", "--debug", "", "Enable debugging output"),
+  ts::SchemaDef::option("", "--run-root", "", "using TS_RUNROOT as sandbox", "TS_RUNROOT", 1),
+  ts::SchemaDef::command("config", "Manipulate configuration records").require_commands(),
+  ts::SchemaDef::command("config get", "Get one or more configuration values", "", MORE_THAN_ONE_ARG_N),
+  ts::SchemaDef::option("config get", "--records", "", "Emit output in records.config format"),
+  ts::SchemaDef::command("config set", "Set a configuration value", "", 2),
+  ts::SchemaDef::command("config reload", "Request a configuration reload"),
+  ts::SchemaDef::command("config status", "Check the configuration status"),
+  ts::SchemaDef::command("metric", "Manipulate performance metrics").require_commands(),
+  ts::SchemaDef::command("metric get", "Get one or more metric values", "", MORE_THAN_ONE_ARG_N),
+  ts::SchemaDef::command("metric match", "Get metrics matching a regular expression", "", MORE_THAN_ZERO_ARG_N),
+  ts::SchemaDef::command("metric clear", "Clear all metric values"),
+  ts::SchemaDef::option("metric clear", "--cluster", "-c", "Clear the cluster metrics as well"),
+  ts::SchemaDef::command("server", "Stop, restart and examine the server").require_commands(),
+  ts::SchemaDef::command("server restart", "Restart Traffic Server"),
+  ts::SchemaDef::option("server restart", "--drain", "", "Wait for client connections to drain before restarting"),
+  ts::SchemaDef::command("server stop", "Stop Traffic Server"),
+  ts::SchemaDef::option("server stop", "--drain", "", "Wait for client connections to drain before stopping"),
+  ts::SchemaDef::command("server status", "Show the proxy status"),
+  ts::SchemaDef::command("storage", "Manipulate cache storage").require_commands(),
+  ts::SchemaDef::command("storage offline", "Take one or more storage volumes offline", "", MORE_THAN_ONE_ARG_N),
+  ts::SchemaDef::command("storage status", "Show the storage configuration", "", MORE_THAN_ZERO_ARG_N),
+};
+static constexpr ts::StaticSchema tool_schema(tool_defs);
+
+// the same command tree, built at run time
+static void
+build_tool(ts::ArgParser &parser)
+{
+  parser.add_option("--help", "-h", "Print usage information");
+  parser.add_option("--version", "-V", "Print version string");
+  parser.add_option("--debug", "", "Enable debugging output");
+  parser.add_option("--run-root", "", "using TS_RUNROOT as sandbox", "TS_RUNROOT", 1);
+  auto &config = parser.add_command("config", "Manipulate configuration records").require_commands();
+  config.add_command("get", "Get one or more configuration values", "", MORE_THAN_ONE_ARG_N)
+    .add_option("--records", "", "Emit output in records.config format");
+  config.add_command("set", "Set a configuration value", "", 2);
+  config.add_command("reload", "Request a configuration reload");
+  config.add_command("status", "Check the configuration status");
+  auto &metric = parser.add_command("metric", "Manipulate performance metrics").require_commands();
+  metric.add_command("get", "Get one or more metric values", "", MORE_THAN_ONE_ARG_N);
+  metric.add_command("match", "Get metrics matching a regular expression", "", MORE_THAN_ZERO_ARG_N);
+  metric.add_command("clear", "Clear all metric values").add_option("--cluster", "-c", "Clear the cluster metrics as well");
+  auto &server = parser.add_command("server", "Stop, restart and examine the server").require_commands();
+  server.add_command("restart", "Restart Traffic Server")
+    .add_option("--drain", "", "Wait for client connections to drain before restarting");
+  server.add_command("stop", "Stop Traffic Server")
+    .add_option("--drain", "", "Wait for client connections to drain before stopping");
+  server.add_command("status", "Show the proxy status");
+  auto &storage = parser.add_command("storage", "Manipulate cache storage").require_commands();
+  storage.add_command("offline", "Take one or more storage volumes offline", "", MORE_THAN_ONE_ARG_N);
+  storage.add_command("status", "Show the storage configuration", "", MORE_THAN_ZERO_ARG_N);
+}
+
+TEST_CASE("Parser construction", "[startup]")
+{
+  const char *argv[] = {"traffic_bench", "server", "restart", "--drain", NULL};
+
+  BENCHMARK("run time tree: build, freeze and parse")
+  {
+    ts::ArgParser parser;
+    build_tool(parser);
+    return parser.parse_view(4, argv);
+  };
+  BENCHMARK("constexpr schema: parse")
+  {
+    ts::ArgParser parser(tool_schema);
+    return parser.parse_view(4, argv);
+  };
+}
+
+TEST_CASE("Arguments lookup", "[get]")
+{
+  ts::ArgParser parser;
+  std::vector<std::string> keys;
+  for (unsigned i = 0; i < 200; i++) {
+    keys.push_back("option" + std::to_string(i));
+    parser.add_option("--" + keys.back(), "", "option " + std::to_string(i), "", 1);
+  }
+  std::vector<ts::ArgKey> handles;
+  std::vector<std::string> storage;
+  std::vector<const char *> argv = {"traffic_bench"};
+  for (unsigned i = 0; i < keys.size(); i++) {
+    handles.push_back(parser.key(keys[i]));
+    storage.push_back("--" + keys[i] + "=value");
+  }
+  for (auto const &arg : storage) {
+    argv.push_back(arg.c_str());
+  }
+  ts::Arguments args = parser.parse_view(argv.size(), argv.data());
+
+  BENCHMARK("get by name, 200 keys")
+  {
+    size_t size = 0;
+    for (auto const &key : keys) {
+      size += args.get(key).size();
+    }
+    return size;
+  };
+  BENCHMARK("get by handle, 200 keys")
+  {
+    size_t size = 0;
+    for (ts::ArgKey key : handles) {
+      size += args.get(key).size();
+    }
+    return size;
+  };
+
+  // the same options as numbers, converted by the caller or by the parse
+  ts::ArgParser typed;
+  std::vector<ts::ArgKey> typed_handles;
+  for (unsigned i = 0; i < keys.size(); i++) {
+    typed.add_typed_option("--" + keys[i], "", "option " + std::to_string(i), ts::ValueType::UNSIGNED);
+    storage[i]  = "--" + keys[i] + "=" + std::to_string(i * 1000003);
+    argv[i + 1] = storage[i].c_str();
+  }
+  for (auto const &key : keys) {
+    typed_handles.push_back(typed.key(key));
+  }
+  ts::Arguments numbers = parser.parse_view(argv.size(), argv.data());
+  BENCHMARK("std::stoul of get by handle, 200 keys")
+  {
+    uint64_t sum = 0;
+    for (ts::ArgKey key : handles) {
+      sum += std::stoul(std::string(numbers.get(key).value_view()));
+    }
+    return sum;
+  };
+  ts::Arguments typed_numbers = typed.parse_view(argv.size(), argv.data());
+  BENCHMARK("as_unsigned of get by handle, 200 keys")
+  {
+    uint64_t sum = 0;
+    for (ts::ArgKey key : typed_handles) {
+      sum += typed_numbers.get(key).as_unsigned();
+    }
+    return sum;
+  };
+  BENCHMARK("parse_view, 200 options") { return parser.parse_view(argv.size(), argv.data()); };
+  BENCHMARK("parse_view, 200 typed options") { return typed.parse_view(argv.size(), argv.data()); };
+}
+
+TEST_CASE("Concurrent parsing", "[thread]")
+{
+  ts::ArgParser parser;
+  build_tool(parser);
+  parser.freeze();
+  ts::ArgParser const &shared = parser;
+
+  constexpr unsigned PARSE_NUM = 10000;
+  for (unsigned thread_num : {1, 2, 4, 8}) {
+    BENCHMARK(std::to_string(thread_num) + " threads, " + std::to_string(PARSE_NUM) + " parses each")
+    {
+      std::vector<std::thread> threads;
+      for (unsigned t = 0; t < thread_num; t++) {
+        threads.emplace_back([&]() {
+          const char *argv[] = {"traffic_bench", "config", "get", "proxy.config.http.cache.http", "--records"};
+          for (unsigned i = 0; i < PARSE_NUM; i++) {
+            shared.parse_view(5, argv);
+          }
+        });
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+    };
+  }
+}
+
+TEST_CASE("Parse throughput", "[parse]")
+{
+  ts::ArgParser parser;
+  parser.add_option("--verbose", "-v", "verbose");
+  parser.add_command("get", "get the values", "", MORE_THAN_ZERO_ARG_N);
+  for (unsigned i = 0; i < 100; i++) {
+    parser.add_option("--option" + std::to_string(i), "", "option " + std::to_string(i), "", 1);
+  }
+  // a chain of nested commands, each with an option
+  ts::ArgParser::Command *command = &parser.add_command("nest0", "nested 0");
+  for (unsigned i = 1; i < 16; i++) {
+    command->add_option("--nest" + std::to_string(i - 1), "", "nested option", "", 1);
+    command = &command->add_command("nest" + std::to_string(i), "nested " + std::to_string(i));
+  }
+  parser.freeze();
+
+  std::vector<std::string> storage;
+  auto make_argv = [&](std::vector<std::string> args) {
+    storage                        = std::move(args);
+    std::vector<const char *> argv = {"traffic_bench"};
+    for (auto const &arg : storage) {
+      argv.push_back(arg.c_str());
+    }
+    argv.push_back(NULL);
+    return argv;
+  };
+
+  // argv length
+  for (unsigned length : {10, 100, 1000, 10000}) {
+    std::vector<std::string> args = {"get"};
+    for (unsigned i = 1; i < length; i++) {
+      args.push_back("proxy.config.value." + std::to_string(i));
+    }
+    std::vector<const char *> argv = make_argv(args);
+    BENCHMARK("parse, argv length " + std::to_string(length)) { return parser.parse(argv.data()); };
+    BENCHMARK("parse_view, argv length " + std::to_string(length)) { return parser.parse_view(length + 1, argv.data()); };
+  }
+
+  // --opt value vs. --opt=value
+  std::vector<std::string> separate;
+  std::vector<std::string> joined;
+  for (unsigned i = 0; i < 100; i++) {
+    separate.push_back("--option" + std::to_string(i));
+    separate.push_back("value" + std::to_string(i));
+    joined.push_back("--option" + std::to_string(i) + "=value" + std::to_string(i));
+  }
+  std::vector<const char *> argv = make_argv(separate);
+  BENCHMARK("parse_view, 100 options as --opt value") { return parser.parse_view(argv.size() - 1, argv.data()); };
+  argv = make_argv(joined);
+  BENCHMARK("parse_view, 100 options as --opt=value") { return parser.parse_view(argv.size() - 1, argv.data()); };
+
+  // nesting depth, with an option of each level given at the deepest one
+  for (unsigned depth : {1, 4, 16}) {
+    std::vector<std::string> args;
+    for (unsigned i = 0; i < depth; i++) {
+      args.push_back("nest" + std::to_string(i));
+    }
+    for (unsigned i = 0; i + 1 < depth; i++) {
+      args.push_back("--nest" + std::to_string(i));
+      args.push_back("value");
+    }
+    args.push_back("-v");
+    std::vector<const char *> nested = make_argv(args);
+    BENCHMARK("parse_view, nesting depth " + std::to_string(depth)) { return parser.parse_view(nested.size() - 1, nested.data()); };
+  }
+
+  // none of the options given, all of them taking their default values
+  ts::ArgParser defaults;
+  for (unsigned i = 0; i < 100; i++) {
+    defaults.add_option("--option" + std::to_string(i), "", "option " + std::to_string(i), "", 2, "localhost 8080");
+  }
+  defaults.freeze();
+  const char *bare[] = {"traffic_bench", NULL};
+  BENCHMARK("parse_view, 100 default values") { return defaults.parse_view(1, bare); };
+}
+
+TEST_CASE("Schema build", "[build]")
+{
+  for (unsigned num : {100, 1000}) {
+    std::vector<std::string> names;
+    for (unsigned i = 0; i < num; i++) {
+      names.push_back(std::to_string(i));
+    }
+    BENCHMARK("add_option and freeze, " + std::to_string(num) + " options")
+    {
+      ts::ArgParser parser;
+      for (auto const &name : names) {
+        parser.add_option("--option" + name, "", "option " + name, "", 1, "default");
+      }
+      parser.freeze();
+      return parser.schema()->key_count;
+    };
+    BENCHMARK("add_command and freeze, " + std::to_string(num) + " commands with 4 options each")
+    {
+      ts::ArgParser parser;
+      for (auto const &name : names) {
+        ts::ArgParser::Command &command = parser.add_command("command" + name, "command " + name);
+        command.add_option("--path", "-p", "the path", "", 1);
+        command.add_option("--host", "-H", "the host", "", 1);
+        command.add_option("--force", "-f", "force");
+        command.add_option("--tags", "-t", "the tags", "", MORE_THAN_ONE_ARG_N);
+      }
+      parser.freeze();
+      return parser.schema()->key_count;
+    };
+  }
+}
+
+TEST_CASE("Help rendering", "[help]")
+{
+  ts::ArgParser parser;
+  build_tool(parser);
+  parser.add_global_usage("traffic_ctl [OPTIONS] CMD [ARGS ...]");
+  for (unsigned i = 0; i < 100; i++) {
+    parser.add_option("--option" + std::to_string(i), "", "option number " + std::to_string(i), "", 1, "default");
+  }
+  parser.freeze();
+  ts::Schema const &schema = *parser.schema();
+
+  BENCHMARK("help message, 19 commands and 104 options")
+  {
+    std::ostringstream out;
+    schema.output_help(out, schema.commands[0], "");
+    return out.str().size();
+  };
+
+  const char *argv[] = {"traffic_ctl", "server", "bogus", NULL};
+  ts::ParseError error;
+  parser.parse(argv, error);
+  BENCHMARK("ParseError::help of a subcommand") { return error.help().size(); };
+}
+
+TEST_CASE("Environment lookup", "[env]")
+{
+  // a crowded environment, looked up by options sharing a few variables
+  for (unsigned i = 0; i < 300; i++) {
+    setenv(("TS_BENCH_FILLER_" + std::to_string(i)).c_str(), "filler", 1);
+  }
+  ts::ArgParser parser;
+  for (unsigned i = 0; i < TOKEN_NUM / 2; i++) {
+    std::string envvar = "TS_BENCH_ENV_" + std::to_string(i % 10);
+    setenv(envvar.c_str(), "value", 1);
+    parser.add_option("--option" + std::to_string(i), "", "option " + std::to_string(i), envvar, 1);
+  }
+  parser.freeze();
+
+  std::vector<std::string> args;
+  for (unsigned i = 0; i < TOKEN_NUM / 2; i++) {
+    args.push_back("--option" + std::to_string(i) + "=value");
+  }
+  std::vector<const char *> argv = {"traffic_bench"};
+  for (auto const &arg : args) {
+    argv.push_back(arg.c_str());
+  }
+  argv.push_back(NULL);
+
+  BENCHMARK("parse_view, 500 options with 10 environment variables") { return parser.parse_view(argv.size() - 1, argv.data()); };
+}
+
+TEST_CASE("Completion", "[complete]")
+{
+  const char *commands[] = {"traffic_ctl", "server", "st", NULL};
+  const char *options[]  = {"traffic_ctl", "server", "restart", "--", NULL};
+
+  // a TAB press of a program with a schema defined at compile time, as the shell runs it
+  BENCHMARK("constexpr schema: complete a subcommand")
+  {
+    ts::ArgParser parser(tool_schema);
+    return parser.complete(3, commands, 2).size();
+  };
+  BENCHMARK("constexpr schema: complete an option")
+  {
+    ts::ArgParser parser(tool_schema);
+    return parser.complete(4, options, 3).size();
+  };
+  BENCHMARK("run time tree: build, freeze and complete a subcommand")
+  {
+    ts::ArgParser parser;
+    build_tool(parser);
+    return parser.complete(3, commands, 2).size();
+  };
+
+  ts::ArgParser wide;
+  for (unsigned i = 0; i < 5000; i++) {
+    wide.add_command("command" + std::to_string(i), "command " + std::to_string(i));
+  }
+  wide.freeze();
+  const char *prefix[] = {"traffic_bench", "command49", NULL};
+  BENCHMARK("complete a prefix among 5000 subcommands") { return wide.complete(2, prefix, 1).size(); };
+}
+
+TEST_CASE("Response files", "[response]")
+{
+  ts::ArgParser parser;
+  parser.allow_response_files();
+  parser.add_option("--urls", "-u", "the urls", "", MORE_THAN_ZERO_ARG_N);
+  parser.freeze();
+
+  for (unsigned num : {10000, 100000, 1000000}) {
+    std::vector<std::string> urls;
+    std::string text;
+    for (unsigned i = 0; i < num; i++) {
+      urls.push_back("http://www.example.com/path/to/object/" + std::to_string(i) + ".jpg");
+      text.append(urls.back()).append("\n");
+    }
+    char path[] = "/tmp/benchmark_ArgParser_XXXXXX";
+    int fd      = mkstemp(path);
+    if (write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size())) {
+      FAIL("cannot write " << path);
+    }
+    close(fd);
+    std::string arg = std::string("@") + path;
+
+    const char *argv1[] = {"traffic_bench", "--urls", arg.c_str(), NULL};
+    BENCHMARK("parse, " + std::to_string(num) + " urls in a response file") { return parser.parse(argv1).get("urls").size(); };
+    std::vector<const char *> argv2 = {"traffic_bench", "--urls"};
+    for (auto const &url : urls) {
+      argv2.push_back(url.c_str());
+    }
+    BENCHMARK("parse_view, " + std::to_string(num) + " urls in argv")
+    {
+      return parser.parse_view(argv2.size(), argv2.data()).get("urls").size();
+    };
+    BENCHMARK("parse_view and iterate, " + std::to_string(num) + " urls in argv")
+    {
+      ts::Arguments parsed_data = parser.parse_view(argv2.size(), argv2.data());
+      size_t length             = 0;
+      for (std::string_view url : parsed_data.get("urls")) {
+        length += url.size();
+      }
+      return length;
+    };
+    unlink(path);
+  }
+}
+
+TEST_CASE("Batch mode", "[batch]")
+{
+  unsigned calls = 0;
+
+  auto build = [&calls](ts::ArgParser &parser) {
+    parser.add_option("--debug", "", "Enable debugging output");
+    auto &config = parser.add_command("config", "Manipulate configuration records").require_commands();
+    config.add_command("get", "Get one or more configuration values", "", MORE_THAN_ONE_ARG_N, [&calls]() { calls++; });
+    config.add_command("set", "Set a configuration value", "", 2, [&calls]() { calls++; });
+    config.add_command("reload", "Request a configuration reload", [&calls]() { calls++; });
+  };
+  ts::ArgParser parser;
+  build(parser);
+  parser.freeze();
+
+  const char *get[] = {"traffic_ctl", "config", "get", "proxy.config.http.cache.http", "--debug", NULL};
+  const char *set[] = {"traffic_ctl", "config", "set", "proxy.config.diags.debug.enabled", "1", NULL};
+  std::string text;
+  for (unsigned i = 0; i < 1000; i++) {
+    text.append(i % 2 ? "config get proxy.config.http.cache.http --debug\n" : "config set proxy.config.diags.debug.enabled 1\n");
+  }
+  BENCHMARK("parse_batch, 1000 lines")
+  {
+    std::istringstream in(text);
+    return parser.parse_batch(in, "traffic_ctl");
+  };
+  // what a process per command line pays besides starting up
+  BENCHMARK("build, freeze, parse and invoke per line, 1000 lines")
+  {
+    for (unsigned i = 0; i < 1000; i++) {
+      ts::ArgParser one;
+      build(one);
+      one.parse_view(5, i % 2 ? get : set).invoke();
+    }
+    return calls;
+  };
+}
+
+TEST_CASE("Executor", "[executor]")
+{
+  ts::ArgParser parser;
+  unsigned wait_ms = 0;
+  std::atomic<unsigned> calls{0};
+  parser.add_command("check", "check a host", "", 1, [&]() {
+    if (wait_ms) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+    }
+    calls++;
+  });
+  const char *argv[] = {"traffic_bench", "check", "host", NULL};
+  ts::Executor executor(8);
+
+  for (unsigned num : {16, 10000}) {
+    wait_ms = num == 16 ? 1 : 0;
+    std::vector<ts::Arguments> batch(num, parser.parse(argv));
+    std::string suffix = std::to_string(num) + (wait_ms ? " functions waiting 1 ms" : " empty functions");
+    BENCHMARK("invoke in a row, " + suffix)
+    {
+      for (ts::Arguments &args : batch) {
+        args.invoke();
+      }
+      return calls.load();
+    };
+    BENCHMARK("Executor of 8 threads, ordered, " + suffix)
+    {
+      return executor.run(batch, ts::Executor::ORDERED).size();
+    };
+    BENCHMARK("Executor of 8 threads, unordered, " + suffix)
+    {
+      return executor.run(batch, ts::Executor::UNORDERED).size();
+    };
+  }
+}
+
+TEST_CASE("Parse cache", "[cache]")
+{
+  ts::ArgParser parser;
+  parser.add_option("--debug", "", "Enable debugging output");
+  auto &metric = parser.add_command("metric", "Manipulate performance metrics").require_commands();
+  metric.add_command("get", "Get one or more metric values", "", MORE_THAN_ONE_ARG_N);
+  metric.add_command("match", "Get metrics matching a regular expression", "", MORE_THAN_ONE_ARG_N);
+  auto &server = parser.add_command("server", "Stop, restart and examine the server").require_commands();
+  server.add_command("status", "Show the proxy status", "TS_STATUS_FORMAT", 0);
+  parser.enable_cache(64);
+
+  // the command lines a daemon is sent over and over
+  const char *status[] = {"traffic_ctl", "server", "status", NULL};
+  const char *get[]    = {"traffic_ctl", "metric", "get", "proxy.process.http.completed_requests", "--debug", NULL};
+  BENCHMARK("parse, health check")
+  {
+    return parser.parse(status).get("status").size();
+  };
+  BENCHMARK("parse_cached, health check")
+  {
+    return parser.parse_cached(3, status)->get("status").size();
+  };
+  BENCHMARK("parse, metric dump")
+  {
+    return parser.parse(get).get("get").size();
+  };
+  BENCHMARK("parse_cached, metric dump")
+  {
+    return parser.parse_cached(5, get)->get("get").size();
+  };
+  // a different command line every time, each one evicting another
+  std::vector<std::string> names;
+  for (unsigned i = 0; i < 1000; i++) {
+    names.push_back("proxy.process.http." + std::to_string(i));
+  }
+  unsigned next = 0;
+  BENCHMARK("parse_cached, 1000 distinct metrics, misses only")
+  {
+    const char *argv[] = {"traffic_ctl", "metric", "get", names[next++ % names.size()].c_str(), NULL};
+    return parser.parse_cached(4, argv)->get("get").size();
+  };
+}
+
+TEST_CASE("Apply a delta", "[apply]")
+{
+  // a daemon configured by 500 options, each with an environment variable and a default value
+  ts::ArgParser parser;
+  std::vector<std::string> names;
+  for (unsigned i = 0; i < 500; i++) {
+    names.push_back("--option" + std::to_string(i));
+    parser.add_option(names.back(), "", "option " + std::to_string(i), "TS_BENCH_OPTION" + std::to_string(i), 1, "default");
+  }
+  std::vector<const char *> argv = {"traffic_server"};
+  for (unsigned i = 0; i < 500; i += 2) {
+    argv.push_back(names[i].c_str());
+    argv.push_back("startup");
+  }
+  argv.push_back(nullptr);
+  ts::Arguments args = parser.parse(argv.data());
+
+  // an operator overriding one of them, rebuilding argv or applying the override only
+  const char *delta[] = {"--option42", "override"};
+  std::vector<const char *> rebuilt(argv.begin(), argv.end() - 1);
+  rebuilt.insert(rebuilt.end(), delta, delta + 2);
+  rebuilt.push_back(nullptr);
+  ts::ParseError error;
+  BENCHMARK("parse again with the override, 500 options")
+  {
+    return parser.parse(rebuilt.data()).get("option42").size();
+  };
+  BENCHMARK("apply the override, 500 options")
+  {
+    return parser.apply(args, 2, delta, error).size();
+  };
+}
+
+TEST_CASE("Option constraints", "[constraint]")
+{
+  // 100 options in pairs, each pair mutually exclusive, and every tenth option requiring the fourth after it
+  std::vector<std::string> keys;
+  for (unsigned i = 0; i < 104; i++) {
+    keys.push_back("option" + std::to_string(100 + i));
+  }
+  auto build = [&keys](ts::ArgParser &parser, bool constraints) {
+    for (std::string const &key : keys) {
+      parser.add_option("--" + key, "", "option");
+    }
+    for (unsigned i = 0; constraints && i < 100; i += 2) {
+      parser.mutually_exclusive({"--" + keys[i], "--" + keys[i + 1]});
+      if (i % 10 == 0) {
+        parser.option_requires("--" + keys[i], {"--" + keys[i + 4]});
+      }
+    }
+  };
+  ts::ArgParser checked;
+  build(checked, true);
+  ts::ArgParser unchecked;
+  build(unchecked, false);
+  // every fourth option
+  std::vector<std::string> given;
+  for (unsigned i = 0; i < 100; i += 4) {
+    given.push_back("--" + keys[i]);
+  }
+  std::vector<const char *> argv = {"traffic_bench"};
+  for (std::string const &option : given) {
+    argv.push_back(option.c_str());
+  }
+  argv.push_back(nullptr);
+
+  BENCHMARK("parse with 60 constraints between 100 options")
+  {
+    return checked.parse(argv.data()).get("option100").size();
+  };
+  // the same checks in the application, by look-up key
+  BENCHMARK("parse, then 60 constraints checked with Arguments::get")
+  {
+    ts::Arguments args = unchecked.parse(argv.data());
+    unsigned failed    = 0;
+    for (unsigned i = 0; i < 100; i += 2) {
+      failed += args.get(keys[i]) && args.get(keys[i + 1]);
+      if (i % 10 == 0) {
+        failed += args.get(keys[i]) && !args.get(keys[i + 4]);
+      }
+    }
+    return failed;
+  };
+}
+
+TEST_CASE("Argument storage", "[memory]")
+{
+  // the former layout, one arena-backed vector of views per key
+  struct VectorData {
+    std::string_view env_value;
+    std::pmr::vector<std::string_view> values;
+    std::string_view *runs;
+    void *typed;
+    unsigned run_count;
+    unsigned typed_count;
+    bool is_called;
+    int type;
+  };
+  WARN("sizeof(ArgumentData) " << sizeof(ts::ArgumentData) << " bytes, with a vector of values " << sizeof(VectorData)
+                               << " bytes");
+
+  // 200 options given once each, the common case
+  ts::ArgParser parser;
+  std::vector<std::string> tokens;
+  for (unsigned i = 0; i < 200; i++) {
+    std::string key = "option" + std::to_string(100 + i);
+    parser.add_option("--" + key, "", "option", "", 1);
+    tokens.push_back("--" + key);
+    tokens.push_back("value" + std::to_string(i));
+  }
+  std::vector<const char *> argv = {"traffic_bench"};
+  for (std::string const &token : tokens) {
+    argv.push_back(token.c_str());
+  }
+  argv.push_back(nullptr);
+
+  BENCHMARK("parse 200 single-valued options")
+  {
+    return parser.parse(argv.data()).get("option150").size();
+  };
+  BENCHMARK("store 200 single values in arena-backed vectors")
+  {
+    std::pmr::monotonic_buffer_resource arena;
+    std::pmr::vector<VectorData> data(&arena);
+    data.reserve(200);
+    for (unsigned i = 0; i < 200; i++) {
+      data.push_back(VectorData{{}, std::pmr::vector<std::string_view>(&arena), nullptr, nullptr, 0, 0, false, 0});
+      data.back().values.push_back(argv[2 + 2 * i]);
+    }
+    return data.size();
+  };
+}
+
+TEST_CASE("Command dispatch", "[dispatch]")
+{
+  // one parent with many sibling commands, each with a subcommand and an option, descending into the middle one
+  for (unsigned num : {10, 100, 1000, 10000}) {
+    ts::ArgParser parser;
+    for (unsigned i = 0; i < num; i++) {
+      ts::ArgParser::Command &command = parser.add_command("plugin" + std::to_string(i), "plugin command");
+      command.add_command("run", "run it").add_option("--path", "-p", "the path", "", 1);
+    }
+    parser.freeze();
+    std::string name   = "plugin" + std::to_string(num / 2);
+    const char *argv[] = {"traffic_bench", name.c_str(), "run", "--path", "/tmp", NULL};
+    BENCHMARK("parse a leaf command among " + std::to_string(num) + " siblings")
+    {
+      return parser.parse(argv).get("path").size();
+    };
+  }
+}
+
+TEST_CASE("Lazy commands", "[lazy]")
+{
+  // 100 plugins with 10 subcommands of 10 options each, a one-shot invocation of a single leaf command
+  auto plugin = [](ts::ArgParser::Command &command) {
+    for (unsigned i = 0; i < 10; i++) {
+      ts::ArgParser::Command &sub = command.add_command("sub" + std::to_string(i), "subcommand " + std::to_string(i));
+      for (unsigned j = 0; j < 10; j++) {
+        sub.add_option("--option" + std::to_string(j), "", "option " + std::to_string(j), "", 1);
+      }
+    }
+  };
+  const char *argv[] = {"traffic_bench", "plugin50", "sub5", "--option5", "value", NULL};
+
+  BENCHMARK("100 plugins built up front: build, freeze and parse")
+  {
+    ts::ArgParser parser;
+    for (unsigned i = 0; i < 100; i++) {
+      plugin(parser.add_command("plugin" + std::to_string(i), "plugin " + std::to_string(i)));
+    }
+    return parser.parse_view(5, argv).get("option5").size();
+  };
+  BENCHMARK("100 lazy plugins: build, freeze and parse")
+  {
+    ts::ArgParser parser;
+    for (unsigned i = 0; i < 100; i++) {
+      parser.add_command("plugin" + std::to_string(i), "plugin " + std::to_string(i), plugin);
+    }
+    return parser.parse_view(5, argv).get("option5").size();
+  };
+}
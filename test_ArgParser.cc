@@ -26,6 +26,35 @@
 #include "catch.hpp"
 #include "ArgParser.h"
 
+#include <atomic>
+#include <cstdlib>
+#include <memory_resource>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+// A memory resource counting the allocations made through it, see "Allocation test"
+struct CountingResource : std::pmr::memory_resource {
+  size_t count = 0;
+
+  void *
+  do_allocate(size_t bytes, size_t alignment) override
+  {
+    count++;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+  void
+  do_deallocate(void *p, size_t bytes, size_t alignment) override
+  {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+  bool
+  do_is_equal(std::pmr::memory_resource const &other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+
 int global;
 ts::ArgParser parser;
 ts::ArgParser parser2;
@@ -150,3 +179,1645 @@ TEST_CASE("Invoke test", "[invoke]")
   parsed_data.invoke();
   REQUIRE(global == 2);
 }
+
+TEST_CASE("Linear parsing test", "[parse]")
+{
+  ts::ArgParser parser3;
+
+  parser3.add_option("--url", "-u", "urls to purge", "", MORE_THAN_ONE_ARG_N);
+  parser3.add_option("--tag", "-t", "purge tag", "", 1);
+  parser3.add_command("purge", "purge the urls").add_option("--host", "-H", "host to purge", "", 1);
+
+  constexpr unsigned N = 100000;
+  std::vector<std::string> urls;
+  std::vector<std::string> eq_urls;
+  for (unsigned i = 0; i < N; i++) {
+    urls.push_back("http://example.com/" + std::to_string(i));
+    eq_urls.push_back("--url=" + urls.back());
+  }
+
+  ts::Arguments parsed_data;
+
+  // a huge variadic option
+  std::vector<const char *> argv1 = {"traffic_purge", "purge", "--host", "h1", "--url"};
+  for (auto const &url : urls) {
+    argv1.push_back(url.c_str());
+  }
+  argv1.push_back(nullptr);
+
+  parsed_data = parser3.parse(argv1.data());
+  REQUIRE(parsed_data.get("purge") == true);
+  REQUIRE(parsed_data.get("host").value() == "h1");
+  REQUIRE(parsed_data.get("url").size() == N);
+  REQUIRE(parsed_data.get("url")[N - 1] == urls.back());
+
+  // a huge number of --arg=value
+  std::vector<const char *> argv2 = {"traffic_purge", "purge"};
+  for (auto const &url : eq_urls) {
+    argv2.push_back(url.c_str());
+  }
+  argv2.push_back("-H");
+  argv2.push_back("h2");
+  argv2.push_back(nullptr);
+
+  parsed_data = parser3.parse(argv2.data());
+  REQUIRE(parsed_data.get("host").value() == "h2");
+  REQUIRE(parsed_data.get("url").size() == N);
+  REQUIRE(parsed_data.get("url")[0] == urls.front());
+
+  // options of the outer commands can be given between the arguments of an option
+  const char *argv3[] = {"traffic_purge", "purge", "--host", "-t", "t1", "h3", NULL};
+
+  parsed_data = parser3.parse(argv3);
+  REQUIRE(parsed_data.get("host").value() == "h3");
+  REQUIRE(parsed_data.get("tag").value() == "t1");
+}
+
+TEST_CASE("Zero-copy parsing test", "[parse]")
+{
+  ts::ArgParser parser4;
+
+  parser4.add_option("--name", "-n", "name of the run", "", 1);
+  parser4.add_command("run", "run something", "", MORE_THAN_ZERO_ARG_N, nullptr);
+
+  std::vector<std::string> args = {"traffic_run", "run", "a", "--name", "n1", "b"};
+  std::vector<const char *> argv;
+  for (auto const &arg : args) {
+    argv.push_back(arg.c_str());
+  }
+  argv.push_back(nullptr);
+
+  // the values point into argv
+  ts::Arguments view_data = parser4.parse_view(args.size(), argv.data());
+  REQUIRE(view_data.get("run").size() == 2);
+  REQUIRE(view_data.get("run").at_view(1).data() == args[5].c_str());
+  REQUIRE(view_data.get("name").value_view().data() == args[4].c_str());
+
+  // the values are owned by the Arguments and shared with its copies
+  ts::Arguments owned_data = parser4.parse(argv.data());
+  args[4]                  = "n2";
+  REQUIRE(owned_data.get("name").value() == "n1");
+  ts::Arguments copied_data = owned_data;
+  owned_data                = ts::Arguments();
+  REQUIRE(copied_data.get("name").value() == "n1");
+  REQUIRE(copied_data.get("run").at(0) == "a");
+
+  // a copy of the data owns its values, whether the Arguments own theirs or not
+  ts::ArgumentData run = parser4.parse(argv.data()).get("run");
+  REQUIRE(run.size() == 2);
+  REQUIRE(std::vector<std::string>(run.begin(), run.end()) == std::vector<std::string>{"a", "b"});
+  REQUIRE(run.value() == "a");
+  REQUIRE(run.at_view(1) == "b");
+  ts::ArgumentData name = parser4.parse_view(args.size(), argv.data()).get("name");
+  args[4]               = "n3";
+  REQUIRE(name.value() == "n2");
+  std::string const &env = name.env();
+  REQUIRE(env.empty());
+}
+
+TEST_CASE("Schema test", "[schema]")
+{
+  ts::ArgParser parser5;
+
+  for (unsigned i = 0; i < 600; i++) {
+    parser5.add_option("--option" + std::to_string(i), "", "option " + std::to_string(i));
+  }
+  parser5.add_option("--last", "-l", "last option", "", 1, "l1");
+  parser5.add_command("cmd", "command").add_option("--cmdoption", "-c", "command option").add_command("subcmd", "sub command");
+  parser5.freeze();
+
+  ts::Arguments parsed_data;
+
+  const char *argv1[] = {"traffic_schema", "--option599", "cmd", "-c", "subcmd", "--option0", "-l", "l2", NULL};
+
+  parsed_data = parser5.parse(argv1);
+  REQUIRE(parsed_data.get("option599") == true);
+  REQUIRE(parsed_data.get("option0") == true);
+  REQUIRE(parsed_data.get("option1") == false);
+  REQUIRE(parsed_data.get("cmdoption") == true);
+  REQUIRE(parsed_data.get("subcmd") == true);
+  REQUIRE(parsed_data.get("last").value() == "l2");
+
+  // the default values point into the schema, which outlives the parser
+  {
+    ts::ArgParser parser6;
+    parser6.add_option("--opt", "-o", "option", "", 2, "d1 d2");
+    const char *argv2[] = {"traffic_schema", NULL};
+    parsed_data         = parser6.parse(argv2);
+  }
+  REQUIRE(parsed_data.get("opt").size() == 2);
+  REQUIRE(parsed_data.get("opt")[1] == "d2");
+
+  // the default values are split when the schema is built
+  ts::SchemaOption const *last = parser5.schema()->find_option(parser5.schema()->commands[0], "--last");
+  REQUIRE(last->default_end - last->default_begin == 1);
+  REQUIRE(parser5.schema()->default_values[last->default_begin] == "l1");
+  const char *argv3[] = {"traffic_schema", NULL};
+  parsed_data         = parser5.parse(argv3);
+  REQUIRE(parsed_data.get("last").value() == "l1");
+  parsed_data.append_arg("last", "l3");
+  REQUIRE(parser5.schema()->default_values[last->default_begin] == "l1");
+}
+
+int static_global;
+static const std::function<void()> static_func = []() { static_global = 1; };
+
+static constexpr ts::SchemaDef static_defs[] = {
+  ts::SchemaDef::option("", "--globalx", "-x", "global switch x", "", 2, "", "globalx_key"),
+  ts::SchemaDef::option("", "--globaly", "-y", "global switch y", "", 2, "default1 default2"),
+  ts::SchemaDef::command("remove", "remove traffic blabla"),
+  ts::SchemaDef::command("init", "initialize traffic blabla", "", 1, &static_func),
+  ts::SchemaDef::option("init", "--initoption", "-i", "init option"),
+  ts::SchemaDef::command("init subinit", "sub initialize traffic blabla", "", 2, nullptr, "subinit_key"),
+  ts::SchemaDef::option("init subinit", "--subinitopt", "-s", "sub init option"),
+  ts::SchemaDef::command("remove subremove", "sub remove traffic blabla").add_example_usage("traffic_blabla remove subremove"),
+};
+static constexpr ts::StaticSchema static_schema(static_defs);
+
+// built by the compiler
+static_assert(static_schema.commands[0].command_end - static_schema.commands[0].command_begin == 2);
+static_assert(static_schema.commands[1].name == "init" && static_schema.commands[2].name == "remove");
+static_assert(static_schema.commands[3].key == "subinit_key");
+static_assert(static_schema.options[1].default_value == "default1 default2");
+static_assert(static_schema.options[1].default_end - static_schema.options[1].default_begin == 2);
+static_assert(static_schema.default_values[static_schema.options[1].default_begin + 1] == "default2");
+
+TEST_CASE("Static schema test", "[schema]")
+{
+  ts::ArgParser parser7(static_schema);
+
+  REQUIRE(parser7.schema() == &static_schema);
+  REQUIRE(parser7.schema()->find_option(static_schema.commands[0], "-y") == &static_schema.options[1]);
+  REQUIRE(parser7.schema()->find_command(static_schema.commands[1], "subinit") == &static_schema.commands[3]);
+
+  ts::Arguments parsed_data;
+
+  const char *argv1[] = {"traffic_blabla", "init", "a", "subinit", "b", "c", "-s", "--globalx", "x", "y", NULL};
+
+  parsed_data = parser7.parse(argv1);
+  REQUIRE(parsed_data.get("init") == true);
+  REQUIRE(parsed_data.get("init").value() == "a");
+  REQUIRE(parsed_data.get("subinit_key").size() == 2);
+  REQUIRE(parsed_data.get("subinitopt") == true);
+  REQUIRE(parsed_data.get("initoption") == false);
+  REQUIRE(parsed_data.get("globalx_key")[1] == "y");
+  REQUIRE(parsed_data.get("globaly").at(1) == "default2");
+  REQUIRE(parsed_data.has_action() == true);
+  parsed_data.invoke();
+  REQUIRE(static_global == 1);
+
+  const char *argv2[] = {"traffic_blabla", "remove", "subremove", "-y", "y1", "y2", NULL};
+
+  parsed_data = parser7.parse(argv2);
+  REQUIRE(parsed_data.get("subremove") == true);
+  REQUIRE(parsed_data.get("globaly")[0] == "y1");
+  REQUIRE(parsed_data.has_action() == false);
+}
+
+TEST_CASE("Key handle test", "[key]")
+{
+  ts::ArgParser parser8;
+
+  parser8.add_option("--verbose", "-v", "verbose");
+  parser8.add_command("run", "run things", "", 1).add_option("--path", "-p", "the path", "", 1, "", "path_key");
+  parser8.add_command("stop", "stop things").add_option("--path", "-p", "the path", "", 1, "", "path_key");
+
+  ts::ArgKey run_key  = parser8.key("run");
+  ts::ArgKey path_key = parser8.key("path_key");
+  REQUIRE(parser8.key("stop").id != run_key.id);
+
+  const char *argv1[] = {"traffic_key", "run", "r1", "-p", "/tmp", NULL};
+
+  ts::Arguments parsed_data = parser8.parse(argv1);
+  REQUIRE(parsed_data.get(run_key) == true);
+  REQUIRE(parsed_data.get(run_key).value() == "r1");
+  REQUIRE(parsed_data.get(path_key).value() == "/tmp");
+  REQUIRE(&parsed_data.get(path_key) == &parsed_data.get("path_key"));
+  REQUIRE(parsed_data.get(parser8.key("stop")) == false);
+  REQUIRE(parsed_data.get("verbose") == false);
+  REQUIRE(parsed_data.get("traffic_key") == true);
+  REQUIRE(parsed_data.get("unknown") == false);
+
+  // appending works the same for keys in and out of the schema
+  parsed_data.append_arg("verbose", "v1");
+  parsed_data.append_arg("extra", "e1");
+  REQUIRE(parsed_data.get("verbose").value() == "v1");
+  REQUIRE(parsed_data.get(parser8.key("verbose")) == true);
+  REQUIRE(parsed_data.get("extra").value() == "e1");
+
+  // the keys of a static schema are resolved by the compiler
+  constexpr ts::ArgKey subinit_key = static_schema.key("subinit_key");
+  const char *argv2[]              = {"traffic_blabla", "init", "a", "subinit", "b", "c", NULL};
+
+  parsed_data = ts::ArgParser(static_schema).parse(argv2);
+  REQUIRE(parsed_data.get(subinit_key)[1] == "c");
+}
+
+TEST_CASE("Allocation test", "[alloc]")
+{
+  ts::ArgParser parser9;
+
+  setenv("ENV_ALLOC_TEST_WITH_A_LONG_NAME", "env_alloc", 0);
+  parser9.add_option("--verbose", "-v", "verbose");
+  parser9.add_option("--tag", "-t", "tags", "", 2, "t1 t2");
+  parser9.add_command("run", "run things", "ENV_ALLOC_TEST_WITH_A_LONG_NAME", MORE_THAN_ONE_ARG_N)
+    .add_option("--path", "-p", "the path", "", 1);
+  parser9.freeze();
+
+  // the number of blocks the arena of a parse of n arguments for the run command allocates
+  auto count = [&](unsigned n, bool copy) {
+    std::vector<std::string> storage;
+    std::vector<const char *> argv = {"traffic_alloc", "run", "-v", "--path=/a/rather/long/path/to/something"};
+    for (unsigned i = 0; i < n; i++) {
+      storage.push_back("argument_number_" + std::to_string(i));
+    }
+    for (auto const &arg : storage) {
+      argv.push_back(arg.c_str());
+    }
+    size_t size = argv.size();
+    argv.push_back(NULL);
+
+    // the blocks of the arena of the parse come from the default resource
+    CountingResource counting;
+    std::pmr::memory_resource *previous = std::pmr::set_default_resource(&counting);
+    {
+      ts::Arguments parsed_data = copy ? parser9.parse(argv.data()) : parser9.parse_view(size, argv.data());
+      REQUIRE(parsed_data.get("run").size() == n);
+      REQUIRE(parsed_data.get("tag").at_view(1) == "t2");
+    }
+    std::pmr::set_default_resource(previous);
+    return counting.count;
+  };
+
+  // a single block of the arena, whatever the number of arguments
+  REQUIRE(count(10, true) == 1);
+  REQUIRE(count(10, false) == 1);
+  REQUIRE(count(1000, true) == 1);
+  REQUIRE(count(1000, false) == 1);
+
+  // copies own their values
+  const char *argv1[]       = {"traffic_alloc", "run", "r1", "r2", NULL};
+  ts::Arguments parsed_data = parser9.parse(argv1);
+  ts::Arguments copied_data;
+  copied_data = parsed_data;
+  parsed_data = ts::Arguments();
+  REQUIRE(copied_data.get("run")[1] == "r2");
+  REQUIRE(copied_data.get("run").env() == "env_alloc");
+}
+
+TEST_CASE("Reentrant parsing test", "[thread]")
+{
+  // the state of a parser is its own
+  ts::ArgParser parser10;
+  ts::ArgParser parser11;
+  parser10.add_global_usage("traffic_10");
+  parser10.add_command("run", "run things");
+  parser10.set_default_command("run");
+  parser11.add_global_usage("traffic_11");
+  parser11.add_command("run", "run things");
+
+  const char *argv1[] = {"traffic_reentrant", NULL};
+  REQUIRE(parser10.parse(argv1).get("run") == true);
+  REQUIRE(parser11.parse(argv1).get("run") == false);
+  REQUIRE(parser10.schema()->usage == "traffic_10");
+  REQUIRE(parser11.schema()->usage == "traffic_11");
+
+  // a shared parser is parsed from many threads at once, the first parse freezing it
+  ts::ArgParser parser12;
+  parser12.add_option("--verbose", "-v", "verbose");
+  parser12.add_command("get", "get records", "", MORE_THAN_ONE_ARG_N).add_option("--records", "-r", "records format");
+  parser12.add_command("set", "set a record", "", 2);
+  ts::ArgParser const &shared = parser12;
+
+  constexpr unsigned THREAD_NUM = 8;
+  constexpr unsigned PARSE_NUM  = 2000;
+  std::atomic<unsigned> failures{0};
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < THREAD_NUM; t++) {
+    threads.emplace_back([&, t]() {
+      std::string name  = "record." + std::to_string(t);
+      std::string value = std::to_string(t);
+      for (unsigned i = 0; i < PARSE_NUM; i++) {
+        ts::Arguments parsed_data;
+        if (i % 2) {
+          const char *argv[] = {"traffic_ctl", "get", name.c_str(), "-r", "other", NULL};
+          parsed_data        = shared.parse(argv);
+          failures += parsed_data.get("get").size() != 2 || parsed_data.get("get")[0] != name || !parsed_data.get("records");
+        } else {
+          const char *argv[] = {"traffic_ctl", "-v", "set", name.c_str(), value.c_str()};
+          parsed_data        = shared.parse_view(5, argv);
+          failures += parsed_data.get("set").size() != 2 || parsed_data.get("set")[1] != value || !parsed_data.get("verbose");
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(failures == 0);
+}
+
+TEST_CASE("Parse error test", "[error]")
+{
+  ts::ArgParser parser13;
+  parser13.add_global_usage("traffic_error [--SWITCH]");
+  parser13.add_option("--help", "-h", "Print usage information");
+  parser13.add_option("--version", "-V", "Print version string");
+  parser13.add_option("--tag", "-t", "tags", "", 2);
+  parser13.add_command("set", "set a record", "", 2);
+  parser13.add_command("server", "server control").require_commands().add_command("stop", "stop the server");
+
+  ts::ParseError error;
+  ts::Arguments parsed_data;
+
+  const char *argv1[] = {"traffic_error", "set", "a", "b", NULL};
+  parsed_data         = parser13.parse(argv1, error);
+  REQUIRE(!error);
+  REQUIRE(error.return_code() == 0);
+  REQUIRE(parsed_data.get("set")[1] == "b");
+
+  const char *argv2[] = {"traffic_error", "set", "a", "b", "bogus", "-x", NULL};
+  parsed_data         = parser13.parse(argv2, error);
+  REQUIRE(error.kind == ts::ParseError::UNKNOWN_ARGUMENT);
+  REQUIRE(error.token == 4);
+  REQUIRE(error.message == "Unknown command, option or args: 'bogus' '-x'");
+  REQUIRE(error.return_code() == 64);
+  REQUIRE(error.help().find("Error: Unknown command, option or args: 'bogus' '-x'") == 0);
+  REQUIRE(error.help().find("Usage: traffic_error [--SWITCH]") != std::string::npos);
+  // what has been parsed is still there
+  REQUIRE(parsed_data.get("set")[0] == "a");
+
+  const char *argv3[] = {"traffic_error", "set", "a", NULL};
+  parsed_data         = parser13.parse_view(3, argv3, error);
+  REQUIRE(error.kind == ts::ParseError::MISSING_ARGUMENT);
+  REQUIRE(error.token == 3);
+  REQUIRE(error.message == "2 argument(s) expected by set");
+
+  const char *argv4[] = {"traffic_error", "--tag=t1", "set", "a", "b", NULL};
+  parsed_data         = parser13.parse(argv4, error);
+  REQUIRE(error.kind == ts::ParseError::ARGUMENT_NUMBER);
+  REQUIRE(error.token == 1);
+
+  const char *argv5[] = {"traffic_error", "server", NULL};
+  parsed_data         = parser13.parse(argv5, error);
+  REQUIRE(error.kind == ts::ParseError::COMMAND_REQUIRED);
+  REQUIRE(error.message == "No subcommand found for server");
+  REQUIRE(error.help().find("stop") != std::string::npos);
+
+  const char *argv6[] = {"traffic_error", "server", "-h", "stop", NULL};
+  parsed_data         = parser13.parse(argv6, error);
+  REQUIRE(error.kind == ts::ParseError::HELP);
+  REQUIRE(error.token == 2);
+  REQUIRE(error.return_code() == 0);
+  REQUIRE(error.help().find("Error:") == std::string::npos);
+  REQUIRE(error.help().find("stop the server") != std::string::npos);
+
+  // rendered into one buffer, written at once
+  std::string body;
+  parser13.schema()->render_help(body, *error.command);
+  REQUIRE(error.help() == body);
+  std::ostringstream out;
+  parser13.schema()->output_help(out, *error.command, "bad usage");
+  REQUIRE(out.str() == "Error: bad usage\n" + body);
+
+  const char *argv7[] = {"traffic_error", "--version", NULL};
+  parsed_data         = parser13.parse(argv7, error);
+  REQUIRE(error.kind == ts::ParseError::VERSION);
+
+  const char *argv8[] = {NULL};
+  parsed_data         = parser13.parse(argv8, error);
+  REQUIRE(error.kind == ts::ParseError::INVALID_ARGV);
+  REQUIRE(error.return_code() == 1);
+
+  // an error does not carry over
+  parsed_data = parser13.parse(argv1, error);
+  REQUIRE(!error);
+}
+
+static constexpr ts::SchemaDef env_defs[] = {
+  ts::SchemaDef::command("start", "start the server", "ENV_SHARED_TEST", 0),
+  ts::SchemaDef::option("start", "--host", "-H", "the host", "ENV_SHARED_TEST", 1),
+  ts::SchemaDef::option("start", "--port", "-p", "the port", "ENV_PORT_TEST", 1),
+  ts::SchemaDef::option("", "--proxy", "-P", "the proxy", "ENV_SHARED_TEST", 1),
+};
+static constexpr ts::StaticSchema env_schema(env_defs);
+
+// the same environment variable is listed once
+static_assert(env_schema.envvar_count == 2);
+static_assert(env_schema.options[0].env_id == env_schema.commands[1].env_id);
+
+TEST_CASE("Environment test", "[env]")
+{
+  ts::ArgParser parser14;
+  parser14.add_option("--proxy", "-P", "the proxy", "ENV_SHARED_TEST", 1);
+  ts::ArgParser::Command &start = parser14.add_command("start", "start the server", "ENV_SHARED_TEST", 0);
+  start.add_option("--host", "-H", "the host", "ENV_SHARED_TEST", 1);
+  start.add_option("--port", "-p", "the port", "ENV_PORT_TEST", 1);
+  parser14.freeze();
+  REQUIRE(parser14.schema()->envvar_count == 2);
+
+  ts::ArgParser parser15(env_schema);
+
+  setenv("ENV_SHARED_TEST", "shared", 1);
+  unsetenv("ENV_PORT_TEST");
+
+  const char *argv1[] = {"traffic_env", "start", "--host=h1", "-P", "p1", "--host", "h2", "-p", "80", NULL};
+
+  for (ts::ArgParser *parser : {&parser14, &parser15}) {
+    ts::Arguments parsed_data = parser->parse(argv1);
+    REQUIRE(parsed_data.get("start").env() == "shared");
+    REQUIRE(parsed_data.get("host").env() == "shared");
+    REQUIRE(parsed_data.get("proxy").env() == "shared");
+    REQUIRE(parsed_data.get("port").env().empty());
+    REQUIRE(parsed_data.get("port").value() == "80");
+  }
+
+  // looked up again by the next parse
+  setenv("ENV_SHARED_TEST", "changed", 1);
+  setenv("ENV_PORT_TEST", "8080", 1);
+  ts::Arguments parsed_data = parser14.parse(argv1);
+  REQUIRE(parsed_data.get("host").env() == "changed");
+  REQUIRE(parsed_data.get("port").env() == "8080");
+  unsetenv("ENV_SHARED_TEST");
+  unsetenv("ENV_PORT_TEST");
+}
+
+TEST_CASE("Completion test", "[complete]")
+{
+  ts::ArgParser parser16;
+  parser16.add_option("--verbose", "-v", "verbose");
+  parser16.add_option("--version", "-V", "version");
+  parser16.add_option("--config", "-c", "the config file", "", 1);
+  ts::ArgParser::Command &server = parser16.add_command("server", "server commands");
+  server.add_command("start", "start the server").add_option("--clear", "", "clear the cache");
+  server.add_command("stop", "stop the server");
+  server.add_command("status", "status of the server");
+  parser16.add_command("config", "config commands").add_command("reload", "reload the config");
+  // a copy made before, without the completion queries
+  ts::ArgParser parser40 = parser16;
+  parser16.enable_completion();
+
+  using Candidates    = std::vector<std::string_view>;
+  const char *argv1[] = {"traffic_complete", "s", NULL};
+  REQUIRE(parser16.complete(2, argv1, 1) == Candidates{"server"});
+  REQUIRE(parser16.complete(1, argv1, 1) == Candidates{"config", "server"});
+
+  const char *argv2[] = {"traffic_complete", "-c", "server", "server", "st", NULL};
+  REQUIRE(parser16.complete(5, argv2, 4) == Candidates{"start", "status", "stop"});
+  // the argument of an option
+  REQUIRE(parser16.complete(5, argv2, 2).empty());
+
+  const char *argv3[] = {"traffic_complete", "server", "start", "--", NULL};
+  REQUIRE(parser16.complete(4, argv3, 3) == Candidates{"--clear", "--config", "--verbose", "--version"});
+  const char *argv4[] = {"traffic_complete", "--ver", NULL};
+  REQUIRE(parser16.complete(2, argv4, 1) == Candidates{"--verbose", "--version"});
+
+  // the hidden completion query of a parse
+  const char *argv5[] = {"traffic_complete", "__complete", "2", "traffic_complete", "server", "st", NULL};
+  ts::ParseError error;
+  ts::Arguments parsed_data = parser16.parse(argv5, error);
+  REQUIRE(error.kind == ts::ParseError::COMPLETE);
+  REQUIRE(error.return_code() == 0);
+  REQUIRE(error.message == "start\nstatus\nstop\n");
+  REQUIRE(parsed_data.get("server") == false);
+
+  const char *argv6[] = {"/usr/bin/traffic_complete", "__completion", "bash", NULL};
+  parsed_data         = parser16.parse(argv6, error);
+  REQUIRE(error.kind == ts::ParseError::COMPLETE);
+  REQUIRE(error.message == ts::ArgParser::completion_script("bash", "traffic_complete"));
+  REQUIRE(error.message.find("complete -o default -F _traffic_complete_complete traffic_complete") != std::string::npos);
+  REQUIRE(ts::ArgParser::completion_script("zsh", "traffic_complete").find("#compdef traffic_complete") == 0);
+  REQUIRE(ts::ArgParser::completion_script("fish", "traffic_complete").empty());
+
+  // not enabled, __complete is an argument as any other
+  parsed_data = parser40.parse(argv5, error);
+  REQUIRE(error.kind == ts::ParseError::UNKNOWN_ARGUMENT);
+  REQUIRE(error.message.find("__complete") != std::string::npos);
+}
+
+static constexpr ts::SchemaDef abbreviation_defs[] = {
+  ts::SchemaDef::command("", "").allow_abbreviations(),
+  ts::SchemaDef::option("", "--globalx", "-x", "global switch x", "", 1),
+  ts::SchemaDef::option("", "--globaly", "-y", "global switch y"),
+  ts::SchemaDef::command("remove", "remove traffic blabla"),
+  ts::SchemaDef::command("restart", "restart traffic blabla"),
+};
+static constexpr ts::StaticSchema abbreviation_schema(abbreviation_defs);
+
+TEST_CASE("Abbreviation test", "[abbreviation]")
+{
+  ts::ArgParser parser17;
+  parser17.allow_abbreviations();
+  parser17.add_option("--globalx", "-x", "global switch x", "", 1);
+  parser17.add_option("--globaly", "-y", "global switch y");
+  parser17.add_command("remove", "remove traffic blabla");
+  ts::ArgParser::Command &restart = parser17.add_command("restart", "restart traffic blabla");
+  restart.add_option("--drain", "-d", "drain first");
+  restart.add_option("--debug", "", "debug the restart");
+  parser17.add_option("--debug", "", "debug");
+
+  ts::ArgParser parser18(abbreviation_schema);
+  ts::ParseError error;
+
+  for (ts::ArgParser *parser : {&parser17, &parser18}) {
+    const char *argv1[]       = {"traffic_abbreviation", "--globalx", "a", "res", NULL};
+    ts::Arguments parsed_data = parser->parse(argv1, error);
+    REQUIRE(!error);
+    REQUIRE(parsed_data.get("restart") == true);
+
+    const char *argv2[] = {"traffic_abbreviation", "--glob", "a", NULL};
+    parsed_data         = parser->parse(argv2, error);
+    REQUIRE(error.kind == ts::ParseError::AMBIGUOUS);
+    REQUIRE(error.token == 1);
+    REQUIRE(error.message == "ambiguous option '--glob', could be --globalx --globaly");
+
+    const char *argv3[] = {"traffic_abbreviation", "--globalx=a", "re", NULL};
+    parsed_data         = parser->parse(argv3, error);
+    REQUIRE(error.kind == ts::ParseError::AMBIGUOUS);
+    REQUIRE(error.message == "ambiguous command 're', could be remove restart");
+  }
+
+  const char *argv4[]       = {"traffic_abbreviation", "rest", "--dr", "--globalx=a", "--globaly", NULL};
+  ts::Arguments parsed_data = parser17.parse(argv4, error);
+  REQUIRE(!error);
+  REQUIRE(parsed_data.get("drain") == true);
+  REQUIRE(parsed_data.get("globalx").value() == "a");
+  REQUIRE(parsed_data.get("globaly") == true);
+
+  // the same option in two commands is not ambiguous
+  const char *argv5[] = {"traffic_abbreviation", "restart", "--deb", "--globalx", "b", NULL};
+  parsed_data         = parser17.parse(argv5, error);
+  REQUIRE(!error);
+  REQUIRE(parsed_data.get("debug") == true);
+  const char *argv6[] = {"traffic_abbreviation", "restart", "--d", NULL};
+  parsed_data         = parser17.parse(argv6, error);
+  REQUIRE(error.message == "ambiguous option '--d', could be --debug --drain");
+
+  // not allowed by default
+  ts::ArgParser parser19;
+  parser19.add_option("--globalx", "-x", "global switch x", "", 1);
+  const char *argv7[] = {"traffic_abbreviation", "--glo", "a", NULL};
+  parsed_data         = parser19.parse(argv7, error);
+  REQUIRE(error.kind == ts::ParseError::UNKNOWN_ARGUMENT);
+}
+
+TEST_CASE("Response file test", "[response]")
+{
+  ts::ArgParser parser20;
+  parser20.allow_response_files();
+  parser20.add_option("--verbose", "-v", "verbose");
+  parser20.add_option("--urls", "-u", "the urls", "", MORE_THAN_ZERO_ARG_N);
+  parser20.add_command("purge", "purge the urls", "", 1);
+
+  char path[] = "/tmp/test_ArgParser_XXXXXX";
+  int fd      = mkstemp(path);
+  REQUIRE(fd >= 0);
+  std::string text = "a b\n  'c d' \"e \\\"f\\\" \\\\g\" h\\ i j'k'l\n\t--verbose\n";
+  REQUIRE(write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size()));
+  close(fd);
+  std::string arg = std::string("@") + path;
+
+  const char *argv1[] = {"traffic_response", "--urls", arg.c_str(), "m", NULL};
+  ts::ParseError error;
+  ts::Arguments parsed_data = parser20.parse(argv1, error);
+  REQUIRE(!error);
+  // the values point into the mapping of the file, which is kept as long as they are
+  unlink(path);
+  ts::ArgumentData const &urls = parsed_data.get("urls");
+  REQUIRE(urls.size() == 8);
+  REQUIRE(urls[0] == "a");
+  REQUIRE(urls[2] == "c d");
+  REQUIRE(urls[3] == "e \"f\" \\g");
+  REQUIRE(urls[4] == "h i");
+  REQUIRE(urls[5] == "jkl");
+  REQUIRE(urls[6] == "--verbose");
+  REQUIRE(urls[7] == "m");
+
+  const char *argv2[] = {"traffic_response", "purge", arg.c_str(), NULL};
+  parsed_data         = parser20.parse_view(3, argv2, error);
+  REQUIRE(error.kind == ts::ParseError::INVALID_ARGV);
+  REQUIRE(error.token == 2);
+  REQUIRE(error.message == "cannot read response file '" + std::string(path) + "'");
+
+  // an empty file, and a plain @
+  char empty_path[] = "/tmp/test_ArgParser_XXXXXX";
+  fd                = mkstemp(empty_path);
+  REQUIRE(fd >= 0);
+  close(fd);
+  arg                 = std::string("@") + empty_path;
+  const char *argv3[] = {"traffic_response", "purge", arg.c_str(), "@", NULL};
+  parsed_data         = parser20.parse_view(4, argv3, error);
+  unlink(empty_path);
+  REQUIRE(!error);
+  REQUIRE(parsed_data.get("purge").value() == "@");
+
+  // not allowed by default
+  ts::ArgParser parser21;
+  parser21.add_command("purge", "purge the urls", "", 1);
+  const char *argv4[] = {"traffic_response", "purge", "@no_such_file", NULL};
+  parsed_data         = parser21.parse(argv4, error);
+  REQUIRE(parsed_data.get("purge").value() == "@no_such_file");
+}
+
+TEST_CASE("Variadic values test", "[variadic]")
+{
+  ts::ArgParser parser22;
+  parser22.add_option("--tag", "-t", "purge tag", "", 1);
+  parser22.add_option("--verbose", "-v", "verbose");
+  parser22.add_command("purge", "purge the urls").add_option("--url", "-u", "urls to purge", "", MORE_THAN_ONE_ARG_N);
+
+  // the values are read from argv in runs in between the options of the outer commands
+  const char *argv1[]          = {"traffic_purge", "purge", "--url", "a", "b", "-t", "t1", "c", "d", "-v", "e", NULL};
+  ts::Arguments parsed_data    = parser22.parse_view(11, argv1);
+  ts::ArgumentData const &urls = parsed_data.get("url");
+  REQUIRE(urls.size() == 5);
+  REQUIRE(std::distance(urls.begin(), urls.end()) == 5);
+  REQUIRE(std::vector<std::string_view>(urls.begin(), urls.end()) == std::vector<std::string_view>{"a", "b", "c", "d", "e"});
+  REQUIRE(urls.begin()->data() == argv1[3]);
+  REQUIRE(urls.value() == "a");
+  REQUIRE(urls.at_view(2).data() == argv1[7]);
+  REQUIRE(urls[2] == "c");
+  REQUIRE(urls.at(4) == "e");
+  REQUIRE_THROWS_AS(urls.at(5), std::out_of_range);
+  REQUIRE(parsed_data.get("tag").value() == "t1");
+  REQUIRE(parsed_data.get("verbose") == true);
+
+  // a copy of the Arguments keeps the runs
+  ts::Arguments copied_data = parser22.parse(argv1);
+  copied_data               = ts::Arguments(copied_data);
+  REQUIRE(std::vector<std::string_view>(copied_data.get("url").begin(), copied_data.get("url").end()) ==
+          std::vector<std::string_view>{"a", "b", "c", "d", "e"});
+
+  // only the options of the outer commands are not values
+  const char *argv2[] = {"traffic_purge", "purge", "--url", "a", "-t", "t1", "--url", "b", NULL};
+  parsed_data         = parser22.parse_view(8, argv2);
+  REQUIRE(std::vector<std::string_view>(parsed_data.get("url").begin(), parsed_data.get("url").end()) ==
+          std::vector<std::string_view>{"a", "--url", "b"});
+
+  // as --arg=value only
+  const char *argv3[] = {"traffic_purge", "purge", "--url=a", "--url=b", NULL};
+  parsed_data         = parser22.parse_view(4, argv3);
+  REQUIRE(parsed_data.get("url").size() == 2);
+  REQUIRE(*++parsed_data.get("url").begin() == "b");
+
+  // no values
+  ts::ArgumentData const &none = parsed_data.get("tag");
+  REQUIRE(none.begin() == none.end());
+  REQUIRE(none.value().empty());
+
+  // the values appended come after the runs, in the order they are given
+  parsed_data = parser22.parse_view(11, argv1);
+  parsed_data.append_arg("url", "f");
+  parsed_data.append_arg("url", "g");
+  ts::ArgumentData const &appended = parsed_data.get("url");
+  REQUIRE(appended.size() == 7);
+  REQUIRE(std::vector<std::string_view>(appended.begin(), appended.end()) ==
+          std::vector<std::string_view>{"a", "b", "c", "d", "e", "f", "g"});
+  REQUIRE(appended.value_view() == "a");
+  REQUIRE(appended.at_view(5) == "f");
+  REQUIRE(appended[6] == "g");
+  ts::ArgumentData appended_copy = appended;
+  REQUIRE(std::vector<std::string_view>(appended_copy.begin(), appended_copy.end()) ==
+          std::vector<std::string_view>{"a", "b", "c", "d", "e", "f", "g"});
+
+  // a value asked for as a string is the only one copied out of the run: the others are still read from argv
+  std::vector<std::string> many(10000);
+  std::vector<const char *> argv4 = {"traffic_purge", "purge", "--url"};
+  for (unsigned i = 0; i < many.size(); i++) {
+    many[i] = "url" + std::to_string(i);
+    argv4.push_back(many[i].c_str());
+  }
+  argv4.push_back(nullptr);
+  parsed_data                 = parser22.parse_view(argv4.size() - 1, argv4.data());
+  ts::ArgumentData const &run = parsed_data.get("url");
+  REQUIRE(run.value() == "url0");
+  REQUIRE(run.at(5000) == "url5000");
+  REQUIRE(&run.at(5000) == &run[5000]);
+  many[5000][0] = many[9999][0] = 'U';
+  REQUIRE(run.at(5000) == "url5000");
+  REQUIRE(run.at(9999) == "Url9999");
+  REQUIRE(run.at_view(5000) == "Url5000");
+}
+
+TEST_CASE("Typed value test", "[typed]")
+{
+  ts::ArgParser parser23;
+  parser23.add_typed_option("--port", "-p", "the port", ts::ValueType::UNSIGNED, "", 1, "8080");
+  parser23.add_typed_option("--offset", "-o", "the offset", ts::ValueType::INT);
+  parser23.add_typed_option("--ratio", "-r", "the ratio", ts::ValueType::DOUBLE);
+  parser23.add_typed_option("--enabled", "-e", "enabled", ts::ValueType::BOOL);
+  parser23.add_typed_option("--sizes", "-s", "the sizes", ts::ValueType::BYTES, "", MORE_THAN_ONE_ARG_N);
+  parser23.add_typed_option("--timeout", "-t", "the timeout", ts::ValueType::DURATION, "", 1, "30s");
+  parser23.add_typed_option("--mode", "-m", "the mode", {ts::ValueType::ENUM, "fast|slow|auto"});
+  parser23.add_option("--name", "-n", "the name", "", 1);
+
+  const char *argv1[] = {"traffic_typed", "-o", "-42", "--ratio=0.25", "-e", "off", "-m", "auto", "-s", "512", "64K", "2MB", "1g",
+                         NULL};
+  ts::ParseError error;
+  ts::Arguments parsed_data = parser23.parse(argv1, error);
+  REQUIRE(!error);
+  REQUIRE(parsed_data.get("port").as_unsigned() == 8080);
+  REQUIRE(parsed_data.get("offset").as_int() == -42);
+  REQUIRE(parsed_data.get("ratio").as_double() == 0.25);
+  REQUIRE(parsed_data.get("enabled").as_bool() == false);
+  REQUIRE(parsed_data.get("mode").as_enum() == 2);
+  REQUIRE(parsed_data.get("timeout").as_duration() == std::chrono::seconds(30));
+  ts::ArgumentData const &sizes = parsed_data.get("sizes");
+  REQUIRE(sizes.as_bytes(0) == 512);
+  REQUIRE(sizes.as_bytes(1) == 64 << 10);
+  REQUIRE(sizes.as_bytes(2) == 2 << 20);
+  REQUIRE(sizes.as_bytes(3) == 1ull << 30);
+  // the strings are still there
+  REQUIRE(sizes[1] == "64K");
+  REQUIRE_THROWS_AS(sizes.as_bytes(4), std::out_of_range);
+  REQUIRE_THROWS_AS(sizes.as_unsigned(0), std::invalid_argument);
+  REQUIRE_THROWS_AS(parsed_data.get("name").as_int(), std::out_of_range);
+
+  const char *argv2[] = {"traffic_typed", "-t", "1500ms", "-p", "65536", NULL};
+  parsed_data         = parser23.parse(argv2, error);
+  REQUIRE(!error);
+  REQUIRE(parsed_data.get("timeout").as_duration() == std::chrono::milliseconds(1500));
+  REQUIRE(parsed_data.get("port").as_unsigned() == 65536);
+
+  // the errors, at the offending argument
+  auto check = [&](std::vector<const char *> argv, unsigned token, std::string const &message) {
+    parser23.parse_view(argv.size(), argv.data(), error);
+    REQUIRE(error.kind == ts::ParseError::INVALID_VALUE);
+    REQUIRE(error.token == token);
+    REQUIRE(error.message == message);
+    REQUIRE(error.return_code() == 64);
+  };
+  check({"traffic_typed", "-n", "x", "-p", "80x"}, 4, "invalid value '80x' for --port: not an unsigned integer");
+  check({"traffic_typed", "-p", "-1"}, 2, "invalid value '-1' for --port: not an unsigned integer");
+  check({"traffic_typed", "--offset=99999999999999999999"}, 1, "invalid value '99999999999999999999' for --offset: out of range");
+  check({"traffic_typed", "-r", "1e999"}, 2, "invalid value '1e999' for --ratio: out of range");
+  check({"traffic_typed", "-e", "maybe"}, 2, "invalid value 'maybe' for --enabled: not a boolean");
+  check({"traffic_typed", "-s", "1", "16E"}, 3, "invalid value '16E' for --sizes: out of range");
+  check({"traffic_typed", "-s", "1Q"}, 2, "invalid value '1Q' for --sizes: not a size");
+  check({"traffic_typed", "-t", "5w"}, 2, "invalid value '5w' for --timeout: unknown unit, expected ns, us, ms, s, m, h or d");
+  check({"traffic_typed", "-t", "9999999999999d"}, 2, "invalid value '9999999999999d' for --timeout: out of range");
+  check({"traffic_typed", "-m", "turbo"}, 2, "invalid value 'turbo' for --mode: expected one of fast|slow|auto");
+
+  // at compile time
+  static constexpr ts::SchemaDef defs[] = {
+    ts::SchemaDef::typed_option("", "--jobs", "-j", "the number of jobs", ts::ValueType::UNSIGNED, "", 1, "4")};
+  static constexpr ts::StaticSchema schema(defs);
+  ts::ArgParser parser24(schema);
+  const char *argv3[] = {"traffic_typed", NULL};
+  REQUIRE(parser24.parse(argv3).get("jobs").as_unsigned() == 4);
+  const char *argv4[] = {"traffic_typed", "-j", "16", NULL};
+  REQUIRE(parser24.parse(argv4).get("jobs").as_unsigned() == 16);
+
+  // the default values and the choices a StaticSchema checks, as the parse converts the values
+  using Type = ts::ValueType;
+  static_assert(Type(Type::INT).valid("-9223372036854775808") && !Type(Type::INT).valid("9223372036854775808"));
+  static_assert(Type(Type::UNSIGNED).valid("18446744073709551615") && !Type(Type::UNSIGNED).valid("-1"));
+  static_assert(Type(Type::BYTES).valid("15EB") && !Type(Type::BYTES).valid("15E1") && !Type(Type::BYTES).valid("17179869184G"));
+  static_assert(Type(Type::DURATION).valid("-30s") && !Type(Type::DURATION).valid("5w"));
+  static_assert(Type(Type::ENUM, "fast|slow").valid("slow") && !Type(Type::ENUM, "fast|slow").valid("fas"));
+  static_assert(Type(Type::ENUM, "fast|slow").valid_choices() && !Type(Type::ENUM, "fast||slow").valid_choices() &&
+                !Type(Type::ENUM, "fast|").valid_choices() && !Type(Type::ENUM, "fast|fast").valid_choices());
+  static constexpr ts::SchemaDef typed_defs[] = {
+    ts::SchemaDef::typed_option("", "--mode", "-m", "the mode", {Type::ENUM, "fast|slow"}, "", 1, "slow"),
+    ts::SchemaDef::typed_option("", "--ratio", "-r", "the ratio", Type::DOUBLE, "", 1, "2.5e-3")};
+  static constexpr ts::StaticSchema typed_schema(typed_defs);
+  ts::ArgParser parser41(typed_schema);
+  REQUIRE(parser41.parse(argv3).get("mode").as_enum() == 1);
+  // they agree with the parse
+  std::vector<std::pair<const char *, std::vector<const char *>>> values = {
+    {"-o", {"-0", "12", "1.5", "9223372036854775807", "9223372036854775808", "12a"}},
+    {"-p", {"0", "18446744073709551616", "+1"}},
+    {"-r", {"0.5", ".5", "5.", "-1e10", "1e", "inf", "NaN", "nan(1)", "1.2.3", "e5"}},
+    {"-e", {"on", "On", "2"}},
+    {"-s", {"1k", "1KB", "1Kb", "1B", "B", "16E", "16384P"}},
+    {"-t", {"1d", "-5m", "100", "9223372037s", "5ss", "s"}},
+    {"-m", {"fast", "auto", "turbo"}}};
+  ts::Schema const &compiled = *parser23.schema();
+  for (auto const &[option, list] : values) {
+    ts::ValueType type = compiled.find_option(compiled.commands[0], option)->type;
+    for (const char *value : list) {
+      const char *argv[] = {"traffic_typed", option, value, NULL};
+      parser23.parse_view(3, argv, error);
+      INFO(option << " " << value);
+      REQUIRE((error.kind != ts::ParseError::INVALID_VALUE) == type.valid(value));
+    }
+  }
+}
+
+TEST_CASE("Batch test", "[batch]")
+{
+  ts::ArgParser parser25;
+  std::vector<std::string> calls;
+  ts::Arguments const *current = nullptr;
+  parser25.add_option("--help", "-h", "help");
+  parser25.add_option("--verbose", "-v", "verbose");
+  parser25.add_command("add", "add two things", "", 2, [&]() {
+    calls.push_back(std::string(current->get("add")[0]) + "+" + std::string(current->get("add")[1]) +
+                    (current->get("verbose") ? " verbose" : ""));
+  });
+  parser25.add_command("fail", "throw", "", 0, []() { throw std::runtime_error("failed"); });
+  parser25.add_command("noop", "no function");
+
+  std::istringstream in("add 1 2\n"
+                        "  # a comment\n"
+                        "\n"
+                        "add 'a b' \"c\\\"d\" -v\n"
+                        "bogus\n"
+                        "fail\n"
+                        "add x\n"
+                        "noop\n"
+                        "add 3 4\n"
+                        "add -h\n");
+  std::ostringstream out;
+  unsigned failed = parser25.parse_batch(in, "traffic_batch", out, [&](ts::Arguments const &args) { current = &args; });
+  REQUIRE(failed == 4);
+  REQUIRE(calls == std::vector<std::string>{"1+2", "a b+c\"d verbose", "3+4"});
+  std::string output = out.str();
+  std::string errors = output.substr(0, output.find("\nCommands"));
+  REQUIRE(errors == "line 5: Error: Unknown command, option or args: 'bogus'\n"
+                    "line 6: Error: failed\n"
+                    "line 7: Error: 2 argument(s) expected by add\n"
+                    "line 8: Error: no function to invoke\n");
+  // the help message of the line, then nothing else
+  REQUIRE(output.find("add two things") != std::string::npos);
+}
+
+TEST_CASE("Executor test", "[executor]")
+{
+  ts::ArgParser parser26;
+  thread_local ts::Arguments const *current = nullptr;
+  std::mutex mutex;
+  std::vector<std::string> calls;
+  parser26.add_command("check", "check a host", "", 1, [&]() {
+    std::string_view host = current->get("check").value();
+    if (host == "bad") {
+      throw std::runtime_error("cannot reach bad");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(host.size()));
+    std::lock_guard<std::mutex> lock(mutex);
+    calls.emplace_back(host);
+  });
+  parser26.add_command("noop", "no function");
+  std::atomic<unsigned> pings{0};
+  parser26.add_command("ping", "count a call", "", 0, [&]() { pings++; });
+
+  std::vector<ts::Arguments> batch;
+  const char *noop_argv[] = {"traffic_check", "noop", NULL};
+  for (unsigned i = 0; i < 40; i++) {
+    std::string host   = i == 7 ? "bad" : "host" + std::string(i % 5 * 4, 'x');
+    const char *argv[] = {"traffic_check", "check", host.c_str(), NULL};
+    batch.push_back(i == 11 ? parser26.parse(noop_argv) : parser26.parse(argv));
+  }
+  auto each = [](ts::Arguments const &args) { current = &args; };
+
+  ts::Executor executor(4);
+  REQUIRE(executor.concurrency() == 4);
+  std::vector<ts::ActionResult> results = executor.run(batch, ts::Executor::ORDERED, each);
+  REQUIRE(results.size() == 40);
+  for (unsigned i = 0; i < results.size(); i++) {
+    REQUIRE(results[i].index == i);
+    REQUIRE(results[i].ok == (i != 7 && i != 11));
+  }
+  REQUIRE(results[7].error == "cannot reach bad");
+  REQUIRE_THROWS_AS(std::rethrow_exception(results[7].exception), std::runtime_error);
+  REQUIRE(results[11].error == "no function to invoke");
+  REQUIRE(calls.size() == 38);
+
+  // all of them, in any order, several times in a row
+  for (unsigned round = 0; round < 3; round++) {
+    calls.clear();
+    std::vector<bool> seen(batch.size());
+    executor.run(
+      batch, [&](ts::ActionResult const &result) { seen[result.index] = true; }, ts::Executor::UNORDERED, each);
+    REQUIRE(std::count(seen.begin(), seen.end(), true) == 40);
+    REQUIRE(calls.size() == 38);
+  }
+
+  // the functions waiting in parallel
+  std::vector<ts::Arguments> slow;
+  std::string host(50, 'x');
+  const char *argv[] = {"traffic_check", "check", host.c_str(), NULL};
+  for (unsigned i = 0; i < 8; i++) {
+    slow.push_back(parser26.parse(argv));
+  }
+  auto start = std::chrono::steady_clock::now();
+  executor.run(slow, ts::Executor::UNORDERED, each);
+  REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(8 * 50));
+
+  // an empty batch, and an exception thrown by done
+  std::vector<ts::Arguments> empty;
+  REQUIRE(executor.run(empty).empty());
+  REQUIRE_THROWS_AS(executor.run(
+                      batch, [](ts::ActionResult const &) { throw std::logic_error("done"); }, ts::Executor::ORDERED, each),
+                    std::logic_error);
+
+  // many small batches back to back, the threads still looking for more of one batch when the next one is set up
+  const char *ping_argv[] = {"traffic_check", "ping", NULL};
+  ts::Arguments ping      = parser26.parse(ping_argv);
+  ts::Executor stress(8);
+  unsigned expected = 0;
+  unsigned ok       = 0;
+  for (unsigned round = 0; round < 5000; round++) {
+    std::vector<ts::Arguments> small(round % 3 + 1, ping);
+    expected += small.size();
+    for (ts::ActionResult const &result : stress.run(small)) {
+      ok += result.ok;
+    }
+  }
+  REQUIRE(ok == expected);
+  REQUIRE(pings == expected);
+}
+
+TEST_CASE("Parse cache test", "[cache]")
+{
+  ts::ArgParser parser27;
+  parser27.add_option("--verbose", "-v", "verbose");
+  parser27.add_command("stats", "dump the metrics", "", 0);
+  parser27.add_command("check", "check a host", "ENV_CACHE_HOST", 0);
+  parser27.allow_response_files();
+  ts::ParseError error;
+
+  // without a cache, every command line is parsed
+  const char *stats_argv[] = {"traffic_ctl", "stats", "-v", NULL};
+  auto first               = parser27.parse_cached(3, stats_argv, error);
+  REQUIRE(!error);
+  REQUIRE(first->get("verbose"));
+  REQUIRE(parser27.cache_stats().misses == 0);
+
+  parser27.enable_cache(2);
+  first       = parser27.parse_cached(3, stats_argv, error);
+  auto second = parser27.parse_cached(3, stats_argv, error);
+  REQUIRE(!error);
+  REQUIRE(first == second);
+  REQUIRE(second->get("stats"));
+  REQUIRE(second->get("verbose"));
+  REQUIRE(parser27.cache_stats().hits == 1);
+  REQUIRE(parser27.cache_stats().misses == 1);
+
+  // the same arguments in another order, or split differently, are another command line
+  const char *reordered_argv[] = {"traffic_ctl", "-v", "stats", NULL};
+  const char *joined_argv[]    = {"traffic_ctl", "stats -v", NULL};
+  REQUIRE(parser27.parse_cached(3, reordered_argv, error) != first);
+  parser27.parse_cached(2, joined_argv, error);
+  REQUIRE(error);
+  REQUIRE(parser27.cache_stats().size == 2);
+
+  // the values of the environment variables looked up are part of the key
+  setenv("ENV_CACHE_HOST", "a.example", 1);
+  const char *check_argv[] = {"traffic_ctl", "check", NULL};
+  auto a                   = parser27.parse_cached(2, check_argv, error);
+  REQUIRE(!error);
+  REQUIRE(a->get("check").env() == "a.example");
+  REQUIRE(parser27.parse_cached(2, check_argv, error) == a);
+  setenv("ENV_CACHE_HOST", "b.example", 1);
+  auto b = parser27.parse_cached(2, check_argv, error);
+  REQUIRE(b != a);
+  REQUIRE(b->get("check").env() == "b.example");
+  REQUIRE(a->get("check").env() == "a.example");
+  unsetenv("ENV_CACHE_HOST");
+
+  // the least recently used command line is dropped
+  REQUIRE(parser27.cache_stats().size == 2);
+  REQUIRE(parser27.parse_cached(3, stats_argv, error) != first);
+  ts::ArgParser::CacheStats stats = parser27.cache_stats();
+  REQUIRE(stats.hits == 2);
+  REQUIRE(stats.misses == 6);
+  REQUIRE(stats.size == 2);
+
+  // a response file is read each time
+  const char *file_argv[] = {"traffic_ctl", "@/nonexistent/args", NULL};
+  parser27.parse_cached(2, file_argv, error);
+  REQUIRE(error.kind == ts::ParseError::INVALID_ARGV);
+  REQUIRE(parser27.cache_stats().misses == 6);
+
+  // the cached Arguments outlive the cache
+  parser27.clear_cache();
+  REQUIRE(parser27.cache_stats().size == 0);
+  REQUIRE(first->get("verbose"));
+
+  // shared by several threads, each changing copies of the cached Arguments in an arena of their own
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> wrong{0};
+  for (unsigned t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      for (unsigned i = 0; i < 200; i++) {
+        const char *argv[] = {"traffic_ctl", (i + t) % 3 ? "stats" : "-v", (i + t) % 3 ? "-v" : "stats", NULL};
+        auto args          = parser27.parse_cached(3, argv);
+        ts::Arguments copy = *args;
+        copy.append_arg("tag", std::to_string(t));
+        copy.set_env("stats", "thread");
+        wrong += !args->get("stats") || args->get("tag") || copy.get("tag").value_view() != std::to_string(t);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(wrong == 0);
+  stats = parser27.cache_stats();
+  REQUIRE(stats.hits + stats.misses == 8 + 800);
+  REQUIRE(stats.size == 2);
+}
+
+TEST_CASE("Apply test", "[apply]")
+{
+  ts::ArgParser parser28;
+  parser28.add_option("--globalx", "-x", "two values", "", 2);
+  parser28.add_option("--log", "-l", "the log level", "ENV_APPLY_LOG", 1, "info");
+  parser28.add_typed_option("--workers", "-w", "the worker threads", ts::ValueType::UNSIGNED, "", 1, "4");
+  ts::ArgParser::Command &run = parser28.add_command("run", "run the server");
+  run.add_option("--port", "-p", "the port", "", 1, "80");
+  run.add_option("--tags", "-t", "tags", "", MORE_THAN_ZERO_ARG_N);
+  parser28.add_command("stop", "stop the server").add_option("--force", "-f", "force");
+  ts::ParseError error;
+
+  const char *argv[] = {"traffic_server", "run", "-x", "a", "b", "--port=8080", "-t", "web", NULL};
+  ts::Arguments args = parser28.parse(argv);
+  REQUIRE(args.get("workers").as_unsigned() == 4);
+
+  // only the values that differ are reported
+  const char *delta1[] = {"--globalx", "a", "c", "--port", "8080", "-w", "16", "--tags", "web", "api"};
+  auto changed         = parser28.apply(args, 10, delta1, error);
+  REQUIRE(!error);
+  REQUIRE(changed == std::vector<std::string_view>{"globalx", "workers", "tags"});
+  REQUIRE(args.get("globalx")[1] == "c");
+  REQUIRE(args.get("port").value() == "8080");
+  REQUIRE(args.get("workers").as_unsigned() == 16);
+  REQUIRE(std::vector<std::string_view>(args.get("tags").begin(), args.get("tags").end()) ==
+          std::vector<std::string_view>{"web", "api"});
+  // the others are untouched
+  REQUIRE(args.get("log").value() == "info");
+  REQUIRE(args.get("run"));
+  REQUIRE(!args.get("stop"));
+
+  // an option given for the first time, with its environment variable
+  setenv("ENV_APPLY_LOG", "from_env", 1);
+  const char *delta2[] = {"--log=debug", "--globalx=d", "--globalx=e"};
+  changed              = parser28.apply(args, 3, delta2, error);
+  unsetenv("ENV_APPLY_LOG");
+  REQUIRE(!error);
+  REQUIRE(changed == std::vector<std::string_view>{"log", "globalx"});
+  REQUIRE(args.get("log").value() == "debug");
+  REQUIRE(args.get("log").env() == "from_env");
+  REQUIRE(args.get("globalx").size() == 2);
+  REQUIRE(args.get("globalx")[0] == "d");
+
+  // an error leaves the arguments as they were
+  ts::Arguments before = args;
+  const char *delta3[] = {"-p", "1", "-w", "many"};
+  REQUIRE(parser28.apply(args, 4, delta3, error).empty());
+  REQUIRE(error.kind == ts::ParseError::INVALID_VALUE);
+  REQUIRE(error.token == 3);
+  REQUIRE(args.get("port").value() == "8080");
+  REQUIRE(args.get("workers").as_unsigned() == 16);
+  const char *delta4[] = {"-p", "1", "--force"};
+  parser28.apply(args, 3, delta4, error);
+  REQUIRE(error.kind == ts::ParseError::UNKNOWN_ARGUMENT);
+  REQUIRE(error.token == 2);
+  REQUIRE(error.message == "Unknown option or args: '--force'");
+  REQUIRE(args.get("port").value() == "8080");
+  const char *delta5[] = {"--globalx=f"};
+  parser28.apply(args, 1, delta5, error);
+  REQUIRE(error.kind == ts::ParseError::ARGUMENT_NUMBER);
+  REQUIRE(args.get("globalx")[1] == "e");
+  const char *delta6[] = {"-x", "g"};
+  parser28.apply(args, 2, delta6, error);
+  REQUIRE(error.kind == ts::ParseError::MISSING_ARGUMENT);
+  REQUIRE(error.token == 2);
+  REQUIRE(args.get("globalx")[0] == "d");
+  // neither are the copies made before
+  const char *delta7[] = {"-p", "443"};
+  REQUIRE(parser28.apply(args, 2, delta7, error) == std::vector<std::string_view>{"port"});
+  REQUIRE(before.get("port").value() == "8080");
+
+  // the Arguments of another parser
+  ts::ArgParser other;
+  other.add_option("--port", "-p", "the port", "", 1);
+  const char *other_argv[] = {"traffic_other", "-p", "80", NULL};
+  ts::Arguments foreign    = other.parse(other_argv);
+  parser28.apply(foreign, 2, delta7, error);
+  REQUIRE(error.kind == ts::ParseError::INVALID_ARGV);
+
+  // applied to copies of a cached result by several threads, each copy leaves the arena shared with the cache
+  parser28.enable_cache(4);
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> wrong{0};
+  for (unsigned t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      ts::ParseError thread_error;
+      std::string port    = std::to_string(8000 + t);
+      const char *delta[] = {"-p", port.c_str(), "--tags", "web", "api"};
+      for (unsigned i = 0; i < 200; i++) {
+        auto cached        = parser28.parse_cached(8, argv);
+        ts::Arguments copy = *cached;
+        parser28.apply(copy, 5, delta, thread_error);
+        wrong += thread_error || copy.get("port").value_view() != port || cached->get("port").value_view() != "8080" ||
+                 cached->get("tags").size() != 1;
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(wrong == 0);
+}
+
+TEST_CASE("Constraint test", "[constraint]")
+{
+  ts::ArgParser parser29;
+  parser29.add_option("--json", "-j", "output json");
+  parser29.add_option("--yaml", "-y", "output yaml");
+  parser29.add_option("--text", "-t", "output text");
+  // enough options for a constraint to span several words
+  for (unsigned i = 0; i < 80; i++) {
+    parser29.add_option("--fill" + std::to_string(100 + i), "", "filler");
+  }
+  parser29.add_option("--cert", "-c", "the certificate", "", 1);
+  parser29.add_option("--key", "-k", "the private key", "", 1);
+  parser29.add_option("--tls", "-s", "use tls");
+  parser29.add_typed_option("--port", "-p", "the port", ts::ValueType::UNSIGNED, "", 1, "8080");
+  parser29.add_typed_option("--timeout", "-o", "the timeout", ts::ValueType::DURATION);
+  parser29.mutually_exclusive({"--json", "--yaml", "--text"});
+  parser29.option_requires("--tls", {"--cert", "--key"});
+  parser29.set_range("--port", "1", "65535").set_range("--timeout", "10ms", "");
+  ts::ArgParser::Command &fetch = parser29.add_command("fetch", "fetch a url");
+  fetch.add_option("--url", "-u", "the url", "", 1);
+  fetch.add_option("--file", "-f", "a file of urls", "", 1);
+  fetch.require_one_of({"--url", "--file"});
+  parser29.add_command("list", "list the urls");
+
+  ts::ParseError error;
+  auto check = [&](std::vector<const char *> argv, ts::ParseError::Kind kind, std::string const &msg) {
+    argv.push_back(nullptr);
+    parser29.parse(argv.data(), error);
+    REQUIRE(error.kind == kind);
+    REQUIRE(error.message == msg);
+  };
+  check({"traffic_cons", "list", "-j", "--tls", "-c", "a", "-k", "b"}, ts::ParseError::NONE, "");
+  check({"traffic_cons", "list", "-j", "-t"}, ts::ParseError::CONSTRAINT, "--json, --text cannot be given together");
+  check({"traffic_cons", "-t", "list", "--yaml", "-j"}, ts::ParseError::CONSTRAINT,
+        "--json, --text, --yaml cannot be given together");
+  check({"traffic_cons", "list", "--tls"}, ts::ParseError::CONSTRAINT, "--tls requires --cert, --key");
+  check({"traffic_cons", "list", "--tls", "--key", "k"}, ts::ParseError::CONSTRAINT, "--tls requires --cert");
+  // the options required alone are fine
+  check({"traffic_cons", "list", "--cert", "c"}, ts::ParseError::NONE, "");
+  // only the constraints of the commands called are checked
+  check({"traffic_cons", "fetch"}, ts::ParseError::CONSTRAINT, "one of --file, --url is required");
+  check({"traffic_cons", "fetch", "-u", "http://a"}, ts::ParseError::NONE, "");
+  // the numeric ranges, of the default values too
+  check({"traffic_cons", "list", "-p", "0"}, ts::ParseError::INVALID_VALUE,
+        "invalid value '0' for --port: not between 1 and 65535");
+  check({"traffic_cons", "list", "-p", "65536"}, ts::ParseError::INVALID_VALUE,
+        "invalid value '65536' for --port: not between 1 and 65535");
+  check({"traffic_cons", "list", "-o", "5ms"}, ts::ParseError::INVALID_VALUE, "invalid value '5ms' for --timeout: less than 10ms");
+  check({"traffic_cons", "list", "-o", "1m", "-p", "65535"}, ts::ParseError::NONE, "");
+  REQUIRE(error.token == 0);
+  const char *ranged[] = {"traffic_cons", "list", NULL};
+  REQUIRE(parser29.parse(ranged).get("port").as_unsigned() == 8080);
+
+  // the constraints of the options of a delta
+  const char *argv[]   = {"traffic_cons", "list", "-j", NULL};
+  ts::Arguments args   = parser29.parse(argv);
+  const char *delta1[] = {"--yaml"};
+  parser29.apply(args, 1, delta1, error);
+  REQUIRE(error.kind == ts::ParseError::CONSTRAINT);
+  REQUIRE(!args.get("yaml"));
+  const char *delta2[] = {"--tls", "-c", "a", "-k", "b", "-p", "443"};
+  REQUIRE(parser29.apply(args, 7, delta2, error).size() == 4);
+  REQUIRE(!error);
+  const char *delta3[] = {"-k", "c", "-p", "0"};
+  parser29.apply(args, 4, delta3, error);
+  REQUIRE(error.kind == ts::ParseError::INVALID_VALUE);
+  REQUIRE(args.get("key").value() == "b");
+  // a failed delta keeps the options given before
+  const char *delta4[] = {"-y"};
+  parser29.apply(args, 1, delta4, error);
+  REQUIRE(error.kind == ts::ParseError::CONSTRAINT);
+
+  // at compile time
+  static constexpr ts::SchemaDef defs[] = {
+    ts::SchemaDef::option("", "--json", "-j", "output json"),
+    ts::SchemaDef::option("", "--yaml", "-y", "output yaml"),
+    ts::SchemaDef::option("", "--tls", "-s", "use tls"),
+    ts::SchemaDef::option("", "--cert", "-c", "the certificate", "", 1),
+    ts::SchemaDef::typed_option("", "--port", "-p", "the port", ts::ValueType::UNSIGNED).set_range("1", "65535"),
+    ts::SchemaDef::mutually_exclusive("", "--json --yaml"),
+    ts::SchemaDef::option_requires("", "--tls", "--cert"),
+    ts::SchemaDef::command("fetch", "fetch a url"),
+    ts::SchemaDef::option("fetch", "--url", "-u", "the url", "", 1),
+    ts::SchemaDef::require_one_of("fetch", "--url")};
+  static constexpr ts::StaticSchema schema(defs);
+  static_assert(schema.constraint_count == 3);
+  static_assert(schema.commands[0].constraint_end == 2);
+  ts::ArgParser parser30(schema);
+  const char *argv1[] = {"traffic_cons", "-j", "-y", NULL};
+  parser30.parse(argv1, error);
+  REQUIRE(error.message == "--json, --yaml cannot be given together");
+  const char *argv2[] = {"traffic_cons", "-s", "-c", "c", "fetch", NULL};
+  parser30.parse(argv2, error);
+  REQUIRE(error.message == "one of --url is required");
+  const char *argv3[] = {"traffic_cons", "-s", "-p", "0", NULL};
+  parser30.parse(argv3, error);
+  REQUIRE(error.message == "invalid value '0' for --port: not between 1 and 65535");
+  const char *argv4[] = {"traffic_cons", "-s", "fetch", "-u", "u", NULL};
+  parser30.parse(argv4, error);
+  REQUIRE(error.message == "--tls requires --cert");
+}
+
+TEST_CASE("Wide command tree test", "[dispatch]")
+{
+  ts::ArgParser parser31;
+  for (unsigned i = 0; i < 2000; i++) {
+    ts::ArgParser::Command &command = parser31.add_command("plugin" + std::to_string(i), "plugin command", "", 0, nullptr,
+                                                           "plugin" + std::to_string(i));
+    command.add_command("run", "run it").add_option("--path", "-p", "the path", "", 1, "/default");
+  }
+  parser31.add_typed_option("--count", "-c", "a count", ts::ValueType::UNSIGNED);
+  parser31.freeze();
+  // the options with a default value or a type of the top level command, a plugin and run
+  REQUIRE(parser31.schema()->implied_key_count == 2);
+
+  const char *argv1[] = {"traffic_wide", "plugin1000", "run", "-c", "3", NULL};
+  ts::Arguments args  = parser31.parse(argv1);
+  REQUIRE(args.get("plugin1000"));
+  REQUIRE(args.get("run"));
+  REQUIRE(args.get("path").value() == "/default");
+  REQUIRE(args.get(parser31.key("count")).as_unsigned() == 3);
+  REQUIRE_FALSE(args.get("plugin999"));
+  REQUIRE_FALSE(args.get(parser31.key("plugin1001")));
+
+  // a key of the schema the parse did not give, appended afterwards
+  args.append_arg("plugin7", "extra");
+  REQUIRE(args.get("plugin7")[0] == "extra");
+  REQUIRE(args.get(parser31.key("plugin7"))[0] == "extra");
+
+  // a copy keeps the data it had when the original is applied a delta
+  ts::Arguments copy  = args;
+  const char *delta[] = {"--path", "/other"};
+  ts::ParseError error;
+  parser31.apply(args, 2, delta, error);
+  REQUIRE(!error);
+  REQUIRE(args.get("path").value() == "/other");
+  REQUIRE(copy.get("path").value() == "/default");
+  REQUIRE(copy.get("count").as_unsigned() == 3);
+
+  ts::Arguments moved = std::move(copy);
+  REQUIRE(moved.get("plugin1000"));
+}
+
+TEST_CASE("Lazy command test", "[lazy]")
+{
+  ts::ArgParser parser32;
+  parser32.add_global_usage("traffic_lazy [OPTIONS] CMD [ARGS ...]");
+  parser32.add_option("--help", "-h", "help");
+  std::atomic<unsigned> built{0};
+  int ran = 0;
+  for (std::string name : {"alpha", "beta", "gamma", "delta"}) {
+    parser32.add_command(name, "plugin " + name, [&built, &ran, name](ts::ArgParser::Command &command) {
+      built++;
+      command.add_option("--path", "-p", "the path of " + name, "", 1, "/default");
+      command.add_command("run", "run " + name, [&ran]() { ran++; }, "run_" + name);
+      // a lazy command can add lazy ones
+      command.add_command("nested", "nested in " + name, [](ts::ArgParser::Command &nested) {
+        nested.add_option("--deep", "", "deep option");
+      });
+    });
+  }
+  parser32.freeze();
+  REQUIRE(parser32.schema()->commands[1].lazy);
+  ts::Schema const *frozen = parser32.schema();
+  ts::ArgKey delta_key     = parser32.key("delta");
+
+  // only the command entered is built, once
+  const char *argv1[] = {"traffic_lazy", "alpha", "run", "--path", "/a", NULL};
+  ts::Arguments args  = parser32.parse(argv1);
+  REQUIRE(built == 1);
+  REQUIRE(args.get("alpha"));
+  REQUIRE(args.get("run_alpha"));
+  REQUIRE(args.get("path").value() == "/a");
+  args.invoke();
+  REQUIRE(ran == 1);
+  REQUIRE(parser32.parse(argv1).get("path").value() == "/a");
+  REQUIRE(built == 1);
+
+  // the help of a lazy command has its options
+  ts::ParseError error;
+  const char *argv2[] = {"traffic_lazy", "beta", "--help", NULL};
+  parser32.parse(argv2, error);
+  REQUIRE(error.kind == ts::ParseError::HELP);
+  REQUIRE(error.help().find("the path of beta") != std::string::npos);
+  REQUIRE(built == 2);
+
+  // completion builds the commands the words walk into, the nested one too
+  const char *argv3[]                      = {"traffic_lazy", "gamma", "nested", "--d", NULL};
+  std::vector<std::string_view> candidates = parser32.complete(4, argv3, 3);
+  REQUIRE(candidates == std::vector<std::string_view>{"--deep"});
+  REQUIRE(built == 3);
+
+  // the Arguments parsed before another command is built can still be applied a delta
+  const char *delta[] = {"--path", "/b"};
+  parser32.apply(args, 2, delta, error);
+  REQUIRE(!error);
+  REQUIRE(args.get("path").value() == "/b");
+
+  // concurrent parses entering the same lazy command build it once
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> found{0};
+  for (unsigned i = 0; i < 4; i++) {
+    threads.emplace_back([&parser32, &found]() {
+      const char *argv[] = {"traffic_lazy", "delta", "run", "-p", "/d", NULL};
+      ts::ParseError thread_error;
+      found += parser32.parse(argv, thread_error).get("run_delta") && !thread_error;
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(found == 4);
+  REQUIRE(built == 4);
+
+  // only the commands built are compiled, the rest of the schema is copied as it is, keys included
+  ts::Schema const *schema = parser32.schema();
+  REQUIRE(schema != frozen);
+  REQUIRE(schema->command_count == frozen->command_count + 4 * 2);
+  REQUIRE(schema->options[0].description.data() == frozen->options[0].description.data());
+  REQUIRE(schema->find_command(*schema->find_command(schema->commands[0], "alpha"), "nested")->lazy);
+  REQUIRE(schema->find_key("delta") == delta_key.id);
+  REQUIRE(!schema->commands[1].lazy);
+
+  // the commands defined are left as they are, the copies of the parser build them again
+  ts::ArgParser parser43 = parser32;
+  parser43.freeze();
+  REQUIRE(parser43.schema()->commands[1].lazy);
+  REQUIRE(parser43.parse(argv1).get("path").value() == "/a");
+  REQUIRE(built == 5);
+  REQUIRE(parser32.parse(argv1).get("run_alpha"));
+  REQUIRE(built == 5);
+}
+
+TEST_CASE("Parser copy test", "[freeze]")
+{
+  ts::ArgParser parser33;
+  parser33.add_option("--verbose", "-v", "verbose");
+  parser33.add_command("stats", "dump the metrics", "", 0);
+  parser33.enable_cache(4);
+  const char *argv1[] = {"traffic_copy", "stats", "-v", NULL};
+  REQUIRE(parser33.parse(argv1).get("verbose"));
+
+  // a copy of a frozen parser is not frozen, and has a cache of its own
+  ts::ArgParser parser34 = parser33;
+  REQUIRE(parser34.schema() == nullptr);
+  parser34.add_command("check", "check a host", "", 1);
+  const char *argv2[] = {"traffic_copy", "check", "h1", NULL};
+  ts::ParseError error;
+  REQUIRE(parser34.parse(argv2, error).get("check").value() == "h1");
+  REQUIRE(!error);
+  REQUIRE(parser34.parse_cached(3, argv1)->get("stats"));
+  REQUIRE(parser34.cache_stats().misses == 1);
+  REQUIRE(parser33.cache_stats().misses == 0);
+  parser33.parse(argv2, error);
+  REQUIRE(error.kind == ts::ParseError::UNKNOWN_ARGUMENT);
+
+  // what is added after the parser is frozen is left out, and reported by the parses since
+  parser33.add_option("--late", "-l", "added too late");
+  parser33.add_command("late", "added too late").add_option("--later", "", "added too late as well");
+  parser33.parse(argv1, error);
+  REQUIRE(error.kind == ts::ParseError::FROZEN);
+  REQUIRE(error.message == "option '--late' added after the parser is frozen");
+  REQUIRE(error.return_code() == 1);
+  REQUIRE(parser33.schema()->find_option(parser33.schema()->commands[0], "--late") == nullptr);
+  parser33.parse_cached(3, argv1, error);
+  REQUIRE(error.kind == ts::ParseError::FROZEN);
+
+  // the copy of such a parser has what was added before it was frozen only
+  parser34 = parser33;
+  REQUIRE(parser34.parse(argv1, error).get("stats"));
+  REQUIRE(!error);
+
+  // a copy of a parser for a schema defined at compile time is frozen as well
+  ts::ArgParser parser35(static_schema);
+  ts::ArgParser parser36 = parser35;
+  REQUIRE(parser36.schema() == &static_schema);
+  const char *argv3[] = {"traffic_copy", "-x", "a", "b", NULL};
+  REQUIRE(parser36.parse(argv3).get("globalx_key").at(1) == "b");
+  parser36.add_option("--late", "-l", "added too late");
+  parser36.parse(argv3, error);
+  REQUIRE(error.kind == ts::ParseError::FROZEN);
+}
+
+TEST_CASE("Benchmark workload test", "[bench]")
+{
+  // the command lines of benchmark_ArgParser.cc parse without an error, into the values they give
+  ts::ArgParser parser37;
+  parser37.add_option("--verbose", "-v", "verbose");
+  parser37.add_command("get", "get the values", "", MORE_THAN_ZERO_ARG_N);
+  for (unsigned i = 0; i < 100; i++) {
+    parser37.add_option("--option" + std::to_string(i), "", "option " + std::to_string(i), "", 1);
+  }
+  ts::ArgParser::Command *command = &parser37.add_command("nest0", "nested 0");
+  for (unsigned i = 1; i < 16; i++) {
+    command->add_option("--nest" + std::to_string(i - 1), "", "nested option", "", 1);
+    command = &command->add_command("nest" + std::to_string(i), "nested " + std::to_string(i));
+  }
+  parser37.freeze();
+
+  std::vector<std::string> storage;
+  auto make_argv = [&](std::vector<std::string> args) {
+    storage                        = std::move(args);
+    std::vector<const char *> argv = {"traffic_bench"};
+    for (auto const &arg : storage) {
+      argv.push_back(arg.c_str());
+    }
+    argv.push_back(NULL);
+    return argv;
+  };
+  ts::ParseError error;
+
+  // argv length
+  std::vector<std::string> values = {"get"};
+  for (unsigned i = 1; i < 10000; i++) {
+    values.push_back("proxy.config.value." + std::to_string(i));
+  }
+  std::vector<const char *> argv = make_argv(values);
+  ts::Arguments args             = parser37.parse_view(argv.size() - 1, argv.data(), error);
+  REQUIRE(!error);
+  REQUIRE(args.get("get").size() == 9999);
+  REQUIRE(args.get("get").at_view(9998) == "proxy.config.value.9999");
+
+  // --opt value and --opt=value give the same values
+  std::vector<std::string> separate;
+  std::vector<std::string> joined;
+  for (unsigned i = 0; i < 100; i++) {
+    separate.push_back("--option" + std::to_string(i));
+    separate.push_back("value" + std::to_string(i));
+    joined.push_back("--option" + std::to_string(i) + "=value" + std::to_string(i));
+  }
+  argv                        = make_argv(separate);
+  ts::Arguments separate_args = parser37.parse(argv.data(), error);
+  REQUIRE(!error);
+  argv                      = make_argv(joined);
+  ts::Arguments joined_args = parser37.parse(argv.data(), error);
+  REQUIRE(!error);
+  for (unsigned i = 0; i < 100; i++) {
+    std::string key = "option" + std::to_string(i);
+    REQUIRE(separate_args.get(key).value() == "value" + std::to_string(i));
+    REQUIRE(joined_args.get(key).value() == separate_args.get(key).value());
+  }
+
+  // the options of every level given at the deepest one
+  std::vector<std::string> nested;
+  for (unsigned i = 0; i < 16; i++) {
+    nested.push_back("nest" + std::to_string(i));
+  }
+  for (unsigned i = 0; i + 1 < 16; i++) {
+    nested.push_back("--nest" + std::to_string(i));
+    nested.push_back("value" + std::to_string(i));
+  }
+  nested.push_back("-v");
+  argv                      = make_argv(nested);
+  ts::Arguments nested_args = parser37.parse_view(argv.size() - 1, argv.data(), error);
+  REQUIRE(!error);
+  REQUIRE(nested_args.get("nest15"));
+  REQUIRE(nested_args.get("nest0").value() == "value0");
+  REQUIRE(nested_args.get("nest14").value() == "value14");
+  REQUIRE(nested_args.get("verbose"));
+
+  // the schemas built
+  ts::ArgParser parser38;
+  for (unsigned i = 0; i < 1000; i++) {
+    ts::ArgParser::Command &command = parser38.add_command("command" + std::to_string(i), "command");
+    command.add_option("--path", "-p", "the path", "", 1);
+    command.add_option("--host", "-H", "the host", "", 1);
+    command.add_option("--force", "-f", "force");
+    command.add_option("--tags", "-t", "the tags", "", MORE_THAN_ONE_ARG_N);
+  }
+  parser38.freeze();
+  REQUIRE(parser38.schema()->command_count == 1001);
+  REQUIRE(parser38.schema()->option_count == 4000);
+}
+
+TEST_CASE("Help rendering test", "[help]")
+{
+  ts::ArgParser parser39;
+  parser39.add_global_usage("traffic_help [--SWITCH [ARG]]");
+  parser39.add_option("--help", "-h", "show the help");
+  parser39.add_option("--tag", "-t", "the tags", "", 2, "t1 t2");
+  parser39.add_option("--url", "", "the urls", "", MORE_THAN_ONE_ARG_N);
+  parser39.add_command("run", "run something").add_example_usage("traffic_help run now");
+  parser39.add_command("a_command_with_a_name_too_long_for_the_column", "long one");
+  parser39.freeze();
+  ts::Schema const &schema = *parser39.schema();
+
+  // the columns of the layout, a name too long for its column pushing the next one to the next line
+  std::string expected;
+  expected.append("\nUsage: traffic_help [--SWITCH [ARG]]\n");
+  expected.append("\nCommands ---------------------- Description -----------------------\n");
+  expected.append("  a_command_with_a_name_too_long_for_the_column\n").append(INDENT_ONE, ' ').append("long one\n");
+  expected.append("  run").append(INDENT_ONE - 5, ' ').append("run something\n");
+  expected.append("\nOptions ======================= Default ===== Description =============\n");
+  expected.append("-h, --help").append(INDENT_TWO - 10, ' ').append("show the help\n");
+  expected.append("-t, --tag <arg1> ... <arg2>").append(INDENT_ONE - 27, ' ').append("t1 t2");
+  expected.append(INDENT_TWO - INDENT_ONE - 5, ' ').append("the tags\n");
+  expected.append("--url <arg> ...").append(INDENT_TWO - 15, ' ').append("the urls\n");
+  std::string rendered;
+  schema.render_help(rendered, schema.commands[0]);
+  REQUIRE(rendered == expected);
+
+  // written to any stream at once
+  struct CountingBuffer : std::stringbuf {
+    unsigned writes = 0;
+    std::streamsize
+    xsputn(const char *s, std::streamsize n) override
+    {
+      writes++;
+      return std::stringbuf::xsputn(s, n);
+    }
+  } buffer;
+  std::ostream out(&buffer);
+  schema.output_help(out, schema.commands[0], "bad usage");
+  REQUIRE(buffer.str() == "Error: bad usage\n" + expected);
+  REQUIRE(buffer.writes == 1);
+
+  // the help of a subcommand has its example usage, and is the same every time
+  const char *argv1[] = {"traffic_help", "run", "--help", NULL};
+  ts::ParseError error;
+  parser39.parse(argv1, error);
+  REQUIRE(error.kind == ts::ParseError::HELP);
+  std::string help = error.help();
+  REQUIRE(help.find("\nExample Usage: traffic_help run now\n") != std::string::npos);
+  REQUIRE(help.find("long one") == std::string::npos);
+  parser39.parse(argv1, error);
+  REQUIRE(error.help() == help);
+}
+
+TEST_CASE("Inline value test", "[inline]")
+{
+  ts::ArgParser parser42;
+  parser42.add_option("--name", "-n", "the name", "", 1);
+  parser42.add_option("--pair", "-p", "two values", "", 2);
+  const char *argv[] = {"traffic_inline", "-n", "n1", "-p", "a", "b", NULL};
+
+  // a single value is held in the data itself, a view into argv
+  ts::Arguments parsed_data    = parser42.parse_view(6, argv);
+  ts::ArgumentData const &name = parsed_data.get("name");
+  REQUIRE(name.size() == 1);
+  REQUIRE(name.value_view().data() == argv[2]);
+  REQUIRE(std::distance(name.begin(), name.end()) == 1);
+  REQUIRE(name.begin()->data() == argv[2]);
+  REQUIRE(name.value() == "n1");
+
+  // a copy holds its single value inline too, a view into a string of its own that outlives the Arguments
+  ts::ArgumentData copy = name;
+  REQUIRE(copy.value_view() == "n1");
+  REQUIRE(copy.value_view().data() != argv[2]);
+  parsed_data = ts::Arguments();
+  REQUIRE(copy.value() == "n1");
+  REQUIRE(copy.value_view().data() == copy.value().data());
+
+  // a single value moves into an array as values are appended, whose capacity doubles
+  parsed_data = parser42.parse_view(6, argv);
+  for (unsigned i = 2; i <= 9; i++) {
+    parsed_data.append_arg("name", "n" + std::to_string(i));
+    REQUIRE(parsed_data.get("name").size() == i);
+    REQUIRE(parsed_data.get("name").at_view(i - 1) == "n" + std::to_string(i));
+  }
+  REQUIRE(parsed_data.get("name").at_view(0).data() == argv[2]);
+  ts::ArgumentData many = parsed_data.get("name");
+  REQUIRE(std::vector<std::string>(many.begin(), many.end()) ==
+          std::vector<std::string>{"n1", "n2", "n3", "n4", "n5", "n6", "n7", "n8", "n9"});
+  // and a copy of the pair owns its array
+  ts::ArgumentData pair = parser42.parse(argv).get("pair");
+  REQUIRE(pair.size() == 2);
+  REQUIRE(pair[1] == "b");
+
+  // an array assigned over a single value, moved, then a single value assigned over it
+  copy = many;
+  REQUIRE(copy.size() == 9);
+  REQUIRE(copy[4] == "n5");
+  REQUIRE(copy.at_view(4).data() != many.at_view(4).data());
+  ts::ArgumentData moved = std::move(copy);
+  REQUIRE(moved.size() == 9);
+  REQUIRE(moved.at_view(8) == "n9");
+  REQUIRE(copy.size() == 0);
+  REQUIRE(copy.begin() == copy.end());
+  ts::ArgumentData single = parser42.parse_view(6, argv).get("name");
+  moved                   = single;
+  REQUIRE(moved.size() == 1);
+  REQUIRE(moved.value() == "n1");
+  ts::ArgumentData &alias = moved;
+  moved                   = alias;
+  REQUIRE(moved.value_view() == "n1");
+  many = std::move(single);
+  REQUIRE(many.size() == 1);
+  REQUIRE(many.value() == "n1");
+  REQUIRE(single.empty());
+
+  // a data appended to the Arguments is copied into their storage
+  parsed_data = parser42.parse_view(6, argv);
+  parsed_data.append("name", moved);
+  moved = ts::ArgumentData();
+  REQUIRE(parsed_data.get("name").size() == 1);
+  REQUIRE(parsed_data.get("name").value() == "n1");
+  parsed_data.append("pair", parsed_data.get("pair"));
+  REQUIRE(parsed_data.get("pair").at_view(1).data() == argv[5]);
+}